@@ -0,0 +1,38 @@
+# Vapoursynth is optional.  Without it, scripts are piped in with vspipe.
+FIND_PATH(VAPOURSYNTH_INCLUDE_DIR VSScript4.h
+    PATHS
+    ~/Library/Frameworks
+    /Library/Frameworks
+    /usr/local/include
+    /usr/include
+    /sw/include # Fink
+    /opt/local/include # DarwinPorts
+    /opt/csw/include # Blastwave
+    /opt/include
+    /usr/freeware/include
+    PATH_SUFFIXES vapoursynth
+    DOC "Location of Vapoursynth Headers"
+)
+
+FIND_LIBRARY(VAPOURSYNTH_SCRIPT_LIBRARY vapoursynth-script
+    PATHS
+    ~/Library/Frameworks
+    /Library/Frameworks
+    /usr/local/lib
+    /usr/local/lib64
+    /usr/lib
+    /usr/lib64
+    /sw/lib
+    /opt/local/lib
+    /opt/csw/lib
+    /opt/lib
+    /usr/freeware/lib64
+    DOC "Location of Vapoursynth Script Library"
+)
+
+IF (VAPOURSYNTH_INCLUDE_DIR AND VAPOURSYNTH_SCRIPT_LIBRARY)
+    SET(VAPOURSYNTH_FOUND "YES")
+ELSE (VAPOURSYNTH_INCLUDE_DIR AND VAPOURSYNTH_SCRIPT_LIBRARY)
+    message(STATUS "Vapoursynth (VSScript4.h, libvapoursynth-script) not found.  "
+            "Building without .vpy input.")
+ENDIF (VAPOURSYNTH_INCLUDE_DIR AND VAPOURSYNTH_SCRIPT_LIBRARY)
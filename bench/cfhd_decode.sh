@@ -0,0 +1,27 @@
+#!/bin/sh
+# Compares the Cineform SDK decode path with the libavcodec one on a Cineform input,
+# re-encoding at full, half and quarter size.
+#
+# usage: bench/cfhd_decode.sh <cineform input> [cfenc binary] [quality]
+
+input="$1"
+cfenc="${2:-./build/cfenc}"
+quality="${3:-medium}"
+
+if [ -z "$input" ] || [ ! -f "$input" ]; then
+    echo "usage: $0 <cineform input> [cfenc binary] [quality]" >&2
+    exit 1
+fi
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+printf "%-8s %-8s %10s\n" decoder size fps
+for size in full half quarter; do
+    for decoder in ffmpeg sdk; do
+        fps=$("$cfenc" -l info -vo -decoder "$decoder" -size "$size" -q "$quality" \
+                  -i "$input" "$tmp/out.mov" 2>&1 |
+              sed -n "s|.*frames of '$tmp/out.mov' in .* (\(.*\) fps)|\1|p")
+        printf "%-8s %-8s %10s\n" "$decoder" "$size" "${fps:-failed}"
+    done
+done
@@ -0,0 +1,90 @@
+#!/bin/sh
+# Encodes synthetic clips made by ffmpeg's test source and compares the fps with a baseline.
+# The first run records the baseline; later runs fail when any clip's fps falls more than
+# <threshold> percent below it.  Each clip is encoded $RUNS times and the best fps counts,
+# which steadies the figures on a shared machine.  Baselines only compare on the same host.
+#
+# usage: bench/fps.sh [cfenc binary] [baseline file] [threshold %]
+#
+# environment: FFMPEG [ffmpeg], RUNS [3], FRAMES [240],
+#              CLIPS (a directory to keep the clips in between runs) [temporary]
+
+cfenc="${1:-./build/cfenc}"
+baseline="${2:-./build/fps_baseline.txt}"
+threshold="${3:-10}"
+ffmpeg="${FFMPEG:-ffmpeg}"
+runs="${RUNS:-3}"
+frames="${FRAMES:-240}"
+
+if [ ! -x "$cfenc" ]; then
+    echo "usage: $0 [cfenc binary] [baseline file] [threshold %]" >&2
+    exit 1
+fi
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+clips="${CLIPS:-$tmp}"
+mkdir -p "$clips"
+
+# name, then the ffmpeg output options; the clips cover the 8-bit, 10-bit and RGB paths
+make_clip() {
+    name="$1"
+    size="$2"
+    shift 2
+    [ -f "$clips/$name-$frames.mov" ] && return 0
+    "$ffmpeg" -v error -y -f lavfi -i "testsrc2=size=$size:rate=24" -frames:v "$frames" \
+        "$@" "$clips/$name-$frames.mov" || exit 1
+}
+
+make_clip yuv420p-1080 1920x1080 -pix_fmt yuv420p -c:v utvideo
+make_clip yuv422p10-2160 3840x2160 -pix_fmt yuv422p10le -c:v prores_ks -profile:v 3
+make_clip gbrp-1080 1920x1080 -pix_fmt gbrp -c:v utvideo
+
+# best fps of $runs encodes
+encode() {
+    best=0
+    i=0
+    while [ "$i" -lt "$runs" ]; do
+        fps=$("$cfenc" -l info -vo "$@" "$tmp/out.mov" 2>&1 |
+              sed -n "s|.*frames of '$tmp/out.mov' in .* (\(.*\) fps)|\1|p")
+        [ -z "$fps" ] && return 1
+        best=$(echo "$fps $best" | awk '{ print ($1 > $2) ? $1 : $2 }')
+        i=$((i + 1))
+    done
+    echo "$best"
+}
+
+: > "$tmp/fps.txt"
+for run in "yuv8 -i $clips/yuv420p-1080-$frames.mov" \
+           "yuv10 -i $clips/yuv422p10-2160-$frames.mov" \
+           "rgb -rgb -i $clips/gbrp-1080-$frames.mov" \
+           "proxies -i $clips/yuv422p10-2160-$frames.mov -o $tmp/half.mov,size=half"; do
+    set -- $run
+    name="$1"
+    shift
+    fps=$(encode "$@") || { echo "$name: encode failed" >&2; exit 1; }
+    echo "$name $fps" >> "$tmp/fps.txt"
+done
+
+if [ ! -f "$baseline" ]; then
+    cp "$tmp/fps.txt" "$baseline"
+    echo "Recorded the baseline in $baseline:"
+    cat "$baseline"
+    exit 0
+fi
+
+# clips missing from the baseline are shown but not judged
+awk -v threshold="$threshold" '
+    NR == FNR { base[$1] = $2; next }
+    {
+        if (! ($1 in base)) { printf "%-8s %10.2f fps  (no baseline)\n", $1, $2; next }
+        change = 100 * ($2 - base[$1]) / base[$1]
+        flag = change < -threshold ? "  REGRESSION" : ""
+        printf "%-8s %10.2f fps  baseline %10.2f  %+6.1f%%%s\n", $1, $2, base[$1], change, flag
+        if (flag != "") failed = 1
+    }
+    END { exit failed }
+' "$baseline" "$tmp/fps.txt" || {
+    echo "fps fell more than $threshold% below the baseline" >&2
+    exit 1
+}
@@ -18,10 +18,31 @@
 
 #include "version.h"
 #include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <getopt.h>
 #include <regex>
 #include <chrono>
 #include <thread>
+#include <mutex>
+#include <cstdio>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <map>
+#include <set>
 
 extern "C"
 {
@@ -29,21 +50,25 @@ extern "C"
     #include <libavformat/avformat.h>
     #include <libswscale/swscale.h>
     #include <libavutil/pixdesc.h>
+    #include <libavutil/imgutils.h>
+    #include <libavutil/parseutils.h>
+    #include <libavutil/murmur3.h>
 }
 
 #include <cineformsdk/CFHDEncoder.h>
+#include <cineformsdk/CFHDDecoder.h>
 #include <cineformsdk/CFHDMetadata.h>
 #include <cineformsdk/ver.h>
 
+#ifdef HAVE_VSSCRIPT
+    #include <VSScript4.h>
+#endif
+
 #ifdef __linux__
     #undef av_err2str
     #define av_err2str(errnum) av_make_error_string((char*)__builtin_alloca(AV_ERROR_MAX_STRING_SIZE), AV_ERROR_MAX_STRING_SIZE, errnum)
 #endif
 
-int g_width;
-int g_height;
-
-
 static void show_banner(void)
 {
     av_log(nullptr, AV_LOG_INFO,
@@ -73,9 +98,9 @@ static void show_usage(void)
     "-q, -quality <string>  Cineform encoding quality [fs1]\n"
     "                            - low, medium, high, fs1, fs2, fs3\n"
     "-rgb                   Encode RGB instead of YUV.  YUV is the default.\n"
-    "-c, -trc <int>         Force transfer characteristics [auto]\n"
+    "-c, -trc <int>         Force the input color matrix [from tags, else by width]\n"
     "                            - 601, 709, or 2020\n"
-    "-t, -threads <int>     Number of threads to use for encoding [auto]\n"
+    "-t, -threads <int>     Thread budget for decoding, scaling and encoding [auto]\n"
     "-l, -loglevel <string> Output verbosity [info]\n"
     "                            - quiet, info, debug\n"
     "-s, -video_size <WxH>  Video dimensions for raw input\n"
@@ -83,8 +108,156 @@ static void show_usage(void)
     "-p, -pix_fmt <string>  Pixel format for raw input.  Use FFmpeg values.\n"
     "-a, -aspect <N:D>      Force display aspect ratio [auto]\n"
     "-vo                    Mux only the new Cineform video stream into the output file.\n"
-    "-i <infile>            Input file or pipe:\n"
-    "<outfile>              Output Cineform file -- typically mov or avi format.\n");
+    "-jobs <file>           Run the jobs listed in file, one set of cfenc arguments per line.\n"
+    "-parallel <int>        Number of jobs to run at once with -jobs [1]\n"
+    "-checkpoint <int>      Commit the output every <int> frames so that -resume can pick up\n"
+    "                       after a crash.  Needs mov or mp4 output. [0 = off]\n"
+    "-resume                Continue an interrupted encode from its last checkpoint.\n"
+    "-frag <float>          Write fragmented mov/mp4, cutting a fragment every <float> seconds\n"
+    "                       so the file can be read while it is being written. [0 = off]\n"
+    "-f, -format <string>   Output container, needed when writing to a pipe [from file name]\n"
+    "                            - mov, mp4, matroska, or cfhd (raw Cineform samples)\n"
+    "-pipe_size <int>       Kernel buffer size in bytes for pipe output [system default]\n"
+    "-start_number <int>    First file number of an image sequence input [auto]\n"
+    "-prefetch <int>        Image sequence files to load and decode, or Vapoursynth frames\n"
+    "                       to request, at once [threads + 2, or 2 with -max_memory]\n"
+    "-scan                  Count the input's frames from its index or packets, for exact\n"
+    "                       progress.  The result is cached in <infile>.cfidx.\n"
+    "-o, -output <spec>     Another output from the same decode.  Repeat for more outputs.\n"
+    "                       <outfile>[,q=<quality>][,rgb][,yuv][,f=<format>][,vo]\n"
+    "                       [,size=half|quarter][,copy][,crop=<W>x<H>+<X>+<Y>]\n"
+    "-tiles <C>x<R>         Split the picture of <outfile> into a grid of C by R tiles, each\n"
+    "                       encoded at once into a file of its own (name_1.mov, ...).\n"
+    "-copy                  Rewrap Cineform input as it is instead of re-encoding it.\n"
+    "-size <string>         Size of <outfile>: full, half or quarter [full]\n"
+    "-dedup <int>           Write the sample of a frame identical to the one before again\n"
+    "                       instead of encoding it (1), or encode every frame (0)\n"
+    "                       [1; 0 with -realtime]\n"
+    "-matrix <string>       YUV <-> RGB conversion [swscale]\n"
+    "                            - swscale (accurate rounding), fixed (cfenc's fixed-point\n"
+    "                              kernels; compare the two with -kernel_bench)\n"
+    "-decoder <string>      Decoder for Cineform input that is re-encoded [sdk]\n"
+    "                            - sdk (Cineform SDK, decodes proxies from the lower\n"
+    "                              wavelet bands), ffmpeg\n"
+    "-analyze <file>        Decode each encoded frame again and write its PSNR and SSIM\n"
+    "                       against the encoder input to a JSON file.\n"
+    "-target_bitrate <Mb/s> Keep the video of <outfile> within a bitrate by choosing the\n"
+    "                       quality as it goes.  -q sets the highest quality. [fs3]\n"
+    "-target_size <MB>      Keep <outfile> within a file size in the same way.\n"
+    "-audio <string>        What to do with audio streams [auto]\n"
+    "                            - auto (copy, or convert to PCM where the output container\n"
+    "                              cannot hold the codec), copy, pcm\n"
+    "-watch <folder>        Run as a daemon that encodes each file written or moved into\n"
+    "                       <folder>, into the <outfile> folder.  Repeat for more folders.\n"
+    "                       Add ,priority=<int> to encode a folder's files first. [0]\n"
+    "-serve <socket>        Run as a server that takes jobs from local clients on a Unix\n"
+    "                       domain socket.  See the README for the protocol.\n"
+    "-realtime <ms>         Live mode: stamp frames with the wall clock, keep each frame's\n"
+    "                       latency near <ms> and write samples as soon as they are done.\n"
+    "                       Implies -vo. [0 = off]\n"
+    "-late <string>         What -realtime does with a frame the encoder is too late for\n"
+    "                       [drop]\n"
+    "                            - drop, repeat (write the previous frame again; also\n"
+    "                              fills the gaps when the input stalls)\n"
+    "-trace <file>          Write a Chrome trace of the encode (each frame's stages on each\n"
+    "                       thread) for chrome://tracing or ui.perfetto.dev.  Jobs of\n"
+    "                       -jobs, -watch and -serve write <file> numbered like the job.\n"
+    "-max_memory <MB>       Low-memory mode: keep the pictures in flight within <MB>, at\n"
+    "                       some cost in speed.  See MEMORY in the README. [0 = off]\n"
+    "-kernel_bench          Time the conversion kernels against swscale on frames of -s\n"
+    "                       size [1920x1080], then exit.\n"
+    "-i <infile>            Input file, image sequence (like plate.%%06d.dpx), Vapoursynth\n"
+    "                       script (.vpy) or pipe:\n"
+    "<outfile>              Output Cineform file -- typically mov or avi format -- or pipe:\n");
+}
+
+
+static int default_threads(void)
+{
+    int threads = std::thread::hardware_concurrency() - 1;
+    if (threads <= 0) threads = 1;
+    return threads;
+}
+
+
+static int64_t now_us(void)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+// The process's peak resident set size so far, in bytes
+static int64_t peak_resident_bytes(void)
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    // kilobytes on Linux
+    return (int64_t)usage.ru_maxrss << 10;
+}
+
+
+// A Vapoursynth script, which cfenc evaluates itself rather than reading through vspipe
+static bool is_script(const char *path)
+{
+    const char *ext = path ? strrchr(path, '.') : nullptr;
+    return ext && strcasecmp(ext, ".vpy") == 0;
+}
+
+
+// One Cineform output.  The <outfile> argument is the first; -o adds more.
+struct CliOutput
+{
+    std::string path;
+    std::string quality;
+    bool b_rgb;
+    // empty to pick the container from the file name
+    std::string format;
+    bool b_video_only;
+    // 2 or 4 for a half or quarter size proxy
+    int scale;
+    bool b_quality_set;
+    bool b_copy;
+    // video bit budget in Mb/s, or whole file size in MB; 0 for a fixed quality
+    float target_bitrate;
+    float target_size;
+    // the region of the picture encoded [crop_width 0 = all of it], or the tile of a
+    // tile_cols by tile_rows grid, which is placed once the picture size is known
+    int crop_x;
+    int crop_y;
+    int crop_width;
+    int crop_height;
+    int tile;
+    int tile_cols;
+    int tile_rows;
+};
+
+
+// A -watch folder.  Files from folders of higher priority are encoded first.
+struct CliWatch
+{
+    std::string path;
+    int priority;
+};
+
+
+static bool valid_quality(const std::string &quality)
+{
+    return quality == "low" || quality == "medium" || quality == "high" ||
+           quality == "fs1" || quality == "fs2"    || quality == "fs3";
+}
+
+
+// path numbered n, for a tile of -tiles or the trace of a job: shot.mov becomes shot_1.mov
+// for the first one.
+static std::string numbered_path(const std::string &path, int n)
+{
+    size_t dot = path.rfind('.');
+    size_t slash = path.rfind('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        dot = path.size();
+    return path.substr(0, dot) + "_" + std::to_string(n) + path.substr(dot);
 }
 
 
@@ -95,31 +268,125 @@ struct CliOptions
     const char *input;
     const char *output;
     std::string quality;
+    // an explicit quality means Cineform input is re-encoded rather than rewrapped
+    bool b_quality_set;
     bool b_rgb;
     int trc;
     int threads;
     const char *video_size;
+    // the -s dimensions, or 0
+    int video_width;
+    int video_height;
     const char *framerate;
     AVRational r_frame_rate;
     AVRational aspect;
     const char *pix_fmt_name;
     bool b_video_only;
+    const char *jobs;
+    int parallel;
+    int checkpoint;
+    bool b_resume;
+    float frag;
+    const char *format;
+    int pipe_size;
+    int start_number;
+    int prefetch;
+    bool b_copy;
+    // 2 or 4 when <outfile> itself is a half or quarter size proxy
+    int scale;
+    // decode Cineform input with libavcodec rather than the Cineform SDK
+    bool b_ffmpeg_decoder;
+    // YUV <-> RGB through CFHD_ColorMatrix rather than swscale
+    bool b_fixed_matrix;
+    // every output, the <outfile> argument first
+    std::vector<CliOutput> outputs;
+    // per-frame progress lines are suppressed when several jobs share the console
+    bool b_progress;
+    // the arguments are a job's (a -jobs line or a -serve submission), not the process's
+    bool b_job;
+    // JSON file for per-frame PSNR and SSIM of the encoded outputs
+    const char *analyze;
+    // count the input's frames exactly instead of estimating from its duration
+    bool b_scan;
+    // the quality of <outfile> follows a budget when one of these is set
+    float target_bitrate;
+    float target_size;
+    // what happens to audio streams: copied, converted to PCM where the container
+    // refuses them, or always converted
+    enum { AUDIO_COPY, AUDIO_AUTO, AUDIO_PCM };
+    int audio;
+    // folders to encode new files from; <outfile> is then the folder the encodes go to
+    std::vector<CliWatch> watch;
+    // Unix domain socket to take jobs on
+    const char *serve;
+    // time the conversion kernels and exit
+    bool b_kernel_bench;
+    // low-memory mode: MB of pictures in flight at once [0 = no limit]
+    int max_memory;
+    // Chrome trace JSON of the encode
+    const char *trace;
+    // live mode: the latency bound in ms [0 = off], and whether frames the encoder is too
+    // late for repeat the one before rather than being dropped
+    int realtime;
+    bool b_late_repeat;
+    // repeated frames reuse the sample before [-1 = unless -realtime]
+    int dedup;
+    // -tiles grid for <outfile> [0 = whole picture]
+    int tile_cols;
+    int tile_rows;
 
     CliOptions()
     {
+        input = nullptr;
+        output = nullptr;
         quality = "fs1";
+        b_quality_set = false;
         b_rgb = false;
         trc = 0;
         threads = 0;
         video_size = nullptr;
+        video_width = 0;
+        video_height = 0;
         framerate = nullptr;
         aspect.num = 0;
         aspect.den = 0;
         pix_fmt_name = nullptr;
         b_video_only = false;
+        jobs = nullptr;
+        parallel = 1;
+        checkpoint = 0;
+        b_resume = false;
+        frag = 0;
+        format = nullptr;
+        pipe_size = 0;
+        start_number = -1;
+        prefetch = 0;
+        b_copy = false;
+        scale = 1;
+        b_ffmpeg_decoder = false;
+        b_fixed_matrix = false;
+        b_progress = true;
+        b_job = false;
+        analyze = nullptr;
+        b_scan = false;
+        target_bitrate = 0;
+        target_size = 0;
+        audio = AUDIO_AUTO;
+        serve = nullptr;
+        b_kernel_bench = false;
+        max_memory = 0;
+        trace = nullptr;
+        realtime = 0;
+        b_late_repeat = false;
+        dedup = -1;
+        tile_cols = 0;
+        tile_rows = 0;
     }
 
     void parse(int argc, char **argv);
+
+private:
+    bool parse_output(const char*, CliOutput&);
 };
 
 
@@ -130,10 +397,17 @@ void CliOptions::parse(int argc, char **argv)
     int raw_param = 0;
     int rgb = 0;
     int video_only = 0;
+    int resume = 0;
+    int copy = 0;
+    int scan = 0;
+    int kernel_bench = 0;
+    std::vector<const char*> output_specs;
 
     while (1)
     {
-        static struct option long_options[] =
+        // not static: the flags point at this call's locals, and jobs parse their own
+        // arguments, on other threads with -serve
+        struct option long_options[] =
         {
             {"quality",   required_argument, 0,          'q'},
             {"rgb",       no_argument,       &rgb,        1 },
@@ -145,6 +419,34 @@ void CliOptions::parse(int argc, char **argv)
             {"pix_fmt",   required_argument, 0,          'p'},
             {"aspect",    required_argument, 0,          'a'},
             {"vo",        no_argument,       &video_only, 1 },
+            {"jobs",      required_argument, 0,          'J'},
+            {"parallel",  required_argument, 0,          'P'},
+            {"checkpoint",required_argument, 0,          'C'},
+            {"resume",    no_argument,       &resume,     1 },
+            {"frag",      required_argument, 0,          'F'},
+            {"format",    required_argument, 0,          'f'},
+            {"pipe_size", required_argument, 0,          'S'},
+            {"start_number", required_argument, 0,       'N'},
+            {"prefetch",  required_argument, 0,          'W'},
+            {"output",    required_argument, 0,          'o'},
+            {"copy",      no_argument,       &copy,       1 },
+            {"scan",      no_argument,       &scan,       1 },
+            {"decoder",   required_argument, 0,          'D'},
+            {"matrix",    required_argument, 0,          'V'},
+            {"size",      required_argument, 0,          'Z'},
+            {"analyze",   required_argument, 0,          'A'},
+            {"target_bitrate", required_argument, 0,     'B'},
+            {"target_size", required_argument, 0,        'T'},
+            {"audio",     required_argument, 0,          'U'},
+            {"watch",     required_argument, 0,          'X'},
+            {"serve",     required_argument, 0,          'Y'},
+            {"kernel_bench", no_argument,    &kernel_bench, 1 },
+            {"max_memory", required_argument, 0,         'M'},
+            {"trace",     required_argument, 0,          'E'},
+            {"realtime",  required_argument, 0,          'L'},
+            {"late",      required_argument, 0,          'K'},
+            {"tiles",     required_argument, 0,          'G'},
+            {"dedup",     required_argument, 0,          'H'},
             {0, 0, 0, 0}
         };
 
@@ -153,7 +455,7 @@ void CliOptions::parse(int argc, char **argv)
         if (c == -1)
             break;
 
-        c = getopt_long_only(argc, argv, "q:c:t:l:s:r:p:a:i:h",
+        c = getopt_long_only(argc, argv, "q:c:t:l:s:r:p:a:f:o:i:h",
                              long_options, &option_index);
 
         switch (c)
@@ -162,8 +464,8 @@ void CliOptions::parse(int argc, char **argv)
                  break;
             case 'q':
                 quality = optarg;
-                if (quality != "low" && quality != "medium" && quality != "high" &&
-                    quality != "fs1" && quality != "fs2"    && quality != "fs3")
+                b_quality_set = true;
+                if (! valid_quality(quality))
                 {
                     av_log(nullptr, AV_LOG_ERROR, "Invalid quality setting.\n");
                     b_show_help = true;
@@ -188,7 +490,13 @@ void CliOptions::parse(int argc, char **argv)
             case 'l':
             {
                 std::string s_loglevel = optarg;
-                if (s_loglevel == "quiet")
+                // the log level is the process's, shared by every job running in it
+                if (b_job)
+                {
+                    av_log(nullptr, AV_LOG_ERROR, "-l cannot be given to a job.\n");
+                    b_show_help = true;
+                }
+                else if (s_loglevel == "quiet")
                     av_log_set_level(AV_LOG_QUIET);
                 else if (s_loglevel == "info")
                     av_log_set_level(AV_LOG_INFO);
@@ -203,17 +511,12 @@ void CliOptions::parse(int argc, char **argv)
             }
             case 's':
             {
+                // WxH, or one of FFmpeg's names such as hd1080
                 video_size = optarg;
-                std::cmatch sm;
-                if (std::regex_match(video_size, sm, std::regex("([0-9]+)x([0-9]+)")))
+                if (av_parse_video_size(&video_width, &video_height, video_size) < 0)
                 {
-                    g_width = stoi(sm[1].str());
-                    g_height = stoi(sm[2].str());
-                    if (g_width < 1 || g_height < 1)
-                    {
-                        av_log(nullptr, AV_LOG_ERROR, "Invalid video_size setting.\n");
-                        b_show_help = true;
-                    }
+                    av_log(nullptr, AV_LOG_ERROR, "Invalid video_size setting.\n");
+                    b_show_help = true;
                 }
                 raw_param++;
                 break;
@@ -263,6 +566,211 @@ void CliOptions::parse(int argc, char **argv)
                 }
                 break;
             }
+            case 'J':
+                jobs = optarg;
+                break;
+            case 'P':
+                parallel = atoi(optarg);
+                if (parallel < 1)
+                {
+                    av_log(nullptr, AV_LOG_ERROR, "Parallel must be >= 1.\n");
+                    b_show_help = true;
+                }
+                break;
+            case 'C':
+                checkpoint = atoi(optarg);
+                if (checkpoint < 0)
+                {
+                    av_log(nullptr, AV_LOG_ERROR, "Checkpoint must be >= 0.\n");
+                    b_show_help = true;
+                }
+                break;
+            case 'F':
+                frag = atof(optarg);
+                if (frag <= 0)
+                {
+                    av_log(nullptr, AV_LOG_ERROR, "Fragment duration must be > 0.\n");
+                    b_show_help = true;
+                }
+                break;
+            case 'f':
+                format = optarg;
+                break;
+            case 'S':
+                pipe_size = atoi(optarg);
+                if (pipe_size < 0)
+                {
+                    av_log(nullptr, AV_LOG_ERROR, "Pipe size must be >= 0.\n");
+                    b_show_help = true;
+                }
+                break;
+            case 'N':
+                start_number = atoi(optarg);
+                if (start_number < 0)
+                {
+                    av_log(nullptr, AV_LOG_ERROR, "Start number must be >= 0.\n");
+                    b_show_help = true;
+                }
+                break;
+            case 'W':
+                prefetch = atoi(optarg);
+                if (prefetch < 1)
+                {
+                    av_log(nullptr, AV_LOG_ERROR, "Prefetch must be >= 1.\n");
+                    b_show_help = true;
+                }
+                break;
+            case 'D':
+            {
+                std::string s_decoder = optarg;
+                if (s_decoder == "ffmpeg")
+                    b_ffmpeg_decoder = true;
+                else if (s_decoder == "sdk")
+                    b_ffmpeg_decoder = false;
+                else
+                {
+                    av_log(nullptr, AV_LOG_ERROR, "Invalid decoder setting.\n");
+                    b_show_help = true;
+                }
+                break;
+            }
+            case 'V':
+            {
+                std::string s_matrix = optarg;
+                if (s_matrix == "fixed")
+                    b_fixed_matrix = true;
+                else if (s_matrix == "swscale")
+                    b_fixed_matrix = false;
+                else
+                {
+                    av_log(nullptr, AV_LOG_ERROR, "Invalid matrix setting.\n");
+                    b_show_help = true;
+                }
+                break;
+            }
+            case 'Z':
+            {
+                std::string s_size = optarg;
+                if (s_size == "full")
+                    scale = 1;
+                else if (s_size == "half")
+                    scale = 2;
+                else if (s_size == "quarter")
+                    scale = 4;
+                else
+                {
+                    av_log(nullptr, AV_LOG_ERROR, "Invalid size setting.\n");
+                    b_show_help = true;
+                }
+                break;
+            }
+            case 'A':
+                analyze = optarg;
+                break;
+            case 'B':
+                target_bitrate = atof(optarg);
+                if (target_bitrate <= 0)
+                {
+                    av_log(nullptr, AV_LOG_ERROR, "Target bitrate must be > 0.\n");
+                    b_show_help = true;
+                }
+                break;
+            case 'T':
+                target_size = atof(optarg);
+                if (target_size <= 0)
+                {
+                    av_log(nullptr, AV_LOG_ERROR, "Target size must be > 0.\n");
+                    b_show_help = true;
+                }
+                break;
+            case 'U':
+            {
+                std::string s_audio = optarg;
+                if (s_audio == "auto")
+                    audio = AUDIO_AUTO;
+                else if (s_audio == "copy")
+                    audio = AUDIO_COPY;
+                else if (s_audio == "pcm")
+                    audio = AUDIO_PCM;
+                else
+                {
+                    av_log(nullptr, AV_LOG_ERROR, "Invalid audio setting.\n");
+                    b_show_help = true;
+                }
+                break;
+            }
+            case 'X':
+            {
+                // <folder>[,priority=<int>]
+                CliWatch dir;
+                std::string spec = optarg;
+                size_t pos = spec.find(",priority=");
+                dir.path = spec.substr(0, pos);
+                dir.priority = pos == std::string::npos ? 0 : atoi(spec.c_str() + pos + 10);
+                if (dir.path.empty())
+                {
+                    av_log(nullptr, AV_LOG_ERROR, "Invalid watch folder.\n");
+                    b_show_help = true;
+                }
+                watch.push_back(dir);
+                break;
+            }
+            case 'Y':
+                serve = optarg;
+                break;
+            case 'E':
+                trace = optarg;
+                break;
+            case 'G':
+                if (sscanf(optarg, "%dx%d", &tile_cols, &tile_rows) != 2 || tile_cols < 1 ||
+                    tile_rows < 1)
+                {
+                    av_log(nullptr, AV_LOG_ERROR, "Invalid tiles setting.\n");
+                    b_show_help = true;
+                }
+                break;
+            case 'H':
+                dedup = atoi(optarg);
+                if (dedup != 0 && dedup != 1)
+                {
+                    av_log(nullptr, AV_LOG_ERROR, "Invalid dedup setting.\n");
+                    b_show_help = true;
+                }
+                break;
+            case 'L':
+                realtime = atoi(optarg);
+                if (realtime < 0)
+                {
+                    av_log(nullptr, AV_LOG_ERROR, "Realtime latency must be >= 0.\n");
+                    b_show_help = true;
+                }
+                break;
+            case 'K':
+            {
+                std::string s_late = optarg;
+                if (s_late == "drop")
+                    b_late_repeat = false;
+                else if (s_late == "repeat")
+                    b_late_repeat = true;
+                else
+                {
+                    av_log(nullptr, AV_LOG_ERROR, "Invalid late setting.\n");
+                    b_show_help = true;
+                }
+                break;
+            }
+            case 'M':
+                max_memory = atoi(optarg);
+                if (max_memory < 0)
+                {
+                    av_log(nullptr, AV_LOG_ERROR, "Max memory must be >= 0.\n");
+                    b_show_help = true;
+                }
+                break;
+            case 'o':
+                // resolved after the loop so that -q, -rgb and -vo apply wherever they appear
+                output_specs.push_back(optarg);
+                break;
             case 'i':
                 input = optarg;
                 if (strcmp(input, "-") == 0) input = "pipe:";
@@ -278,13 +786,61 @@ void CliOptions::parse(int argc, char **argv)
 
     if (rgb) b_rgb = true;
     if (video_only) b_video_only = true;
+    // the wall clock stamps would leave other streams out of step with the video
+    if (realtime > 0) b_video_only = true;
+    if (resume) b_resume = true;
+    if (copy) b_copy = true;
+    if (scan) b_scan = true;
+    if (kernel_bench) b_kernel_bench = true;
+
+    // -s is the only setting the benchmark takes
+    if (b_kernel_bench)
+    {
+        if (optind != argc || input || jobs || ! watch.empty() || serve)
+        {
+            av_log(nullptr, AV_LOG_ERROR, "-kernel_bench takes no input or output.\n");
+            show_usage();
+            throw 1;
+        }
+        return;
+    }
+
+    // clients of the job server send their own arguments
+    if (serve)
+    {
+        if (optind != argc || input || jobs || ! watch.empty())
+        {
+            av_log(nullptr, AV_LOG_ERROR, "-serve takes no input, output, -jobs or -watch.\n");
+            show_usage();
+            throw 1;
+        }
+        return;
+    }
+
+    // a job list supplies its own inputs and outputs
+    if (jobs)
+    {
+        if (optind != argc || input || ! watch.empty())
+        {
+            av_log(nullptr, AV_LOG_ERROR, "Do not set an input or output file with -jobs.\n");
+            show_usage();
+            throw 1;
+        }
+        return;
+    }
 
     if (optind == argc - 1)
+    {
         output = argv[optind];
+        if (strcmp(output, "-") == 0) output = "pipe:1";
+    }
     else
         b_show_help = true;
 
-    if (raw_param != 0 && raw_param != 3)
+    // an image sequence or a script only needs the frame rate, and a script has its own
+    bool b_sequence_rate = raw_param == 1 && framerate && input &&
+                           (av_filename_number_test(input) || is_script(input));
+    if (raw_param != 0 && raw_param != 3 && ! b_sequence_rate)
     {
         av_log(nullptr, AV_LOG_ERROR,
         "If you specify video size, frame rate, and pixel format, we assume the input is raw\n"
@@ -292,951 +848,8788 @@ void CliOptions::parse(int argc, char **argv)
         b_show_help = true;
     }
 
-    if (b_show_help || ! input)
+    // a watch folder supplies the inputs
+    if (! watch.empty() && ! b_show_help)
     {
-        show_usage();
-        throw 1;
+        if (input || ! output_specs.empty() || b_resume || checkpoint > 0 || tile_cols > 0 ||
+            strncmp(output, "pipe:", 5) == 0)
+        {
+            av_log(nullptr, AV_LOG_ERROR, "With -watch, give the output folder as <outfile>, "
+                   "and no input, -o, -tiles, -checkpoint or -resume.\n");
+            throw 1;
+        }
+        input = "";
     }
 
-    if (strcmp(input, output) == 0)
+    if (b_show_help || ! input)
     {
-        av_log(nullptr, AV_LOG_ERROR, "Input and output files are the same.\n");
+        show_usage();
         throw 1;
     }
-}
-
 
-struct CFHD_Encoder
-{
-    struct CFHD_AVData
+    CliOutput primary;
+    primary.path = output;
+    primary.quality = quality;
+    primary.b_rgb = b_rgb;
+    primary.format = format ? format : "";
+    // raw samples have no room for other streams
+    primary.b_video_only = b_video_only || (format && strcmp(format, "cfhd") == 0);
+    primary.scale = scale;
+    // a budget means Cineform input is re-encoded, like an explicit quality
+    primary.b_quality_set = b_quality_set || target_bitrate > 0 || target_size > 0;
+    primary.b_copy = b_copy;
+    primary.target_bitrate = target_bitrate;
+    primary.target_size = target_size;
+    primary.crop_x = 0;
+    primary.crop_y = 0;
+    primary.crop_width = 0;
+    primary.crop_height = 0;
+    primary.tile = 0;
+    primary.tile_cols = 0;
+    primary.tile_rows = 0;
+    // -tiles makes a file of each tile, numbered across the rows from the top left
+    if (tile_cols * tile_rows > 1)
     {
-        uint8_t *data;
-        int64_t pts;
-        int64_t duration;
-        
-        CFHD_AVData(uint8_t *data, int pitch, int64_t pts, int64_t duration)
+        if (strncmp(output, "pipe:", 5) == 0 || scale > 1 || b_copy)
         {
-            size_t size = (size_t)(pitch * g_height);
-            this->data = (uint8_t*)malloc(size);
-            memcpy(this->data, data, size);
-            this->pts = pts;
-            this->duration = duration;
+            av_log(nullptr, AV_LOG_ERROR, "-tiles needs an output file, encoded at full size.\n");
+            throw 1;
         }
-    };
-
-    struct CFHD_Sample
+        for (int i = 0; i < tile_cols * tile_rows; i++)
+        {
+            CliOutput tile = primary;
+            tile.path = numbered_path(primary.path, i + 1);
+            tile.tile = i;
+            tile.tile_cols = tile_cols;
+            tile.tile_rows = tile_rows;
+            outputs.push_back(tile);
+        }
+    }
+    else
+        outputs.push_back(primary);
+    for (const char *spec : output_specs)
     {
-        CFHD_SampleBufferRef buffer;
-        uint32_t frame_num;
-        uint8_t *data;
-        size_t size;
-        int64_t pts;
-        int64_t duration;
-
-        CFHD_Sample()
+        CliOutput extra;
+        if (! parse_output(spec, extra))
         {
-            buffer = nullptr;
-            frame_num = 0;
-            data = nullptr;
-            size = 0;
-            pts = 0;
-            duration = 0;
+            show_usage();
+            throw 1;
         }
-    };
-
-    CFHD_EncoderPoolRef pool;
-    CFHD_MetadataRef metadata;
-    CFHD_Sample sample;
-    CFHD_PixelFormat pix_fmt;
-    CFHD_EncodedFormat enc_fmt;
-    CFHD_EncodingFlags flags;
-    CFHD_EncodingQuality quality;
-    int threads;
-    int queue_size;
-    int queued;
-    // queue is necessary to avoid a data race condition with the read/decode thread(s)
-    std::vector<CFHD_AVData> queue;
+        outputs.push_back(extra);
+    }
 
-    CFHD_Encoder(bool input_is_8_bit, int rgb, std::string quality, int trc, int threads)
+    for (size_t i = 0; i < outputs.size(); i++)
     {
-        this->quality = set_quality(quality);
-        flags = CFHD_ENCODING_FLAGS_NONE;
-        queued = 0;
-
-        if (rgb)
+        const char *path = outputs[i].path.c_str();
+        if (strcmp(input, path) == 0 && strncmp(input, "pipe:", 5) != 0 && watch.empty())
         {
-            // We scale everything to RGB48 because it simplifies things for us and because
-            // Cineform does that anyway so we're not wasting cycles.
-            pix_fmt = CFHD_PIXEL_FORMAT_RG48;
-            enc_fmt = CFHD_ENCODED_FORMAT_RGB_444;
+            av_log(nullptr, AV_LOG_ERROR, "Input and output files are the same.\n");
+            throw 1;
         }
-        else
-        {
-            // Cineform encodes 8-bit YUV efficiently; scaling to 10-bit here would waste cycles.
-            // We use v210 when our input video is already > 8-bit.
-            if (input_is_8_bit)
-                pix_fmt = CFHD_PIXEL_FORMAT_YUY2;
-            else
-                pix_fmt = CFHD_PIXEL_FORMAT_V210;
-            enc_fmt = CFHD_ENCODED_FORMAT_YUV_422;
-            if (trc == 0)
+        for (size_t j = 0; j < i; j++)
+            if (outputs[j].path == outputs[i].path)
             {
-                if (g_width <= 720)
-                    flags |= CFHD_ENCODING_FLAGS_YUV_601;
+                av_log(nullptr, AV_LOG_ERROR, "Output '%s' is given twice.\n", path);
+                throw 1;
             }
-            else if (trc == 601)
-                flags |= CFHD_ENCODING_FLAGS_YUV_601;
-        }
+    }
 
-        if (threads > 0) this->threads = threads;
-        else
-        {
-            this->threads = std::thread::hardware_concurrency() - 1;
-            if (this->threads <= 0) this->threads = 1;
-        }
-        queue_size = (int)round((float)this->threads * 1.5);
-        av_log(nullptr, AV_LOG_INFO, "Encoding threads: %d\n", this->threads);
+    if ((target_bitrate > 0 || target_size > 0) && b_copy)
+    {
+        av_log(nullptr, AV_LOG_ERROR,
+               "A target bitrate or size needs the video re-encoded, not -copy.\n");
+        throw 1;
     }
 
-    ~CFHD_Encoder()
+    if ((b_resume || checkpoint > 0) && outputs.size() > 1)
     {
-        av_log(nullptr, AV_LOG_DEBUG, "CFHD_Encoder destructor called.\n");
-        for (CFHD_AVData i : queue)
-        {
-            free(i.data);
-            i.data = nullptr;
-        }
-        if (sample.data)
-        {
-            CFHD_ReleaseSampleBuffer(pool, sample.buffer);
-            sample.buffer = nullptr;
+        av_log(nullptr, AV_LOG_ERROR, "Checkpoints and -resume work with one output only.\n");
+        throw 1;
+    }
+
+    if (b_resume && strcmp(input, "pipe:") == 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "Resuming needs a seekable input file, not a pipe.\n");
+        throw 1;
+    }
+
+    if (checkpoint > 0 && strncmp(output, "pipe:", 5) == 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "Checkpoints need an output file, not a pipe.\n");
+        throw 1;
+    }
+}
+
+
+// Parses an -o spec:
+// <outfile>[,q=<quality>][,rgb][,yuv][,f=<format>][,vo][,size=half|quarter][,copy]
+//          [,crop=<W>x<H>+<X>+<Y>]
+// Settings left out are taken from the command line, except the container, size and crop.
+bool CliOptions::parse_output(const char *spec, CliOutput &out)
+{
+    std::string s = spec;
+    size_t pos = s.find(',');
+
+    out.path = s.substr(0, pos);
+    if (out.path == "-") out.path = "pipe:1";
+    out.quality = quality;
+    out.b_rgb = b_rgb;
+    out.b_video_only = b_video_only;
+    out.scale = 1;
+    out.b_quality_set = b_quality_set;
+    out.b_copy = b_copy;
+    out.target_bitrate = 0;
+    out.target_size = 0;
+    out.crop_x = 0;
+    out.crop_y = 0;
+    out.crop_width = 0;
+    out.crop_height = 0;
+    out.tile = 0;
+    out.tile_cols = 0;
+    out.tile_rows = 0;
+    if (out.path.empty())
+    {
+        av_log(nullptr, AV_LOG_ERROR, "Output '%s' has no file name.\n", spec);
+        return false;
+    }
+
+    while (pos != std::string::npos)
+    {
+        size_t next = s.find(',', pos + 1);
+        std::string opt = s.substr(pos + 1, next == std::string::npos ? next : next - pos - 1);
+        pos = next;
+
+        if (opt.compare(0, 2, "q=") == 0 && valid_quality(opt.substr(2)))
+        {
+            out.quality = opt.substr(2);
+            out.b_quality_set = true;
+        }
+        else if (opt == "rgb")
+            out.b_rgb = true;
+        else if (opt == "yuv")
+            out.b_rgb = false;
+        else if (opt.compare(0, 2, "f=") == 0 && opt.size() > 2)
+        {
+            out.format = opt.substr(2);
+            if (out.format == "cfhd")
+                out.b_video_only = true;
+        }
+        else if (opt == "vo")
+            out.b_video_only = true;
+        else if (opt == "size=full")
+            out.scale = 1;
+        else if (opt == "size=half")
+            out.scale = 2;
+        else if (opt == "size=quarter")
+            out.scale = 4;
+        else if (opt == "copy")
+            out.b_copy = true;
+        else if (opt.compare(0, 5, "crop=") == 0)
+        {
+            // a crop starts on a 48 pixel boundary, where rows of every encoder input format
+            // start on 16 bytes (see CFHD_Output::set_size)
+            int end = 0;
+            if (sscanf(opt.c_str() + 5, "%dx%d+%d+%d%n", &out.crop_width, &out.crop_height,
+                       &out.crop_x, &out.crop_y, &end) != 4 || opt[5 + end] != '\0' ||
+                out.crop_width < 2 || out.crop_width % 2 || out.crop_height < 1 ||
+                out.crop_x < 0 || out.crop_x % 48 || out.crop_y < 0)
+            {
+                av_log(nullptr, AV_LOG_ERROR, "Invalid crop '%s' for output '%s': the width "
+                       "must be even and X a multiple of 48.\n", opt.c_str() + 5,
+                       out.path.c_str());
+                return false;
+            }
+        }
+        else
+        {
+            av_log(nullptr, AV_LOG_ERROR, "Invalid setting '%s' for output '%s'.\n",
+                   opt.c_str(), out.path.c_str());
+            return false;
+        }
+    }
+    if (out.crop_width > 0 && out.scale > 1)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "Output '%s' is cropped, so it is encoded at full size.\n",
+               out.path.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+static std::string json_quote(const std::string &value)
+{
+    std::string quoted = "\"";
+    char escape[8];
+
+    for (unsigned char c : value)
+    {
+        if (c == '"' || c == '\\')
+            quoted += '\\';
+        if (c < 0x20)
+        {
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            quoted += escape;
+        }
+        else
+            quoted += (char)c;
+    }
+    return quoted + '"';
+}
+
+
+static void write_json_string(FILE *file, const std::string &value)
+{
+    fputs(json_quote(value).c_str(), file);
+}
+
+
+// -trace writes a Chrome trace of the job, which chrome://tracing and ui.perfetto.dev open.
+// Each frame's demux, decode, conversion bands, submission to the encoder and muxing is a
+// span on the thread that did it, and its turnaround in the encoder pool is an async span
+// per output.  The SDK does not say when a sample is done, only whether it is when asked,
+// so the turnaround runs from submission until the sample was collected: at the next
+// frame's submission, or within the 10 ms poll while the pool is full (within a
+// millisecond with -realtime, whose collector polls the pools).  Gaps between spans are
+// the pipeline's bubbles.  Events are written as they happen, so a long encode does not
+// pile them up.
+struct CFHD_Trace
+{
+    FILE *file;
+    std::string path;
+    int64_t epoch;
+    // small numbers for the threads seen so far
+    std::map<std::thread::id, int> tids;
+    bool b_first;
+    // microseconds from submission to collection, for the turnaround summary
+    std::vector<int64_t> turnarounds;
+    std::mutex mutex;
+
+    CFHD_Trace()
+    {
+        file = nullptr;
+        epoch = now_us();
+        b_first = true;
+    }
+
+    ~CFHD_Trace() { close(); }
+
+    bool open(const char*);
+    void name_thread(const std::string&);
+    void span(const char*, int64_t, int64_t frame = -1);
+    void encoded(const std::string&, uint32_t, int64_t, int64_t);
+    void close();
+
+private:
+    int tid(const std::string &name = "");
+    void begin_event();
+};
+
+
+bool CFHD_Trace::open(const char *path)
+{
+    this->path = path;
+    if (! (file = fopen(path, "w")))
+    {
+        av_log(nullptr, AV_LOG_ERROR, "CFHD_Trace: cannot write '%s': %s\n", path,
+               strerror(errno));
+        return false;
+    }
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", file);
+    name_thread("main");
+    return true;
+}
+
+
+// The calling thread's number.  A thread seen for the first time is named name, or after
+// its number.  Called with the mutex held.
+int CFHD_Trace::tid(const std::string &name)
+{
+    auto i = tids.find(std::this_thread::get_id());
+    if (i != tids.end())
+        return i->second;
+    int tid = (int)tids.size() + 1;
+    tids[std::this_thread::get_id()] = tid;
+    begin_event();
+    fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+            "\"args\":{\"name\":%s}}", tid,
+            json_quote(name.empty() ? "thread " + std::to_string(tid) : name).c_str());
+    return tid;
+}
+
+
+void CFHD_Trace::begin_event()
+{
+    fputs(b_first ? "\n" : ",\n", file);
+    b_first = false;
+}
+
+
+void CFHD_Trace::name_thread(const std::string &name)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (file)
+        tid(name);
+}
+
+
+// A span on the calling thread from start until now, both from now_us()
+void CFHD_Trace::span(const char *name, int64_t start, int64_t frame)
+{
+    int64_t end = now_us();
+    std::lock_guard<std::mutex> lock(mutex);
+    if (! file)
+        return;
+    int id = tid();
+    begin_event();
+    fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%lld,\"dur\":%lld",
+            name, id, (long long)(start - epoch), (long long)(end - start));
+    if (frame >= 0)
+        fprintf(file, ",\"args\":{\"frame\":%lld}", (long long)frame);
+    fputc('}', file);
+}
+
+
+// A frame's turnaround in the encoder pool of an output, from submission to collection
+void CFHD_Trace::encoded(const std::string &output, uint32_t frame, int64_t submitted,
+                         int64_t collected)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (! file)
+        return;
+    std::string cat = json_quote(output);
+    begin_event();
+    fprintf(file, "{\"name\":\"encoder turnaround\",\"cat\":%s,\"ph\":\"b\",\"id\":%u,"
+            "\"pid\":1,\"ts\":%lld,\"args\":{\"frame\":%u}},\n", cat.c_str(), frame,
+            (long long)(submitted - epoch), frame);
+    fprintf(file, "{\"name\":\"encoder turnaround\",\"cat\":%s,\"ph\":\"e\",\"id\":%u,"
+            "\"pid\":1,\"ts\":%lld}", cat.c_str(), frame, (long long)(collected - epoch));
+    turnarounds.push_back(collected - submitted);
+}
+
+
+void CFHD_Trace::close()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (! file)
+        return;
+    fputs("\n]}\n", file);
+    if (fclose(file) != 0)
+        av_log(nullptr, AV_LOG_ERROR, "CFHD_Trace: writing '%s' failed\n", path.c_str());
+    else
+        av_log(nullptr, AV_LOG_INFO, "Trace written to '%s'\n", path.c_str());
+    file = nullptr;
+
+    if (turnarounds.empty())
+        return;
+    std::sort(turnarounds.begin(), turnarounds.end());
+    auto ms = [this](double q)
+    {
+        return turnarounds[(size_t)(q * (turnarounds.size() - 1) + 0.5)] / 1000.0;
+    };
+    av_log(nullptr, AV_LOG_INFO, "Encoder turnaround (submission to collection) over %zu "
+           "frames: median %1.1f ms, p95 %1.1f ms, p99 %1.1f ms, max %1.1f ms\n",
+           turnarounds.size(), ms(0.5), ms(0.95), ms(0.99), ms(1.0));
+}
+
+
+// Work-stealing task pool shared by every stage (and every job) in the process.  Each worker
+// owns a deque per priority, runs its newest task first and steals the oldest task of another
+// worker when it runs dry.  Higher priorities are always drained first, so the stage that is
+// currently the bottleneck can jump the queue.  A thread that waits on a group runs tasks
+// while there are any, and sleeps until the group is done otherwise.
+//
+// The pool is a quarter of the process thread budget.  The Cineform SDK runs its encoder
+// threads itself, so each transcode takes them out of the same budget: see share().
+struct CFHD_TaskPool
+{
+    enum Priority { PRIORITY_LOW, PRIORITY_NORMAL, PRIORITY_HIGH, PRIORITY_COUNT };
+
+    struct Group
+    {
+        std::atomic<int> pending;
+
+        Group()
+        {
+            pending = 0;
+        }
+    };
+
+    struct Task
+    {
+        std::function<void()> func;
+        Group *group;
+    };
+
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks[PRIORITY_COUNT];
+    };
+
+    // one deque per pool thread plus a last one for threads outside the pool
+    std::vector<Worker*> workers;
+    std::vector<std::thread> threads;
+    std::mutex idle_mutex;
+    std::condition_variable idle_cv;
+    std::atomic<int> queued;
+    std::atomic<unsigned> next_worker;
+    bool b_stop;
+    // the process thread budget the pool is part of
+    int budget;
+
+    CFHD_TaskPool(int budget)
+    {
+        int threads = std::max(1, budget / 4);
+        this->budget = budget;
+        queued = 0;
+        next_worker = 0;
+        b_stop = false;
+        for (int i = 0; i <= threads; i++)
+            workers.push_back(new Worker());
+        for (int i = 0; i < threads; i++)
+            this->threads.push_back(std::thread(&CFHD_TaskPool::worker, this, i));
+    }
+
+    ~CFHD_TaskPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(idle_mutex);
+            b_stop = true;
+        }
+        idle_cv.notify_all();
+        for (std::thread &t : threads)
+            t.join();
+        for (Worker *w : workers)
+            delete w;
+    }
+
+    int size() { return (int)threads.size(); }
+    // the pool threads that count against a transcode given <threads> of the budget
+    int share(int threads)
+    {
+        return std::max(1, (int)((int64_t)size() * threads / budget));
+    }
+    void submit(Group*, Priority, std::function<void()>);
+    void wait(Group*);
+    bool run_one();
+
+private:
+    static int &self();
+    bool take(Task&);
+    void worker(int);
+};
+
+
+// Index of the calling thread's own deque, or -1 for threads outside the pool.
+int &CFHD_TaskPool::self()
+{
+    static thread_local int index = -1;
+    return index;
+}
+
+
+void CFHD_TaskPool::submit(Group *group, Priority priority, std::function<void()> func)
+{
+    int i = self();
+    if (i < 0)
+        i = next_worker++ % workers.size();
+
+    group->pending++;
+    {
+        std::lock_guard<std::mutex> lock(workers[i]->mutex);
+        workers[i]->tasks[priority].push_back(Task{func, group});
+    }
+    {
+        std::lock_guard<std::mutex> lock(idle_mutex);
+        queued++;
+    }
+    idle_cv.notify_one();
+}
+
+
+bool CFHD_TaskPool::take(Task &task)
+{
+    int i = self();
+    int n = (int)workers.size();
+
+    for (int p = PRIORITY_COUNT - 1; p >= 0; p--)
+    {
+        if (i >= 0)
+        {
+            std::lock_guard<std::mutex> lock(workers[i]->mutex);
+            std::deque<Task> &own = workers[i]->tasks[p];
+            if (! own.empty())
+            {
+                task = own.back();
+                own.pop_back();
+                queued--;
+                return true;
+            }
+        }
+        // steal, starting with the next worker over so that thieves spread out
+        for (int k = 1; k <= n; k++)
+        {
+            int victim = (i + k + n) % n;
+            std::lock_guard<std::mutex> lock(workers[victim]->mutex);
+            std::deque<Task> &other = workers[victim]->tasks[p];
+            if (! other.empty())
+            {
+                task = other.front();
+                other.pop_front();
+                queued--;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+
+bool CFHD_TaskPool::run_one()
+{
+    Task task;
+
+    if (queued == 0 || ! take(task))
+        return false;
+    task.func();
+    // the group may be gone as soon as pending reaches 0, so only the pool's lock is taken
+    if (--task.group->pending == 0)
+    {
+        std::lock_guard<std::mutex> lock(idle_mutex);
+        idle_cv.notify_all();
+    }
+    return true;
+}
+
+
+// Runs queued tasks while the group has work left, and sleeps when there are none, until a
+// task is submitted or the group's last task ends.
+void CFHD_TaskPool::wait(Group *group)
+{
+    while (group->pending > 0)
+    {
+        if (run_one())
+            continue;
+        std::unique_lock<std::mutex> lock(idle_mutex);
+        idle_cv.wait(lock, [this, group] { return group->pending == 0 || queued > 0; });
+    }
+}
+
+
+void CFHD_TaskPool::worker(int index)
+{
+    self() = index;
+    while (1)
+    {
+        {
+            std::unique_lock<std::mutex> lock(idle_mutex);
+            idle_cv.wait(lock, [this] { return b_stop || queued > 0; });
+            if (b_stop)
+                return;
+        }
+        while (run_one())
+            ;
+    }
+}
+
+
+struct CFHD_Encoder
+{
+    // The pool reads each picture until its sample comes back, so a queue slot holds a
+    // reference to the picture's buffer rather than a copy.  One converted picture can then
+    // feed several pools at once.
+    struct CFHD_AVData
+    {
+        AVBufferRef *buf;
+        uint8_t *data;
+        int pitch;
+        uint32_t frame_num;
+        int64_t pts;
+        int64_t duration;
+        // when the picture was handed to push(), from now_us()
+        int64_t submit_us;
+        // the quality the pool was encoding at
+        CFHD_EncodingQuality quality;
+
+        CFHD_AVData()
+        {
+            buf = nullptr;
+            data = nullptr;
+            pitch = 0;
+            quality = CFHD_ENCODING_QUALITY_DEFAULT;
+            frame_num = 0;
+            pts = 0;
+            duration = 0;
+            submit_us = 0;
+        }
+    };
+
+    // With -analyze, a finished sample keeps the picture it was encoded from until it is
+    // written, for the analyzer to compare against.
+    struct CFHD_Sample
+    {
+        CFHD_SampleBufferRef buffer;
+        uint32_t frame_num;
+        uint8_t *data;
+        size_t size;
+        int64_t pts;
+        int64_t duration;
+        AVBufferRef *picture;
+        uint8_t *picture_data;
+        int picture_pitch;
+        // when the picture was handed over and when its sample came back
+        int64_t submit_us;
+        int64_t done_us;
+        CFHD_EncodingQuality quality;
+
+        CFHD_Sample()
+        {
+            buffer = nullptr;
+            quality = CFHD_ENCODING_QUALITY_DEFAULT;
+            frame_num = 0;
+            data = nullptr;
+            size = 0;
+            picture = nullptr;
+            picture_data = nullptr;
+            picture_pitch = 0;
+            submit_us = 0;
+            done_us = 0;
+            pts = 0;
+            duration = 0;
+        }
+    };
+
+    CFHD_EncoderPoolRef pool;
+    CFHD_MetadataRef metadata;
+    CFHD_Sample sample;
+    CFHD_PixelFormat pix_fmt;
+    CFHD_EncodedFormat enc_fmt;
+    CFHD_EncodingFlags flags;
+    CFHD_EncodingQuality quality;
+    int width;
+    int height;
+    int threads;
+    int queue_size;
+    int queued;
+    // hold on to each picture until its sample is written (for -analyze)
+    bool b_keep_pictures;
+    // block on the pool for the next sample instead of polling every 10 ms (for -realtime)
+    bool b_wait;
+    // Samples are numbered for the SDK in submission order.  This keeps queue slots in step
+    // with the pool even when frame numbers do not start at 1 (as when resuming).
+    uint32_t submitted;
+    // queue keeps the pictures alive while the pool works on them
+    std::vector<CFHD_AVData> queue;
+
+    CFHD_Encoder(int width, int height, bool input_is_8_bit, int rgb, std::string quality,
+                 int trc, int threads)
+    {
+        this->quality = set_quality(quality);
+        this->width = width;
+        this->height = height;
+        pool = nullptr;
+        metadata = nullptr;
+        flags = CFHD_ENCODING_FLAGS_NONE;
+        queued = 0;
+        submitted = 0;
+        b_keep_pictures = false;
+        b_wait = false;
+
+        if (rgb)
+        {
+            // We scale everything to RGB48 because it simplifies things for us and because
+            // Cineform does that anyway so we're not wasting cycles.
+            pix_fmt = CFHD_PIXEL_FORMAT_RG48;
+            enc_fmt = CFHD_ENCODED_FORMAT_RGB_444;
+        }
+        else
+        {
+            // Cineform encodes 8-bit YUV efficiently; scaling to 10-bit here would waste cycles.
+            // We use v210 when our input video is already > 8-bit.
+            if (input_is_8_bit)
+                pix_fmt = CFHD_PIXEL_FORMAT_YUY2;
+            else
+                pix_fmt = CFHD_PIXEL_FORMAT_V210;
+            enc_fmt = CFHD_ENCODED_FORMAT_YUV_422;
+            if (trc == 0)
+            {
+                if (width <= 720)
+                    flags |= CFHD_ENCODING_FLAGS_YUV_601;
+            }
+            else if (trc == 601)
+                flags |= CFHD_ENCODING_FLAGS_YUV_601;
+        }
+
+        if (threads > 0) this->threads = threads;
+        else this->threads = default_threads();
+        queue_size = queue_for(this->threads);
+        av_log(nullptr, AV_LOG_INFO, "Encoding threads: %d\n", this->threads);
+    }
+
+    // pictures a pool of threads holds before the oldest must be taken
+    static int queue_for(int threads)
+    {
+        return (int)round((float)threads * 1.5);
+    }
+
+    ~CFHD_Encoder()
+    {
+        av_log(nullptr, AV_LOG_DEBUG, "CFHD_Encoder destructor called.\n");
+        if (sample.data)
+        {
+            CFHD_ReleaseSampleBuffer(pool, sample.buffer);
+            sample.buffer = nullptr;
             sample.data = nullptr;
         }
-        if (metadata)
+        if (metadata)
+        {
+            CFHD_MetadataClose(metadata);
+            metadata = nullptr;
+        }
+        if (pool)
+        {
+            CFHD_ReleaseEncoderPool(pool);
+            pool = nullptr;
+        }
+        // only once the pool is gone is nothing reading the pictures
+        for (CFHD_AVData &i : queue)
+            av_buffer_unref(&i.buf);
+        av_buffer_unref(&sample.picture);
+    }
+
+    // Holds at most depth pictures.  A pool thread has nothing to work on without a picture
+    // of its own, so the threads come down with the queue.  Before start().
+    void limit_queue(int depth)
+    {
+        queue_size = std::max(1, std::min(queue_size, depth));
+        threads = std::min(threads, queue_size);
+    }
+
+    // when the oldest picture in the pool was handed over
+    int64_t oldest_submit() const
+    {
+        return queued ? queue[(submitted - queued) % queue_size].submit_us : 0;
+    }
+
+    bool start();
+    bool push(AVBufferRef*, uint8_t*, int, uint32_t, int64_t, int64_t);
+    bool pop();
+    bool poll(bool*);
+    bool restart(CFHD_EncodingQuality);
+
+private:
+    CFHD_EncodingQuality set_quality(std::string);
+    bool take(uint32_t);
+};
+
+
+CFHD_EncodingQuality CFHD_Encoder::set_quality(std::string quality)
+{
+    const char *c_quality;
+    CFHD_EncodingQuality cfhd_quality = CFHD_ENCODING_QUALITY_DEFAULT;
+
+    if (quality == "low")
+    {
+        cfhd_quality = CFHD_ENCODING_QUALITY_LOW;
+        c_quality = "Low";
+    }
+    else if (quality == "medium")
+    {
+        cfhd_quality = CFHD_ENCODING_QUALITY_MEDIUM;
+        c_quality = "Medium";
+    }
+    else if (quality == "high")
+    {
+        cfhd_quality = CFHD_ENCODING_QUALITY_HIGH;
+        c_quality = "High";
+    }
+    else if (quality == "fs1")
+    {
+        cfhd_quality = CFHD_ENCODING_QUALITY_FILMSCAN1;
+        c_quality = "Film Scan 1";
+    }
+    else if (quality == "fs2")
+    {
+        cfhd_quality = CFHD_ENCODING_QUALITY_FILMSCAN2;
+        c_quality = "Film Scan 2";
+    }
+    else if (quality == "fs3")
+    {
+        cfhd_quality = CFHD_ENCODING_QUALITY_FILMSCAN3;
+        c_quality = "Film Scan 3";
+    }
+    av_log(nullptr, AV_LOG_INFO, "\nCineform quality: %s\n", c_quality);
+    return cfhd_quality;
+}
+
+
+bool CFHD_Encoder::start()
+{
+    CFHD_Error err = CFHD_ERROR_OKAY;
+
+    err = CFHD_MetadataOpen(&metadata);
+    if (err)
+    {
+        av_log(nullptr, AV_LOG_ERROR,
+               "CFHD_Encoder::start: MetadataOpen failed with error code: %d\n", err);
+        return false;
+    }
+    err = CFHD_CreateEncoderPool(&pool, threads, queue_size, nullptr);
+    if (err)
+    {
+        av_log(nullptr, AV_LOG_ERROR,
+               "CFHD_Encoder::start: CreateEncoderPool failed with error code: %d\n", err);
+        return false;
+    }
+    err = CFHD_AttachEncoderPoolMetadata(pool, metadata);
+    if (err)
+    {
+        av_log(nullptr, AV_LOG_ERROR,
+               "CFHD_Encoder::start: AttachEncoderPoolMetadata failed with error code: %d\n", err);
+        return false;
+    }
+    int videochannels = 1;  //1 - 2D, 2 - 3D;
+    err = CFHD_MetadataAdd(metadata, TAG_VIDEO_CHANNELS, METADATATYPE_UINT32, 4,
+                           (uint32_t *)&videochannels, false);
+    if (err)
+    {
+        av_log(nullptr, AV_LOG_ERROR,
+               "CFHD_Encoder::start: MetadataAdd failed with error code: %d\n", err);
+        return false;
+    }
+    err = CFHD_PrepareEncoderPool(pool, width, height, pix_fmt, enc_fmt, flags, quality);
+    if (err)
+    {
+        av_log(nullptr, AV_LOG_ERROR,
+               "CFHD_Encoder::start: PrepareEncoderPool failed with error code: %d\n", err);
+        return false;
+    }
+    err = CFHD_AttachEncoderPoolMetadata(pool, metadata);
+    if (err)
+    {
+        av_log(nullptr, AV_LOG_ERROR,
+               "CFHD_Encoder::start: AttachEncoderPoolMetadata failed with error code: %d\n", err);
+        return false;
+    }
+    err = CFHD_StartEncoderPool(pool);
+    if (err)
+    {
+        av_log(nullptr, AV_LOG_ERROR,
+               "CFHD_Encoder::start: StartEncoderPool failed with error code: %d\n", err);
+        return false;
+    }
+    return true;
+}
+
+
+// Sets a new quality for the samples that follow.  Every queued sample must have been
+// popped, since the pool is stopped and prepared again.
+bool CFHD_Encoder::restart(CFHD_EncodingQuality quality)
+{
+    CFHD_Error err;
+
+    this->quality = quality;
+    if ((err = CFHD_StopEncoderPool(pool)))
+    {
+        av_log(nullptr, AV_LOG_ERROR,
+               "CFHD_Encoder::restart: StopEncoderPool failed with error code: %d\n", err);
+        return false;
+    }
+    if ((err = CFHD_PrepareEncoderPool(pool, width, height, pix_fmt, enc_fmt, flags, quality)))
+    {
+        av_log(nullptr, AV_LOG_ERROR,
+               "CFHD_Encoder::restart: PrepareEncoderPool failed with error code: %d\n", err);
+        return false;
+    }
+    if ((err = CFHD_AttachEncoderPoolMetadata(pool, metadata)))
+    {
+        av_log(nullptr, AV_LOG_ERROR,
+               "CFHD_Encoder::restart: AttachEncoderPoolMetadata failed with error code: %d\n",
+               err);
+        return false;
+    }
+    if ((err = CFHD_StartEncoderPool(pool)))
+    {
+        av_log(nullptr, AV_LOG_ERROR,
+               "CFHD_Encoder::restart: StartEncoderPool failed with error code: %d\n", err);
+        return false;
+    }
+    return true;
+}
+
+
+// Queues the picture at data, which lies in buf, for encoding.
+bool CFHD_Encoder::push(AVBufferRef *buf, uint8_t *data, int pitch, uint32_t frame_num,
+                        int64_t pts, int64_t duration)
+{
+    CFHD_Error err = CFHD_ERROR_OKAY;
+    int64_t called = now_us();
+
+    while (1)
+    {
+        if (queued < queue_size)
+        {
+            err = CFHD_MetadataAdd(metadata, TAG_UNIQUE_FRAMENUM, METADATATYPE_UINT32, 4,
+                                   (uint32_t *)&(frame_num), false);
+            if (err)
+            {
+                av_log(nullptr, AV_LOG_ERROR,
+                       "CFHD_Encoder::push: MetadataAdd failed with error code: %d\n", err);
+                return false;
+            }
+
+            int i = submitted % queue_size;
+            if (i == queue.size())
+                queue.push_back(CFHD_AVData());
+            if (! (queue[i].buf = av_buffer_ref(buf)))
+            {
+                av_log(nullptr, AV_LOG_ERROR, "CFHD_Encoder::push: av_buffer_ref failed\n");
+                return false;
+            }
+            queue[i].data = data;
+            queue[i].pitch = pitch;
+            queue[i].frame_num = frame_num;
+            queue[i].pts = pts;
+            queue[i].duration = duration;
+            queue[i].submit_us = called;
+            queue[i].quality = quality;
+
+            submitted++;
+            err = CFHD_EncodeAsyncSample(pool, submitted, data, pitch, metadata);
+            if (err)
+            {
+                av_log(nullptr, AV_LOG_ERROR,
+                       "CFHD_Encoder::push: EncodeAsyncSample failed with error code: %d\n", err);
+                return false;
+            }
+            queued++;
+            return true;
+        }
+        else if (! pop())
+            return false;
+    }
+}
+
+
+bool CFHD_Encoder::pop()
+{
+    CFHD_Error err = CFHD_ERROR_OKAY;
+    uint32_t job_num;
+
+    if (b_wait)
+    {
+        err = CFHD_WaitForSample(pool, &job_num, &sample.buffer);
+        if (err)
+        {
+            av_log(nullptr, AV_LOG_ERROR,
+                   "CFHD_Encoder::pop: WaitForSample failed with error code: %d\n", err);
+            return false;
+        }
+        return take(job_num);
+    }
+    if (CFHD_ERROR_OKAY == CFHD_TestForSample(pool, &job_num, &sample.buffer))
+        return take(job_num);
+    usleep(10000);
+    return true;
+}
+
+
+// Takes a sample that is already done without waiting.  *b_taken says whether there was one.
+bool CFHD_Encoder::poll(bool *b_taken)
+{
+    uint32_t job_num;
+
+    *b_taken = queued > 0 &&
+               CFHD_ERROR_OKAY == CFHD_TestForSample(pool, &job_num, &sample.buffer);
+    return ! *b_taken || take(job_num);
+}
+
+
+bool CFHD_Encoder::take(uint32_t job_num)
+{
+    CFHD_Error err = CFHD_GetEncodedSample(sample.buffer, (void **)&sample.data, &sample.size);
+    if (err)
+    {
+        av_log(nullptr, AV_LOG_ERROR,
+               "CFHD_Encoder::take: GetEncodedSample failed with error code: %d\n", err);
+        return false;
+    }
+    int i = (job_num - 1) % queue_size;
+    sample.frame_num = queue[i].frame_num;
+    sample.pts = queue[i].pts;
+    sample.duration = queue[i].duration;
+    av_buffer_unref(&sample.picture);
+    sample.picture = queue[i].buf;
+    sample.picture_data = queue[i].data;
+    sample.picture_pitch = queue[i].pitch;
+    sample.submit_us = queue[i].submit_us;
+    sample.quality = queue[i].quality;
+    sample.done_us = now_us();
+    queue[i].buf = nullptr;
+    queued--;
+    // nothing reads the picture again, so it goes back to its pool now
+    if (! b_keep_pictures)
+        av_buffer_unref(&sample.picture);
+    return true;
+}
+
+
+// Keeps the started pools of finished encodes for later encodes with the same profile (size,
+// pixel format, flags, quality and thread count).  Preparing a pool costs about as much as
+// encoding a short clip, so -jobs and -watch hand each job a warm pool where they can.
+// Shared by the jobs that run at once.
+struct CFHD_EncoderCache
+{
+    // least recently used first
+    std::deque<CFHD_Encoder*> idle;
+    size_t max_idle;
+    uint32_t hits;
+    uint32_t misses;
+    std::mutex mutex;
+
+    CFHD_EncoderCache(size_t max_idle)
+    {
+        this->max_idle = max_idle;
+        hits = 0;
+        misses = 0;
+    }
+
+    ~CFHD_EncoderCache()
+    {
+        for (CFHD_Encoder *cfhd : idle)
+            delete cfhd;
+    }
+
+    bool reuse(CFHD_Encoder*&);
+    void release(CFHD_Encoder*);
+};
+
+
+// Swaps cfhd, which has not been started, for a warm encoder of the same profile.  False if
+// there is none, and cfhd is left to be started.
+bool CFHD_EncoderCache::reuse(CFHD_Encoder *&cfhd)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for (auto i = idle.rbegin(); i != idle.rend(); ++i)
+    {
+        CFHD_Encoder *warm = *i;
+        if (warm->width == cfhd->width && warm->height == cfhd->height &&
+            warm->pix_fmt == cfhd->pix_fmt && warm->enc_fmt == cfhd->enc_fmt &&
+            warm->flags == cfhd->flags && warm->quality == cfhd->quality &&
+            warm->threads == cfhd->threads && warm->queue_size == cfhd->queue_size)
+        {
+            idle.erase(std::next(i).base());
+            delete cfhd;
+            cfhd = warm;
+            hits++;
+            return true;
+        }
+    }
+    misses++;
+    return false;
+}
+
+
+// Takes back an encoder whose every sample has been written.  The least recently used pool
+// is closed when there are more than max_idle.
+void CFHD_EncoderCache::release(CFHD_Encoder *cfhd)
+{
+    CFHD_Encoder *evicted = nullptr;
+
+    if (cfhd->queued > 0 || cfhd->sample.data)
+    {
+        delete cfhd;
+        return;
+    }
+    av_buffer_unref(&cfhd->sample.picture);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        idle.push_back(cfhd);
+        if (idle.size() > max_idle)
+        {
+            evicted = idle.front();
+            idle.pop_front();
+        }
+    }
+    if (evicted)
+        delete evicted;
+}
+
+
+// Unpacks one v210 group: four 32-bit words of three 10-bit samples each, which hold six
+// pixels as Cb Y Cr, Y Cb Y, Cr Y Cb, Y Cr Y.
+static inline void unpack_v210_group(const uint32_t *w, uint16_t *y, uint16_t *cb, uint16_t *cr)
+{
+    cb[0] = w[0] & 0x3ff;
+    y[0] = (w[0] >> 10) & 0x3ff;
+    cr[0] = (w[0] >> 20) & 0x3ff;
+    y[1] = w[1] & 0x3ff;
+    cb[1] = (w[1] >> 10) & 0x3ff;
+    y[2] = (w[1] >> 20) & 0x3ff;
+    cr[1] = w[2] & 0x3ff;
+    y[3] = (w[2] >> 10) & 0x3ff;
+    cb[2] = (w[2] >> 20) & 0x3ff;
+    y[4] = w[3] & 0x3ff;
+    cr[2] = (w[3] >> 10) & 0x3ff;
+    y[5] = (w[3] >> 20) & 0x3ff;
+}
+
+
+// Unpacks an encoder input picture (YUY2, V210 or RG48) into one plane of samples per
+// component.  The chroma planes of 4:2:2 formats are half width.
+static void unpack_picture(CFHD_PixelFormat pix_fmt, const uint8_t *data, int pitch, int width,
+                           int height, std::vector<uint16_t> planes[3], int widths[3])
+{
+    bool b_rgb = pix_fmt == CFHD_PIXEL_FORMAT_RG48;
+    widths[0] = width;
+    widths[1] = widths[2] = b_rgb ? width : width / 2;
+    for (int c = 0; c < 3; c++)
+        planes[c].resize((size_t)widths[c] * height);
+
+    for (int y = 0; y < height; y++)
+    {
+        const uint8_t *row = data + (ptrdiff_t)pitch * y;
+        uint16_t *p0 = &planes[0][(size_t)widths[0] * y];
+        uint16_t *p1 = &planes[1][(size_t)widths[1] * y];
+        uint16_t *p2 = &planes[2][(size_t)widths[2] * y];
+
+        if (b_rgb)
+        {
+            const uint16_t *src = (const uint16_t*)row;
+            for (int x = 0; x < width; x++)
+            {
+                p0[x] = src[3 * x];
+                p1[x] = src[3 * x + 1];
+                p2[x] = src[3 * x + 2];
+            }
+        }
+        else if (pix_fmt == CFHD_PIXEL_FORMAT_V210)
+        {
+            // v210 rows always hold whole groups, so a last partial group (two or four
+            // pixels) is unpacked whole and cut short
+            const uint32_t *src = (const uint32_t*)row;
+            int groups = width / 6;
+            for (int g = 0; g < groups; g++)
+                unpack_v210_group(src + 4 * g, p0 + 6 * g, p1 + 3 * g, p2 + 3 * g);
+            if (width % 6)
+            {
+                uint16_t luma[6], cb[3], cr[3];
+                int rest = width % 6;
+                unpack_v210_group(src + 4 * groups, luma, cb, cr);
+                std::copy(luma, luma + rest, p0 + 6 * groups);
+                std::copy(cb, cb + rest / 2, p1 + 3 * groups);
+                std::copy(cr, cr + rest / 2, p2 + 3 * groups);
+            }
+        }
+        else
+            for (int x = 0; x < width / 2; x++)
+            {
+                p0[2 * x] = row[4 * x];
+                p1[x] = row[4 * x + 1];
+                p0[2 * x + 1] = row[4 * x + 2];
+                p2[x] = row[4 * x + 3];
+            }
+    }
+}
+
+
+// Sum of squared differences between two planes, over samples of up to 16 bits.  Each
+// square fits 32 bits unsigned, which keeps the loop to 32-bit lanes until the sum.
+static uint64_t plane_sse(const uint16_t *a, const uint16_t *b, size_t count)
+{
+    uint64_t sse = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t d = (uint32_t)((int32_t)a[i] - (int32_t)b[i]);
+        sse += d * d;
+    }
+    return sse;
+}
+
+
+// Adds a row of each plane to per-column sums of samples, squares and products.  Samples
+// are at most 16 bits, so each product fits 32 bits.
+static void column_sums(const uint16_t *__restrict a, const uint16_t *__restrict b, int count,
+                        uint32_t *__restrict s1, uint32_t *__restrict s2,
+                        uint64_t *__restrict ss, uint64_t *__restrict s12)
+{
+    for (int x = 0; x < count; x++)
+    {
+        uint32_t va = a[x], vb = b[x];
+        s1[x] += va;
+        s2[x] += vb;
+        ss[x] += (uint64_t)(va * va) + vb * vb;
+        s12[x] += va * vb;
+    }
+}
+
+
+// SSIM over 8x8 windows stepped by 4 pixels, as in x264 and FFmpeg.  Sums are taken over
+// 4x4 blocks, and each window adds up four neighbouring blocks.  A block row is summed a
+// whole image row at a time into column sums, which are then folded four to a block.  The
+// constants are FFmpeg's (ssim_end1x), so the numbers compare with its ssim filter.
+static double plane_ssim(const uint16_t *a, const uint16_t *b, int width, int height, int max)
+{
+    struct Sums { int64_t s1, s2, ss, s12; };
+    int bw = width / 4, bh = height / 4;
+    if (bw < 2 || bh < 2)
+        return 1.0;
+
+    std::vector<Sums> above(bw), below(bw);
+    std::vector<uint32_t> col_s1(4 * bw), col_s2(4 * bw);
+    std::vector<uint64_t> col_ss(4 * bw), col_s12(4 * bw);
+    auto block_row = [&](int by, std::vector<Sums> &sums)
+    {
+        std::fill(col_s1.begin(), col_s1.end(), 0);
+        std::fill(col_s2.begin(), col_s2.end(), 0);
+        std::fill(col_ss.begin(), col_ss.end(), 0);
+        std::fill(col_s12.begin(), col_s12.end(), 0);
+        for (int y = 4 * by; y < 4 * by + 4; y++)
+            column_sums(a + (size_t)width * y, b + (size_t)width * y, 4 * bw, col_s1.data(),
+                        col_s2.data(), col_ss.data(), col_s12.data());
+        for (int bx = 0; bx < bw; bx++)
+        {
+            Sums s = { 0, 0, 0, 0 };
+            for (int x = 4 * bx; x < 4 * bx + 4; x++)
+            {
+                s.s1 += col_s1[x];
+                s.s2 += col_s2[x];
+                s.ss += col_ss[x];
+                s.s12 += col_s12[x];
+            }
+            sums[bx] = s;
+        }
+    };
+
+    double c1 = 0.01 * 0.01 * max * max * 64;
+    double c2 = 0.03 * 0.03 * max * max * 64 * 63;
+    double total = 0;
+    int count = 0;
+    block_row(0, above);
+    for (int by = 1; by < bh; by++)
+    {
+        block_row(by, below);
+        for (int bx = 0; bx + 1 < bw; bx++)
+        {
+            double s1 = (double)(above[bx].s1 + above[bx + 1].s1 + below[bx].s1 + below[bx + 1].s1);
+            double s2 = (double)(above[bx].s2 + above[bx + 1].s2 + below[bx].s2 + below[bx + 1].s2);
+            double ss = (double)(above[bx].ss + above[bx + 1].ss + below[bx].ss + below[bx + 1].ss);
+            double s12 = (double)(above[bx].s12 + above[bx + 1].s12 + below[bx].s12 +
+                                  below[bx + 1].s12);
+            double vars = ss * 64 - s1 * s1 - s2 * s2;
+            double covar = s12 * 64 - s1 * s2;
+            total += (2 * s1 * s2 + c1) * (2 * covar + c2) / ((s1 * s1 + s2 * s2 + c1) * (vars + c2));
+            count++;
+        }
+        std::swap(above, below);
+    }
+    return total / count;
+}
+
+
+// Measures what an encode loses.  Each finished sample is decoded again by the SDK on the
+// task pool, at low priority so that it only takes threads the encode leaves idle, and is
+// compared with the picture the encoder was given.  PSNR and SSIM are taken per component
+// in the encoder input format, so no conversion muddies the numbers.
+struct CFHD_Analyzer
+{
+    struct Result
+    {
+        uint32_t frame_num;
+        double mse[3];
+        double ssim[3];
+    };
+
+    // Decoders are not thread safe, so each task borrows one with its scratch buffers.
+    struct Decoder
+    {
+        CFHD_DecoderRef ref;
+        bool b_prepared;
+        std::vector<uint8_t> picture;
+        std::vector<uint16_t> decoded[3];
+        std::vector<uint16_t> source[3];
+    };
+
+    CFHD_TaskPool *taskpool;
+    CFHD_PixelFormat pix_fmt;
+    int width;
+    int height;
+    int pitch;
+    int max_value;
+    // samples waiting to be analyzed hold on to their pictures, so only so many may queue;
+    // the ones that find the queue full are skipped
+    int max_pending;
+    uint32_t skipped;
+    CFHD_TaskPool::Group group;
+    std::mutex mutex;
+    std::vector<Decoder*> idle;
+    std::vector<Decoder*> decoders;
+    std::vector<Result> results;
+    std::atomic<bool> b_failed;
+
+    static int pending_for(CFHD_TaskPool *taskpool)
+    {
+        return taskpool->size() * 2 + 2;
+    }
+
+    CFHD_Analyzer(CFHD_TaskPool *taskpool, CFHD_PixelFormat pix_fmt, int width, int height)
+    {
+        this->taskpool = taskpool;
+        this->pix_fmt = pix_fmt;
+        this->width = width;
+        this->height = height;
+        max_pending = pending_for(taskpool);
+        skipped = 0;
+        b_failed = false;
+        // v210 rows are padded to 128 bytes
+        if (pix_fmt == CFHD_PIXEL_FORMAT_V210)
+        {
+            pitch = (width + 47) / 48 * 128;
+            max_value = 1023;
+        }
+        else if (pix_fmt == CFHD_PIXEL_FORMAT_RG48)
+        {
+            pitch = width * 6;
+            max_value = 65535;
+        }
+        else
+        {
+            pitch = width * 2;
+            max_value = 255;
+        }
+    }
+
+    ~CFHD_Analyzer()
+    {
+        taskpool->wait(&group);
+        for (Decoder *decoder : decoders)
+        {
+            if (decoder->ref) CFHD_CloseDecoder(decoder->ref);
+            delete decoder;
+        }
+    }
+
+    bool submit(const uint8_t*, size_t, AVBufferRef*, const uint8_t*, int, uint32_t);
+    bool finish();
+    bool is_rgb() { return pix_fmt == CFHD_PIXEL_FORMAT_RG48; }
+
+private:
+    void analyze(std::vector<uint8_t>&, AVBufferRef*, const uint8_t*, int, uint32_t);
+    Decoder *take_decoder();
+};
+
+
+// Queues a finished sample for analysis against the picture it was encoded from.  The
+// sample is copied, since the encoder reuses its buffer; the picture is referenced.  When
+// analysis has fallen behind, the sample is left out rather than hold up the encode, so
+// the figures cover a sample of the frames.
+bool CFHD_Analyzer::submit(const uint8_t *sample, size_t size, AVBufferRef *buf,
+                           const uint8_t *data, int source_pitch, uint32_t frame_num)
+{
+    if (b_failed)
+        return false;
+    if (group.pending >= max_pending)
+    {
+        skipped++;
+        return true;
+    }
+
+    AVBufferRef *ref = av_buffer_ref(buf);
+    if (! ref)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "CFHD_Analyzer::submit: av_buffer_ref failed\n");
+        return false;
+    }
+    std::shared_ptr<std::vector<uint8_t>> copy =
+        std::make_shared<std::vector<uint8_t>>(sample, sample + size);
+    taskpool->submit(&group, CFHD_TaskPool::PRIORITY_LOW,
+                     [this, copy, ref, data, source_pitch, frame_num]
+    {
+        analyze(*copy, ref, data, source_pitch, frame_num);
+    });
+    return true;
+}
+
+
+CFHD_Analyzer::Decoder *CFHD_Analyzer::take_decoder()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (! idle.empty())
+        {
+            Decoder *decoder = idle.back();
+            idle.pop_back();
+            return decoder;
+        }
+    }
+    Decoder *decoder = new Decoder();
+    decoder->ref = nullptr;
+    decoder->b_prepared = false;
+    CFHD_Error err = CFHD_OpenDecoder(&decoder->ref, nullptr);
+    std::lock_guard<std::mutex> lock(mutex);
+    decoders.push_back(decoder);
+    if (err)
+    {
+        av_log(nullptr, AV_LOG_ERROR,
+               "CFHD_Analyzer: OpenDecoder failed with error code: %d\n", err);
+        return nullptr;
+    }
+    return decoder;
+}
+
+
+void CFHD_Analyzer::analyze(std::vector<uint8_t> &sample, AVBufferRef *buf, const uint8_t *data,
+                            int source_pitch, uint32_t frame_num)
+{
+    Decoder *decoder = take_decoder();
+    CFHD_Error err = CFHD_ERROR_OKAY;
+
+    if (decoder && ! decoder->b_prepared)
+    {
+        int actual_width, actual_height;
+        CFHD_PixelFormat actual_fmt;
+        err = CFHD_PrepareToDecode(decoder->ref, width, height, pix_fmt,
+                                   CFHD_DECODED_RESOLUTION_FULL, CFHD_DECODING_FLAGS_NONE,
+                                   sample.data(), (int)sample.size(),
+                                   &actual_width, &actual_height, &actual_fmt);
+        if (! err && (actual_width != width || actual_height != height || actual_fmt != pix_fmt))
+            err = CFHD_ERROR_BADFORMAT;
+        decoder->b_prepared = ! err;
+        decoder->picture.resize((size_t)pitch * height);
+    }
+    if (decoder && ! err)
+        err = CFHD_DecodeSample(decoder->ref, sample.data(), (int)sample.size(),
+                                decoder->picture.data(), pitch);
+    if (! decoder || err)
+    {
+        if (decoder)
+            av_log(nullptr, AV_LOG_ERROR,
+                   "CFHD_Analyzer: decoding frame %u failed with error code: %d\n", frame_num, err);
+        b_failed = true;
+        av_buffer_unref(&buf);
+        return;
+    }
+
+    int widths[3];
+    unpack_picture(pix_fmt, decoder->picture.data(), pitch, width, height, decoder->decoded, widths);
+    unpack_picture(pix_fmt, data, source_pitch, width, height, decoder->source, widths);
+    av_buffer_unref(&buf);
+
+    Result result;
+    result.frame_num = frame_num;
+    for (int c = 0; c < 3; c++)
+    {
+        size_t count = (size_t)widths[c] * height;
+        result.mse[c] = (double)plane_sse(decoder->source[c].data(), decoder->decoded[c].data(),
+                                          count) / count;
+        result.ssim[c] = plane_ssim(decoder->source[c].data(), decoder->decoded[c].data(),
+                                    widths[c], height, max_value);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    results.push_back(result);
+    idle.push_back(decoder);
+}
+
+
+// Waits for the queued samples and puts the results in frame order.
+bool CFHD_Analyzer::finish()
+{
+    taskpool->wait(&group);
+    std::sort(results.begin(), results.end(),
+              [](const Result &a, const Result &b) { return a.frame_num < b.frame_num; });
+    return ! b_failed;
+}
+
+
+// Picks the Cineform quality level segment by segment so that the video keeps within a bit
+// budget, with no trial encode.  Sample sizes are measured as they come back from the
+// encoder.  After each segment, the highest level expected to fit what is left of the
+// budget is chosen, so an early overshoot is paid back over the next few segments.
+struct CFHD_RateControl
+{
+    static const int LEVELS = 6;
+
+    double fps;
+    double frame_bits;
+    // the highest level allowed, and the one in use (indices into levels)
+    int max_level;
+    int level;
+    int segment_frames;
+    int frames;
+    double bits;
+    uint64_t total_frames;
+    double total_bits;
+    int switches;
+
+    // the state a checkpoint keeps, as "rate_<name> <value>" lines
+    static const int STATE_COUNT = 7;
+    static const char *const state_names[STATE_COUNT];
+
+    CFHD_RateControl(double bitrate, double fps, CFHD_EncodingQuality ceiling)
+    {
+        frame_bits = bitrate / fps;
+        max_level = LEVELS - 1;
+        for (int i = 0; i < LEVELS; i++)
+            if (levels()[i] == ceiling)
+                max_level = i;
+        level = max_level;
+        // two seconds per segment, with a short first one so a bad start is caught early
+        segment_frames = std::min(8, std::max(1, (int)lrint(fps * 2)));
+        frames = 0;
+        bits = 0;
+        total_frames = 0;
+        total_bits = 0;
+        switches = 0;
+        this->fps = fps;
+    }
+
+    static const CFHD_EncodingQuality *levels()
+    {
+        static const CFHD_EncodingQuality levels[LEVELS] =
+        {
+            CFHD_ENCODING_QUALITY_LOW, CFHD_ENCODING_QUALITY_MEDIUM, CFHD_ENCODING_QUALITY_HIGH,
+            CFHD_ENCODING_QUALITY_FILMSCAN1, CFHD_ENCODING_QUALITY_FILMSCAN2,
+            CFHD_ENCODING_QUALITY_FILMSCAN3
+        };
+        return levels;
+    }
+
+    CFHD_EncodingQuality quality() { return levels()[level]; }
+    const char *name()
+    {
+        static const char *names[LEVELS] = { "low", "medium", "high", "fs1", "fs2", "fs3" };
+        return names[level];
+    }
+    bool add_sample(size_t, CFHD_EncodingQuality);
+    double bitrate() { return total_frames ? total_bits / total_frames * fps : 0; }
+    void save(std::ostream&);
+    void restore(const std::string&, int64_t);
+};
+
+
+const char *const CFHD_RateControl::state_names[STATE_COUNT] =
+{
+    "level", "segment", "frames", "bits", "total_frames", "total_bits", "switches"
+};
+
+
+// Counts one encoded sample, encoded at quality.  Returns true when the segment ends with a
+// change of level.  The samples that were queued when the level changed come back at the
+// old level; they count against the budget, but the segment they belonged to has been
+// closed, and the new one measures the new level only.
+bool CFHD_RateControl::add_sample(size_t size, CFHD_EncodingQuality quality)
+{
+    // Rough sample size of each level relative to Film Scan 1.  Only the ratios between
+    // levels matter; the content's complexity comes from the segment just measured.
+    static const double scale[LEVELS] = { 0.45, 0.6, 0.75, 1.0, 1.3, 1.7 };
+
+    total_frames++;
+    total_bits += (double)size * 8;
+    if (quality != levels()[level])
+        return false;
+    frames++;
+    bits += (double)size * 8;
+    if (frames < segment_frames)
+        return false;
+
+    // spread what is over or under budget across the next four segments
+    segment_frames = std::max(1, (int)lrint(fps * 2));
+    double horizon = segment_frames * 4.0;
+    double allowed = (frame_bits * (total_frames + horizon) - total_bits) / horizon;
+    double complexity = bits / frames / scale[level];
+    int next = 0;
+    for (int i = max_level; i > 0; i--)
+    {
+        // stepping up needs 10% headroom, so the level does not flip back and forth
+        double headroom = i > level ? 0.9 : 1.0;
+        if (complexity * scale[i] <= allowed * headroom)
+        {
+            next = i;
+            break;
+        }
+    }
+    frames = 0;
+    bits = 0;
+    if (next == level)
+        return false;
+    level = next;
+    switches++;
+    return true;
+}
+
+
+void CFHD_RateControl::save(std::ostream &file)
+{
+    int64_t values[STATE_COUNT] = { level, segment_frames, frames, llrint(bits),
+                                    (int64_t)total_frames, llrint(total_bits), switches };
+    for (int i = 0; i < STATE_COUNT; i++)
+        file << "rate_" << state_names[i] << " " << values[i] << "\n";
+}
+
+
+// Takes back one value saved by save(), given its name without "rate_".
+void CFHD_RateControl::restore(const std::string &name, int64_t value)
+{
+    if (name == "level") level = std::min(std::max((int)value, 0), max_level);
+    else if (name == "segment") segment_frames = std::max(1, (int)value);
+    else if (name == "frames") frames = (int)value;
+    else if (name == "bits") bits = (double)value;
+    else if (name == "total_frames") total_frames = (uint64_t)value;
+    else if (name == "total_bits") total_bits = (double)value;
+    else if (name == "switches") switches = (int)value;
+}
+
+
+// Reads a numbered image sequence (DPX, EXR, TIFF, PNG...).  Several files are loaded and
+// decoded at once on the task pool, each slot with its own decoder, and frames are handed
+// over in order.  Files are opened one number at a time, so a sequence of any length starts
+// at once, and it ends at the first missing number.  Reads bypass the page cache (O_DIRECT)
+// where the filesystem allows it, since every file is read once.
+struct CFHD_SequenceReader
+{
+    struct Slot
+    {
+        AVCodecContext *dec_ctx;
+        AVFrame *frame;
+        int number;
+        int status;
+        CFHD_TaskPool::Group group;
+    };
+
+    std::string pattern;
+    CFHD_TaskPool *taskpool;
+    std::vector<Slot*> slots;
+    int first_number;
+    int next_number;
+    size_t next_slot;
+    bool b_eof;
+    CFHD_Trace *trace;
+
+    CFHD_SequenceReader(const char *pattern, int first_number, CFHD_TaskPool *taskpool)
+    {
+        this->pattern = pattern;
+        this->taskpool = taskpool;
+        trace = nullptr;
+        this->first_number = first_number;
+        next_number = first_number;
+        next_slot = 0;
+        b_eof = false;
+    }
+
+    ~CFHD_SequenceReader()
+    {
+        for (Slot *slot : slots)
+        {
+            taskpool->wait(&slot->group);
+            av_frame_free(&slot->frame);
+            avcodec_free_context(&slot->dec_ctx);
+            delete slot;
+        }
+    }
+
+    bool start(const AVCodec*, const AVCodecParameters*, int, int);
+    int read(AVFrame*);
+
+private:
+    void schedule(Slot*);
+    void load(Slot*);
+    int read_file(const char*, AVPacket*);
+};
+
+
+bool CFHD_SequenceReader::start(const AVCodec *codec, const AVCodecParameters *codecpar,
+                                int skip, int depth)
+{
+    int ret;
+
+    next_number += skip;
+    for (int i = 0; i < depth; i++)
+    {
+        Slot *slot = new Slot();
+        slots.push_back(slot);
+        slot->frame = av_frame_alloc();
+        slot->dec_ctx = avcodec_alloc_context3(codec);
+        if (! (slot->frame && slot->dec_ctx))
+        {
+            av_log(nullptr, AV_LOG_ERROR, "CFHD_SequenceReader: allocation failed\n");
+            return false;
+        }
+        if ((ret = avcodec_parameters_to_context(slot->dec_ctx, codecpar)) < 0 ||
+            (ret = avcodec_open2(slot->dec_ctx, codec, nullptr)) < 0)
+        {
+            av_log(nullptr, AV_LOG_ERROR,
+                   "CFHD_SequenceReader: opening the decoder failed:\n%s\n", av_err2str(ret));
+            return false;
+        }
+    }
+    for (Slot *slot : slots)
+        schedule(slot);
+    av_log(nullptr, AV_LOG_INFO, "Reading image sequence from number %d, %d files at a time\n",
+           next_number - depth, depth);
+    return true;
+}
+
+
+void CFHD_SequenceReader::schedule(Slot *slot)
+{
+    slot->number = next_number++;
+    taskpool->submit(&slot->group, CFHD_TaskPool::PRIORITY_NORMAL, [this, slot]
+    {
+        int64_t start = now_us();
+        load(slot);
+        if (trace)
+            trace->span("decode file", start, slot->number);
+    });
+}
+
+
+// Moves the next frame in sequence order into frame.  Returns AVERROR_EOF after the last one.
+int CFHD_SequenceReader::read(AVFrame *frame)
+{
+    if (b_eof)
+        return AVERROR_EOF;
+
+    Slot *slot = slots[next_slot];
+    taskpool->wait(&slot->group);
+    if (slot->status < 0)
+    {
+        b_eof = true;
+        if (slot->status != AVERROR_EOF)
+        {
+            char path[4096];
+            av_get_frame_filename(path, sizeof(path), pattern.c_str(), slot->number);
+            av_log(nullptr, AV_LOG_ERROR, "Failed to read '%s':\n%s\n", path,
+                   av_err2str(slot->status));
+        }
+        return slot->status;
+    }
+
+    av_frame_move_ref(frame, slot->frame);
+    // image2 numbers frames from the first file of the sequence in 1/framerate units
+    frame->pts = slot->number - first_number;
+    frame->pkt_duration = 1;
+    schedule(slot);
+    next_slot = (next_slot + 1) % slots.size();
+    return 0;
+}
+
+
+static void free_aligned(void *opaque, uint8_t *data)
+{
+    free(data);
+}
+
+
+int CFHD_SequenceReader::read_file(const char *path, AVPacket *pkt)
+{
+    const size_t align = 4096;
+    struct stat st;
+    void *data = nullptr;
+    int fd = -1;
+    bool b_direct = false;
+
+#ifdef O_DIRECT
+    fd = open(path, O_RDONLY | O_DIRECT);
+    b_direct = fd >= 0;
+#endif
+    if (fd < 0 && (fd = open(path, O_RDONLY)) < 0)
+        return errno == ENOENT ? AVERROR_EOF : AVERROR(errno);
+
+    if (fstat(fd, &st) < 0)
+    {
+        int ret = AVERROR(errno);
+        close(fd);
+        return ret;
+    }
+    // O_DIRECT wants aligned buffers and whole-block reads, and decoders want zeroed padding
+    size_t size = (size_t)st.st_size;
+    size_t alloc = (size + AV_INPUT_BUFFER_PADDING_SIZE + align - 1) & ~(align - 1);
+    if (posix_memalign(&data, align, alloc) != 0)
+    {
+        close(fd);
+        return AVERROR(ENOMEM);
+    }
+
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t n = ::read(fd, (uint8_t*)data + done, alloc - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        // some filesystems accept O_DIRECT at open and refuse it at read
+        if (n < 0 && errno == EINVAL && b_direct)
+        {
+            close(fd);
+            b_direct = false;
+            if ((fd = open(path, O_RDONLY)) >= 0 && lseek(fd, (off_t)done, SEEK_SET) >= 0)
+                continue;
+        }
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    if (fd >= 0)
+        close(fd);
+    if (done < size)
+    {
+        free(data);
+        return AVERROR(EIO);
+    }
+    memset((uint8_t*)data + size, 0, alloc - size);
+
+    pkt->buf = av_buffer_create((uint8_t*)data, (int)alloc, free_aligned, nullptr, 0);
+    if (! pkt->buf)
+    {
+        free(data);
+        return AVERROR(ENOMEM);
+    }
+    pkt->data = (uint8_t*)data;
+    pkt->size = (int)size;
+    pkt->flags |= AV_PKT_FLAG_KEY;
+    return 0;
+}
+
+
+void CFHD_SequenceReader::load(Slot *slot)
+{
+    char path[4096];
+    AVPacket *pkt = av_packet_alloc();
+
+    if (! pkt)
+    {
+        slot->status = AVERROR(ENOMEM);
+        return;
+    }
+    if (av_get_frame_filename(path, sizeof(path), pattern.c_str(), slot->number) < 0)
+        slot->status = AVERROR(EINVAL);
+    else
+        slot->status = read_file(path, pkt);
+
+    if (slot->status == 0)
+    {
+        slot->status = avcodec_send_packet(slot->dec_ctx, pkt);
+        if (slot->status == 0)
+            slot->status = avcodec_receive_frame(slot->dec_ctx, slot->frame);
+        // an image decoder that holds its frame back would be a surprise
+        if (slot->status == AVERROR(EAGAIN))
+            slot->status = AVERROR_INVALIDDATA;
+    }
+    av_packet_free(&pkt);
+}
+
+
+#ifdef HAVE_VSSCRIPT
+// The FFmpeg format that lays out the planes of a Vapoursynth format, or AV_PIX_FMT_NONE.
+// Both order the components Y, U, V or R, G, B; FFmpeg's planar RGB formats store G first,
+// which the component descriptors account for.
+static AVPixelFormat vs_pix_fmt(const VSVideoFormat &format)
+{
+    int components = format.colorFamily == cfGray ? 1 : 3;
+
+    for (const AVPixFmtDescriptor *desc = av_pix_fmt_desc_next(nullptr); desc;
+         desc = av_pix_fmt_desc_next(desc))
+    {
+        bool b_rgb = desc->flags & AV_PIX_FMT_FLAG_RGB;
+        bool b_float = desc->flags & AV_PIX_FMT_FLAG_FLOAT;
+        bool b_match = desc->nb_components == components &&
+                       ! (desc->flags & (AV_PIX_FMT_FLAG_BE | AV_PIX_FMT_FLAG_PAL |
+                                         AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_HWACCEL)) &&
+                       b_rgb == (format.colorFamily == cfRGB) &&
+                       b_float == (format.sampleType == stFloat) &&
+                       desc->log2_chroma_w == format.subSamplingW &&
+                       desc->log2_chroma_h == format.subSamplingH;
+        // one component per plane, with nothing else in its samples
+        for (int c = 0; b_match && c < components; c++)
+        {
+            const AVComponentDescriptor &comp = desc->comp[c];
+            b_match = comp.depth == format.bitsPerSample && comp.step == format.bytesPerSample &&
+                      comp.offset == 0 && comp.shift == 0;
+            for (int k = 0; k < c; k++)
+                b_match = b_match && desc->comp[k].plane != comp.plane;
+        }
+        if (b_match)
+            return av_pix_fmt_desc_get_id(desc);
+    }
+    return AV_PIX_FMT_NONE;
+}
+
+
+// Frames of a Vapoursynth script, evaluated in this process through the VSScript API rather
+// than piped in by vspipe.  <depth> frames are requested ahead and rendered on Vapoursynth's
+// own threads.  Each is handed out in order as an AVFrame over the VSFrame's planes, which
+// frees the VSFrame with its last reference, so the conversion to the encoder input reads
+// the planes where Vapoursynth rendered them.
+struct CFHD_VapourSynthReader
+{
+    struct Slot
+    {
+        const VSFrame *frame;
+        std::string error;
+        bool b_ready;
+    };
+
+    // what an AVFrame's buffer needs to free the VSFrame it wraps
+    struct FrameRef
+    {
+        const VSAPI *vsapi;
+        const VSFrame *frame;
+    };
+
+    std::string path;
+    int64_t frames;
+    AVRational frame_rate;
+
+    const VSSCRIPTAPI *vssapi;
+    const VSAPI *vsapi;
+    VSScript *script;
+    VSNode *node;
+    const VSVideoInfo *info;
+    AVPixelFormat pix_fmt;
+    std::vector<Slot> slots;
+    int next_frame;
+    int next_request;
+    // requests Vapoursynth has not answered yet
+    int pending;
+    std::mutex mutex;
+    std::condition_variable cond;
+
+    CFHD_VapourSynthReader(const char *path)
+    {
+        this->path = path;
+        frames = 0;
+        frame_rate = av_make_q(0, 1);
+        vssapi = nullptr;
+        vsapi = nullptr;
+        script = nullptr;
+        node = nullptr;
+        info = nullptr;
+        pix_fmt = AV_PIX_FMT_NONE;
+        next_frame = 0;
+        next_request = 0;
+        pending = 0;
+    }
+
+    ~CFHD_VapourSynthReader()
+    {
+        // every request is answered, even after an error, and the node must outlive them
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [this] { return pending == 0; });
+        lock.unlock();
+        for (Slot &slot : slots)
+            if (slot.frame) vsapi->freeFrame(slot.frame);
+        if (node) vsapi->freeNode(node);
+        if (script) vssapi->freeScript(script);
+    }
+
+    bool open(AVCodecParameters*);
+    bool start(int, int);
+    int read(AVFrame*);
+
+private:
+    void request();
+    static void VS_CC frame_done(void*, const VSFrame*, int, VSNode*, const char*);
+    static void free_frame(void*, uint8_t*);
+};
+
+
+// Evaluates the script and describes its output in par, with the color and aspect tags of
+// its first frame.
+bool CFHD_VapourSynthReader::open(AVCodecParameters *par)
+{
+    char error[1024];
+
+    if (! (vssapi = getVSScriptAPI(VSSCRIPT_API_VERSION)) ||
+        ! (vsapi = vssapi->getVSAPI(VAPOURSYNTH_API_VERSION)) ||
+        ! (script = vssapi->createScript(nullptr)))
+    {
+        av_log(nullptr, AV_LOG_ERROR, "Failed to initialize Vapoursynth\n");
+        return false;
+    }
+    // relative paths in the script are from its own folder, as with vspipe
+    vssapi->evalSetWorkingDir(script, 1);
+    if (vssapi->evaluateFile(script, path.c_str()))
+    {
+        av_log(nullptr, AV_LOG_ERROR, "Failed to evaluate '%s':\n%s\n", path.c_str(),
+               vssapi->getError(script));
+        return false;
+    }
+    if (! (node = vssapi->getOutputNode(script, 0)) || vsapi->getNodeType(node) != mtVideo)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "'%s' sets no video output\n", path.c_str());
+        return false;
+    }
+    info = vsapi->getVideoInfo(node);
+    if (info->format.colorFamily == cfUndefined || info->width <= 0 || info->height <= 0 ||
+        info->fpsNum <= 0 || info->fpsDen <= 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR,
+               "'%s' must have a constant format, frame size and frame rate\n", path.c_str());
+        return false;
+    }
+    if ((pix_fmt = vs_pix_fmt(info->format)) == AV_PIX_FMT_NONE)
+    {
+        char name[32];
+        vsapi->getVideoFormatName(&info->format, name);
+        av_log(nullptr, AV_LOG_ERROR, "Vapoursynth's %s has no FFmpeg pixel format\n", name);
+        return false;
+    }
+    frames = info->numFrames;
+    av_reduce(&frame_rate.num, &frame_rate.den, info->fpsNum, info->fpsDen, INT_MAX);
+
+    par->codec_type = AVMEDIA_TYPE_VIDEO;
+    par->codec_id = AV_CODEC_ID_RAWVIDEO;
+    par->format = pix_fmt;
+    par->width = info->width;
+    par->height = info->height;
+
+    const VSFrame *first = vsapi->getFrame(0, node, error, sizeof(error));
+    if (! first)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "Failed to get frame 0 of '%s':\n%s\n", path.c_str(),
+               error);
+        return false;
+    }
+    const VSMap *props = vsapi->getFramePropertiesRO(first);
+    auto prop = [this, props](const char *key, int64_t value) -> int64_t
+    {
+        int err = 0;
+        int64_t v = vsapi->mapGetInt(props, key, 0, &err);
+        return err ? value : v;
+    };
+    // Vapoursynth takes its matrix, transfer and primaries values from H.273, as FFmpeg does
+    par->color_space = (AVColorSpace)prop("_Matrix", AVCOL_SPC_UNSPECIFIED);
+    par->color_trc = (AVColorTransferCharacteristic)prop("_Transfer", AVCOL_TRC_UNSPECIFIED);
+    par->color_primaries = (AVColorPrimaries)prop("_Primaries", AVCOL_PRI_UNSPECIFIED);
+    int64_t range = prop("_ColorRange", -1);
+    par->color_range = range == 0 ? AVCOL_RANGE_JPEG :
+                       range == 1 ? AVCOL_RANGE_MPEG : AVCOL_RANGE_UNSPECIFIED;
+    int64_t sar_num = prop("_SARNum", 0);
+    int64_t sar_den = prop("_SARDen", 0);
+    if (sar_num > 0 && sar_den > 0)
+        av_reduce(&par->sample_aspect_ratio.num, &par->sample_aspect_ratio.den,
+                  sar_num, sar_den, INT_MAX);
+    vsapi->freeFrame(first);
+    return true;
+}
+
+
+// Requests the first <depth> frames from frame <skip> on.
+bool CFHD_VapourSynthReader::start(int skip, int depth)
+{
+    next_frame = skip;
+    next_request = skip;
+    slots.resize(depth);
+    for (Slot &slot : slots)
+    {
+        slot.frame = nullptr;
+        slot.b_ready = false;
+    }
+    for (int i = 0; i < depth; i++)
+        request();
+    av_log(nullptr, AV_LOG_INFO, "Rendering '%s' from frame %d, %d frames at a time\n",
+           path.c_str(), skip, depth);
+    return true;
+}
+
+
+void CFHD_VapourSynthReader::request()
+{
+    if (next_request >= frames)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending++;
+    }
+    // the callback can run before this returns, on this thread
+    vsapi->getFrameAsync(next_request++, node, frame_done, this);
+}
+
+
+void VS_CC CFHD_VapourSynthReader::frame_done(void *opaque, const VSFrame *frame, int n,
+                                              VSNode *node, const char *error)
+{
+    CFHD_VapourSynthReader *reader = (CFHD_VapourSynthReader*)opaque;
+    std::lock_guard<std::mutex> lock(reader->mutex);
+    Slot &slot = reader->slots[n % reader->slots.size()];
+
+    slot.frame = frame;
+    if (! frame)
+        slot.error = error ? error : "";
+    slot.b_ready = true;
+    reader->pending--;
+    reader->cond.notify_all();
+}
+
+
+void CFHD_VapourSynthReader::free_frame(void *opaque, uint8_t *data)
+{
+    FrameRef *ref = (FrameRef*)opaque;
+    ref->vsapi->freeFrame(ref->frame);
+    delete ref;
+}
+
+
+// Points frame at the planes of the next frame in order, and requests the frame <depth>
+// further on in its place.  Returns AVERROR_EOF after the last one.
+int CFHD_VapourSynthReader::read(AVFrame *frame)
+{
+    if (next_frame >= frames)
+        return AVERROR_EOF;
+
+    Slot &slot = slots[next_frame % slots.size()];
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [&slot] { return slot.b_ready; });
+    const VSFrame *f = slot.frame;
+    slot.frame = nullptr;
+    slot.b_ready = false;
+    lock.unlock();
+    if (! f)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "Failed to get frame %d of '%s':\n%s\n", next_frame,
+               path.c_str(), slot.error.c_str());
+        return AVERROR_EXTERNAL;
+    }
+
+    FrameRef *ref = new FrameRef();
+    ref->vsapi = vsapi;
+    ref->frame = f;
+    int size = (int)(vsapi->getStride(f, 0) * info->height);
+    frame->buf[0] = av_buffer_create((uint8_t*)vsapi->getReadPtr(f, 0), size, free_frame, ref,
+                                     AV_BUFFER_FLAG_READONLY);
+    if (! frame->buf[0])
+    {
+        vsapi->freeFrame(f);
+        delete ref;
+        return AVERROR(ENOMEM);
+    }
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+    for (int c = 0; c < desc->nb_components; c++)
+    {
+        frame->data[desc->comp[c].plane] = (uint8_t*)vsapi->getReadPtr(f, c);
+        frame->linesize[desc->comp[c].plane] = (int)vsapi->getStride(f, c);
+    }
+    frame->format = pix_fmt;
+    frame->width = info->width;
+    frame->height = info->height;
+    frame->pts = next_frame++;
+    frame->pkt_duration = 1;
+    request();
+    return 0;
+}
+#else
+// Without Vapoursynth, scripts go through vspipe as raw video.
+struct CFHD_VapourSynthReader
+{
+    int64_t frames;
+    AVRational frame_rate;
+
+    CFHD_VapourSynthReader(const char*)
+    {
+        frames = 0;
+        frame_rate = av_make_q(0, 1);
+    }
+
+    bool open(AVCodecParameters*)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "This cfenc was built without Vapoursynth.  "
+               "Pipe the script in with vspipe and -s, -r and -p instead.\n");
+        return false;
+    }
+
+    bool start(int, int) { return false; }
+    int read(AVFrame*) { return AVERROR_EOF; }
+};
+#endif
+
+
+// Frame count and key frames of the video stream, for -scan and -resume.  They come from
+// the demuxer's index when that holds every frame, otherwise from reading the packets (never
+// decoding them), with transport and program streams split by byte offset and read in
+// parallel.  The result is cached beside the input as <input>.cfidx and reused while the
+// input's size and modification time stay the same.
+struct CFHD_FrameIndex
+{
+    struct KeyFrame
+    {
+        // from 0, in packet order
+        int64_t frame;
+        // in the stream time base, the one the demuxer seeks by (dts where there is one)
+        int64_t ts;
+        // byte offset, or -1
+        int64_t pos;
+    };
+
+    // what one chunk of the file [start, end) holds, in packet order
+    struct Chunk
+    {
+        int64_t start;
+        int64_t end;
+        int64_t frames;
+        std::vector<KeyFrame> keyframes;
+        int status;
+        bool b_seek_failed;
+    };
+
+    int64_t frames;
+    std::vector<KeyFrame> keyframes;
+
+    CFHD_FrameIndex()
+    {
+        frames = 0;
+    }
+
+    bool build(const char*, AVFormatContext*, AVStream*, CFHD_TaskPool*);
+    const KeyFrame *key_before(int64_t, int64_t) const;
+    static bool by_bytes(AVFormatContext*);
+
+private:
+    static bool has_fragments(const char*);
+    bool from_demuxer(const char*, AVFormatContext*, AVStream*);
+    bool scan(const char*, AVFormatContext*, AVStream*, CFHD_TaskPool*);
+    static void scan_chunk(const char*, AVInputFormat*, bool, int, Chunk*);
+    bool load(const std::string&, const struct stat&, int);
+    void save(const std::string&, const struct stat&, int);
+};
+
+
+// Fills the index for stream of the open ifmt_ctx read from path.  Returns false when the
+// input cannot be indexed (a pipe, say) or reading it fails.
+bool CFHD_FrameIndex::build(const char *path, AVFormatContext *ifmt_ctx, AVStream *stream,
+                            CFHD_TaskPool *taskpool)
+{
+    struct stat st;
+    std::string cache = std::string(path) + ".cfidx";
+
+    if (strncmp(path, "pipe:", 5) == 0 || stat(path, &st) < 0 || ! S_ISREG(st.st_mode))
+        return false;
+    if (load(cache, st, stream->index))
+    {
+        av_log(nullptr, AV_LOG_INFO, "Frame index read from '%s'\n", cache.c_str());
+        return true;
+    }
+
+    int64_t start = now_us();
+    const char *how = "from the demuxer's index";
+    if (! from_demuxer(path, ifmt_ctx, stream))
+    {
+        how = "by reading the packets";
+        if (! scan(path, ifmt_ctx, stream, taskpool))
+            return false;
+    }
+    av_log(nullptr, AV_LOG_INFO, "Indexed %" PRId64 " frames (%zu key frames) %s in %1.2f seconds\n",
+           frames, keyframes.size(), how, (now_us() - start) / 1e6);
+    save(cache, st, stream->index);
+    return true;
+}
+
+
+// The last key frame before frame (in packet order) that is not after ts, or null when the
+// index has none.
+const CFHD_FrameIndex::KeyFrame *CFHD_FrameIndex::key_before(int64_t frame, int64_t ts) const
+{
+    const KeyFrame *key = nullptr;
+    for (const KeyFrame &k : keyframes)
+    {
+        if (k.frame >= frame)
+            break;
+        if (k.ts == AV_NOPTS_VALUE || ts == AV_NOPTS_VALUE || k.ts <= ts)
+            key = &k;
+    }
+    return key;
+}
+
+
+// Transport and program streams resync at any byte offset, so they are split and seeked by
+// position.
+bool CFHD_FrameIndex::by_bytes(AVFormatContext *ifmt_ctx)
+{
+    const char *name = ifmt_ctx->iformat->name;
+    return (strcmp(name, "mpegts") == 0 || strcmp(name, "mpeg") == 0) &&
+           ! (ifmt_ctx->iformat->flags & AVFMT_NO_BYTE_SEEK);
+}
+
+
+// True when a MOV/MP4 file has a top level moof box.  The demuxer's index only holds the
+// fragments it has read so far.
+bool CFHD_FrameIndex::has_fragments(const char *path)
+{
+    std::ifstream file(path, std::ios::binary);
+    unsigned char box[16];
+    int64_t pos = 0;
+
+    while (file.seekg(pos) && file.read((char*)box, 8))
+    {
+        if (memcmp(box + 4, "moof", 4) == 0)
+            return true;
+        uint64_t size = (uint64_t)box[0] << 24 | box[1] << 16 | box[2] << 8 | box[3];
+        if (size == 1)
+        {
+            if (! file.read((char*)box + 8, 8))
+                break;
+            size = 0;
+            for (int i = 8; i < 16; i++)
+                size = size << 8 | box[i];
+        }
+        // 0 runs to the end of the file
+        if (size < 8 || size > (uint64_t)INT64_MAX - pos)
+            break;
+        pos += size;
+    }
+    return false;
+}
+
+
+// mov, mp4 and avi with an idx1 load an entry for every frame when they open.  Other
+// demuxers index only some frames (matroska's cues list key frames), and a fragmented
+// MOV/MP4 only the fragments read so far, so the index is only taken when its entry count
+// is the header's frame count and the file has no fragments.
+bool CFHD_FrameIndex::from_demuxer(const char *path, AVFormatContext *ifmt_ctx,
+                                   AVStream *stream)
+{
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(58, 78, 100)
+    int count = avformat_index_get_entries_count(stream);
+    if (count <= 0 || count != stream->nb_frames)
+    {
+        if (count > 0)
+            av_log(nullptr, AV_LOG_DEBUG, "The index holds %d frames where the header says %"
+                   PRId64 "; reading the packets\n", count, stream->nb_frames);
+        return false;
+    }
+    if (strstr(ifmt_ctx->iformat->name, "mov") && has_fragments(path))
+    {
+        av_log(nullptr, AV_LOG_DEBUG, "The input is fragmented; reading the packets\n");
+        return false;
+    }
+    frames = count;
+    keyframes.clear();
+    for (int i = 0; i < count; i++)
+    {
+        const AVIndexEntry *entry = avformat_index_get_entry(stream, i);
+        if (entry->flags & AVINDEX_KEYFRAME)
+            keyframes.push_back({ i, entry->timestamp, entry->pos });
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+bool CFHD_FrameIndex::scan(const char *path, AVFormatContext *ifmt_ctx, AVStream *stream,
+                           CFHD_TaskPool *taskpool)
+{
+    int64_t size = ifmt_ctx->pb ? avio_size(ifmt_ctx->pb) : -1;
+    // each chunk takes the packets that start inside it
+    bool b_split = by_bytes(ifmt_ctx);
+    int count = 1;
+    if (b_split && size > 0)
+        count = (int)std::max((int64_t)1, std::min((int64_t)taskpool->size() + 1,
+                                                   size / (64 << 20)));
+
+    std::vector<Chunk> chunks(count);
+    CFHD_TaskPool::Group group;
+    for (int i = 0; i < count; i++)
+    {
+        chunks[i].start = size / count * i;
+        chunks[i].end = i + 1 < count ? size / count * (i + 1) : INT64_MAX;
+        chunks[i].frames = 0;
+        chunks[i].status = 0;
+        chunks[i].b_seek_failed = false;
+    }
+    // Stream indexes depend on the order streams turn up in, which differs between chunks
+    // of a transport stream, so those are matched by PID.
+    int key = b_split ? stream->id : stream->index;
+    for (int i = 1; i < count; i++)
+    {
+        Chunk *chunk = &chunks[i];
+        taskpool->submit(&group, CFHD_TaskPool::PRIORITY_NORMAL,
+                         [path, ifmt_ctx, b_split, key, chunk]
+        {
+            scan_chunk(path, ifmt_ctx->iformat, b_split, key, chunk);
+        });
+    }
+    scan_chunk(path, ifmt_ctx->iformat, b_split, key, &chunks[0]);
+    taskpool->wait(&group);
+
+    bool b_seek_failed = false;
+    for (Chunk &chunk : chunks)
+        b_seek_failed = b_seek_failed || chunk.b_seek_failed;
+    if (b_seek_failed)
+    {
+        av_log(nullptr, AV_LOG_DEBUG, "Byte seeking failed; indexing from the start instead\n");
+        chunks.resize(1);
+        chunks[0].end = INT64_MAX;
+        chunks[0].frames = 0;
+        chunks[0].keyframes.clear();
+        scan_chunk(path, ifmt_ctx->iformat, b_split, key, &chunks[0]);
+    }
+
+    frames = 0;
+    keyframes.clear();
+    for (Chunk &chunk : chunks)
+    {
+        if (chunk.status < 0 && chunk.status != AVERROR_EOF)
+        {
+            av_log(nullptr, AV_LOG_WARNING, "Indexing '%s' failed:\n%s\n", path,
+                   av_err2str(chunk.status));
+            return false;
+        }
+        for (KeyFrame k : chunk.keyframes)
+        {
+            k.frame += frames;
+            keyframes.push_back(k);
+        }
+        frames += chunk.frames;
+    }
+    return frames > 0;
+}
+
+
+// Counts the video packets that start in [chunk->start, chunk->end).  The video stream is
+// the one whose id (with b_by_id) or index is key.  All other streams are discarded, so
+// demuxers skip over their payload.
+void CFHD_FrameIndex::scan_chunk(const char *path, AVInputFormat *fmt, bool b_by_id, int key,
+                                 Chunk *chunk)
+{
+    AVFormatContext *ctx = nullptr;
+    AVPacket *pkt = av_packet_alloc();
+    int ret;
+
+    if (! pkt)
+    {
+        chunk->status = AVERROR(ENOMEM);
+        return;
+    }
+    if ((ret = avformat_open_input(&ctx, path, fmt, nullptr)) < 0)
+    {
+        chunk->status = ret;
+        av_packet_free(&pkt);
+        return;
+    }
+    auto is_video = [ctx, b_by_id, key](int index)
+    {
+        return b_by_id ? ctx->streams[index]->id == key : index == key;
+    };
+    for (unsigned i = 0; i < ctx->nb_streams; i++)
+        if (! is_video(i))
+            ctx->streams[i]->discard = AVDISCARD_ALL;
+    if (chunk->start > 0 && av_seek_frame(ctx, -1, chunk->start, AVSEEK_FLAG_BYTE) < 0)
+        chunk->b_seek_failed = true;
+
+    while (! chunk->b_seek_failed && (ret = av_read_frame(ctx, pkt)) >= 0)
+    {
+        bool b_video = pkt->stream_index < (int)ctx->nb_streams && is_video(pkt->stream_index);
+        // packets without a position belong to the chunk that read them
+        bool b_before = pkt->pos >= 0 && pkt->pos < chunk->start;
+        bool b_after = pkt->pos >= chunk->end;
+        if (b_video && ! b_before && ! b_after)
+        {
+            if (pkt->flags & AV_PKT_FLAG_KEY)
+                chunk->keyframes.push_back({ chunk->frames,
+                                             pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts,
+                                             pkt->pos });
+            chunk->frames++;
+        }
+        av_packet_unref(pkt);
+        if (b_after)
+            break;
+    }
+    chunk->status = ret;
+    av_packet_free(&pkt);
+    avformat_close_input(&ctx);
+}
+
+
+bool CFHD_FrameIndex::load(const std::string &cache, const struct stat &st, int index)
+{
+    std::ifstream file(cache);
+    std::string magic;
+    int version = 0, stream_index = -1;
+    int64_t size = -1, mtime = -1, count = -1;
+    size_t nb_keyframes = 0;
+
+    if (! (file >> magic >> version >> size >> mtime >> stream_index >> count >> nb_keyframes) ||
+        magic != "cfenc-index" || version != 3 || size != (int64_t)st.st_size ||
+        mtime != (int64_t)st.st_mtime || stream_index != index || count <= 0)
+        return false;
+    keyframes.resize(nb_keyframes);
+    for (KeyFrame &k : keyframes)
+        if (! (file >> k.frame >> k.ts >> k.pos))
+            return false;
+    frames = count;
+    return true;
+}
+
+
+// The cache is a convenience: an input in a read-only directory is simply indexed again
+// next time.
+void CFHD_FrameIndex::save(const std::string &cache, const struct stat &st, int index)
+{
+    std::ofstream file(cache);
+    if (! file)
+    {
+        av_log(nullptr, AV_LOG_DEBUG, "Cannot write the frame index to '%s'\n", cache.c_str());
+        return;
+    }
+    file << "cfenc-index 3\n" << (int64_t)st.st_size << " " << (int64_t)st.st_mtime << " "
+         << index << "\n" << frames << " " << keyframes.size() << "\n";
+    for (const KeyFrame &k : keyframes)
+        file << k.frame << " " << k.ts << " " << k.pos << "\n";
+}
+
+
+// Writes a non-seekable output (stdout or another pipe) through two large buffers: the
+// muxer fills one while a thread writes the other into the pipe.  The encode only stalls on
+// a slow reader once both buffers are full.
+struct CFHD_PipeWriter
+{
+    int fd;
+    size_t buffer_size;
+    std::vector<uint8_t> buffers[2];
+    // the muxer fills buffers[filling]; the writer thread owns the other one while b_pending
+    int filling;
+    // every flush of the muxer goes to the pipe at once (for -realtime)
+    bool b_flush;
+    bool b_pending;
+    bool b_stop;
+    bool b_error;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread thread;
+    AVIOContext *pb;
+
+    CFHD_PipeWriter(int fd, int pipe_size)
+    {
+        this->fd = fd;
+        filling = 0;
+        b_flush = false;
+        b_pending = false;
+        b_stop = false;
+        b_error = false;
+        pb = nullptr;
+
+#ifdef F_SETPIPE_SZ
+        if (pipe_size > 0 && fcntl(fd, F_SETPIPE_SZ, pipe_size) < 0)
+            av_log(nullptr, AV_LOG_WARNING, "Failed to set the pipe size to %d bytes\n", pipe_size);
+#endif
+        int size = pipe_size;
+#ifdef F_GETPIPE_SZ
+        if (size <= 0)
+            size = fcntl(fd, F_GETPIPE_SZ);
+#endif
+        // a few pipe-fulls per hand-off, so each write() call fills the pipe
+        buffer_size = std::max((size_t)std::max(size, 0) * 4, (size_t)(4 << 20));
+        buffers[0].reserve(buffer_size);
+        buffers[1].reserve(buffer_size);
+    }
+
+    ~CFHD_PipeWriter()
+    {
+        close();
+        if (pb)
+        {
+            av_freep(&pb->buffer);
+            avio_context_free(&pb);
+        }
+    }
+
+    bool open();
+    bool close();
+
+private:
+    static int write_packet(void*, uint8_t*, int);
+    bool hand_off();
+    void writer();
+};
+
+
+bool CFHD_PipeWriter::open()
+{
+    const int avio_size = 1 << 16;
+    uint8_t *avio_buffer = (uint8_t*)av_malloc(avio_size);
+
+    if (avio_buffer)
+        pb = avio_alloc_context(avio_buffer, avio_size, 1, this, nullptr, write_packet, nullptr);
+    if (! pb)
+    {
+        av_free(avio_buffer);
+        av_log(nullptr, AV_LOG_ERROR, "CFHD_PipeWriter: avio_alloc_context failed\n");
+        return false;
+    }
+    thread = std::thread(&CFHD_PipeWriter::writer, this);
+    return true;
+}
+
+
+// Flushes everything the muxer has written and waits for it to reach the pipe.
+bool CFHD_PipeWriter::close()
+{
+    if (! thread.joinable())
+        return ! b_error;
+    avio_flush(pb);
+    hand_off();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        b_stop = true;
+    }
+    cv.notify_all();
+    thread.join();
+    return ! b_error;
+}
+
+
+int CFHD_PipeWriter::write_packet(void *opaque, uint8_t *buf, int size)
+{
+    CFHD_PipeWriter *w = (CFHD_PipeWriter*)opaque;
+    std::vector<uint8_t> &front = w->buffers[w->filling];
+
+    front.insert(front.end(), buf, buf + size);
+    if ((front.size() >= w->buffer_size || w->b_flush) && ! w->hand_off())
+        return AVERROR(EIO);
+    return size;
+}
+
+
+bool CFHD_PipeWriter::hand_off()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this] { return ! b_pending; });
+    if (b_error)
+        return false;
+    filling ^= 1;
+    buffers[filling].clear();
+    b_pending = true;
+    cv.notify_all();
+    return true;
+}
+
+
+void CFHD_PipeWriter::writer()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (1)
+    {
+        cv.wait(lock, [this] { return b_pending || b_stop; });
+        if (! b_pending)
+            return;
+
+        std::vector<uint8_t> &back = buffers[filling ^ 1];
+        lock.unlock();
+        size_t done = 0;
+        bool b_ok = true;
+        while (done < back.size())
+        {
+            ssize_t n = write(fd, back.data() + done, back.size() - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                av_log(nullptr, AV_LOG_ERROR, "CFHD_PipeWriter: write failed: %s\n", strerror(errno));
+                b_ok = false;
+                break;
+            }
+            done += n;
+        }
+        lock.lock();
+        if (! b_ok)
+            b_error = true;
+        b_pending = false;
+        cv.notify_all();
+    }
+}
+
+
+// Muxes one output on its own thread.  Packets of every stream are queued as they are
+// produced, and the thread writes each batch that has gathered through the muxer's dts
+// interleaving.  Disk writes never hold up the encode unless the disk falls max_bytes
+// behind, and audio lands beside the video it plays with rather than wherever the encoder
+// happened to be when it was demuxed.
+struct CFHD_Muxer
+{
+    AVFormatContext *ofmt_ctx;
+    std::string path;
+    std::deque<AVPacket*> queue;
+    size_t queued_bytes;
+    size_t max_bytes;
+    // the thread is writing a batch
+    bool b_busy;
+    bool b_stop;
+    int status;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread thread;
+    CFHD_Trace *trace;
+
+    CFHD_Muxer(AVFormatContext *ofmt_ctx, const std::string &path)
+    {
+        this->ofmt_ctx = ofmt_ctx;
+        this->path = path;
+        queued_bytes = 0;
+        max_bytes = 256 << 20;
+        b_busy = false;
+        b_stop = false;
+        status = 0;
+        trace = nullptr;
+    }
+
+    ~CFHD_Muxer()
+    {
+        stop();
+        for (AVPacket *pkt : queue)
+            av_packet_free(&pkt);
+    }
+
+    void start() { thread = std::thread(&CFHD_Muxer::writer, this); }
+    bool write(const AVPacket*);
+    bool sync();
+    bool finish();
+
+private:
+    void stop();
+    void writer();
+};
+
+
+// Queues a new reference to pkt, whose timestamps are in its output stream's time base.
+// Packets whose data is not reference counted (encoded samples) are copied.
+bool CFHD_Muxer::write(const AVPacket *pkt)
+{
+    AVPacket *ref = av_packet_alloc();
+    int ret;
+
+    if (! ref || (ret = av_packet_ref(ref, pkt)) < 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "CFHD_Muxer: av_packet_ref failed\n");
+        av_packet_free(&ref);
+        return false;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this] { return queued_bytes < max_bytes || status < 0; });
+    if (status < 0)
+    {
+        av_packet_free(&ref);
+        return false;
+    }
+    queued_bytes += ref->size;
+    queue.push_back(ref);
+    cv.notify_all();
+    return true;
+}
+
+
+// Waits until every queued packet has been handed to the muxer.  The thread is then idle,
+// so the caller may use ofmt_ctx itself until it queues the next packet.
+bool CFHD_Muxer::sync()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this] { return (queue.empty() && ! b_busy) || status < 0; });
+    return status >= 0;
+}
+
+
+// Writes everything queued and stops the thread, ready for the trailer.
+bool CFHD_Muxer::finish()
+{
+    bool b_ok = sync();
+    stop();
+    return b_ok;
+}
+
+
+void CFHD_Muxer::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        b_stop = true;
+    }
+    cv.notify_all();
+    if (thread.joinable())
+        thread.join();
+}
+
+
+void CFHD_Muxer::writer()
+{
+    if (trace)
+        trace->name_thread("mux " + path);
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (1)
+    {
+        cv.wait(lock, [this] { return ! queue.empty() || b_stop; });
+        if (queue.empty())
+            return;
+
+        std::deque<AVPacket*> batch;
+        batch.swap(queue);
+        size_t bytes = queued_bytes;
+        int ret = status;
+        b_busy = true;
+        lock.unlock();
+        int64_t start = now_us();
+        for (AVPacket *pkt : batch)
+        {
+            // the muxer takes over the packet's reference
+            if (ret >= 0 && (ret = av_interleaved_write_frame(ofmt_ctx, pkt)) < 0)
+                av_log(nullptr, AV_LOG_ERROR,
+                       "CFHD_Muxer: av_interleaved_write_frame failed for '%s':\n%s\n",
+                       path.c_str(), av_err2str(ret));
+            av_packet_free(&pkt);
+        }
+        if (trace)
+            trace->span("write", start);
+        lock.lock();
+        queued_bytes -= bytes;
+        status = ret;
+        b_busy = false;
+        cv.notify_all();
+    }
+}
+
+
+// Reads one decoded sample as a signed 32-bit value, full scale at the top bit, whatever
+// the decoder's sample format.
+static int32_t read_sample(const uint8_t *p, AVSampleFormat fmt, int i)
+{
+    double v;
+
+    switch (fmt)
+    {
+        case AV_SAMPLE_FMT_U8:  return (p[i] - 128) * (1 << 24);
+        case AV_SAMPLE_FMT_S16: return ((const int16_t*)p)[i] * (1 << 16);
+        case AV_SAMPLE_FMT_S32: return ((const int32_t*)p)[i];
+        case AV_SAMPLE_FMT_S64: return (int32_t)(((const int64_t*)p)[i] >> 32);
+        case AV_SAMPLE_FMT_FLT: v = ((const float*)p)[i]; break;
+        case AV_SAMPLE_FMT_DBL: v = ((const double*)p)[i]; break;
+        default: return 0;
+    }
+    v *= 2147483648.0;
+    if (v >= 2147483647.0) return INT32_MAX;
+    if (v <= -2147483648.0) return INT32_MIN;
+    return (int32_t)lrint(v);
+}
+
+
+// Interleaves a decoded frame into the 16 or 32-bit samples the PCM encoders take.
+// pcm_s24le keeps the top 24 bits of each 32-bit sample.
+static void pack_samples(const AVFrame *src, AVFrame *dst)
+{
+    AVSampleFormat fmt = (AVSampleFormat)src->format;
+    bool b_planar = av_sample_fmt_is_planar(fmt);
+    int channels = dst->channels;
+
+    fmt = av_get_packed_sample_fmt(fmt);
+    for (int c = 0; c < channels; c++)
+    {
+        const uint8_t *p = src->extended_data[b_planar ? c : 0];
+        int first = b_planar ? 0 : c;
+        int step = b_planar ? 1 : channels;
+        if (dst->format == AV_SAMPLE_FMT_S16)
+        {
+            int16_t *out = (int16_t*)dst->data[0] + c;
+            for (int n = 0; n < src->nb_samples; n++)
+                out[n * channels] = (int16_t)(read_sample(p, fmt, first + n * step) >> 16);
+        }
+        else
+        {
+            int32_t *out = (int32_t*)dst->data[0] + c;
+            for (int n = 0; n < src->nb_samples; n++)
+                out[n * channels] = read_sample(p, fmt, first + n * step);
+        }
+    }
+}
+
+
+// Converts an audio stream that the output container cannot hold to PCM on its own thread,
+// so the job still reads the source once.  16-bit sources stay 16-bit; anything deeper,
+// including the float that lossy decoders give, becomes 24-bit.  Packets arrive in the
+// input's time base and leave through the output's muxer.
+struct CFHD_AudioTranscoder
+{
+    AVStream *ist;
+    AVStream *ost;
+    CFHD_Muxer *muxer;
+    AVCodecContext *dec_ctx;
+    AVCodecContext *enc_ctx;
+    AVFrame *frame;
+    AVFrame *pcm;
+    AVPacket *pkt;
+    int64_t next_pts;
+    std::deque<AVPacket*> queue;
+    size_t max_packets;
+    bool b_finish;
+    bool b_stop;
+    bool b_ok;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread thread;
+
+    CFHD_AudioTranscoder(AVStream *ist, AVStream *ost)
+    {
+        this->ist = ist;
+        this->ost = ost;
+        muxer = nullptr;
+        dec_ctx = nullptr;
+        enc_ctx = nullptr;
+        frame = av_frame_alloc();
+        pcm = av_frame_alloc();
+        pkt = av_packet_alloc();
+        next_pts = 0;
+        max_packets = 256;
+        b_finish = false;
+        b_stop = false;
+        b_ok = true;
+    }
+
+    ~CFHD_AudioTranscoder()
+    {
+        stop();
+        for (AVPacket *p : queue)
+            av_packet_free(&p);
+        if (enc_ctx) avcodec_free_context(&enc_ctx);
+        if (dec_ctx) avcodec_free_context(&dec_ctx);
+        av_packet_free(&pkt);
+        av_frame_free(&pcm);
+        av_frame_free(&frame);
+    }
+
+    static AVCodecID pcm_codec(const AVCodecParameters*);
+    bool open(AVCodecID);
+    void start(CFHD_Muxer *muxer)
+    {
+        this->muxer = muxer;
+        thread = std::thread(&CFHD_AudioTranscoder::worker, this);
+    }
+    bool write(const AVPacket*);
+    bool finish();
+
+private:
+    void stop();
+    void worker();
+    bool decode(const AVPacket*);
+    bool encode(const AVFrame*);
+};
+
+
+AVCodecID CFHD_AudioTranscoder::pcm_codec(const AVCodecParameters *par)
+{
+    int bits = par->bits_per_raw_sample;
+    if (bits == 0 && par->format >= 0)
+        bits = av_get_bytes_per_sample((AVSampleFormat)par->format) * 8;
+    return bits > 0 && bits <= 16 ? AV_CODEC_ID_PCM_S16LE : AV_CODEC_ID_PCM_S24LE;
+}
+
+
+// Opens the decoder and the PCM encoder, and describes the encoded stream in ost.  Call
+// before the output header is written.
+bool CFHD_AudioTranscoder::open(AVCodecID codec_id)
+{
+    int ret;
+    const AVCodec *dec = avcodec_find_decoder(ist->codecpar->codec_id);
+    const AVCodec *enc = avcodec_find_encoder(codec_id);
+
+    if (! frame || ! pcm || ! pkt)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "CFHD_AudioTranscoder: initialization failed\n");
+        return false;
+    }
+    if (! dec || ! enc)
+    {
+        AVCodecID missing = dec ? codec_id : ist->codecpar->codec_id;
+        av_log(nullptr, AV_LOG_ERROR, "CFHD_AudioTranscoder: no %s for %s\n",
+               dec ? "encoder" : "decoder", avcodec_get_name(missing));
+        return false;
+    }
+    if (! (dec_ctx = avcodec_alloc_context3(dec)) || ! (enc_ctx = avcodec_alloc_context3(enc)))
+    {
+        av_log(nullptr, AV_LOG_ERROR, "CFHD_AudioTranscoder: avcodec_alloc_context3 failed\n");
+        return false;
+    }
+    dec_ctx->pkt_timebase = ist->time_base;
+    if ((ret = avcodec_parameters_to_context(dec_ctx, ist->codecpar)) < 0 ||
+        (ret = avcodec_open2(dec_ctx, dec, nullptr)) < 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "CFHD_AudioTranscoder: opening the %s decoder failed:\n%s\n",
+               dec->name, av_err2str(ret));
+        return false;
+    }
+    if (dec_ctx->sample_rate <= 0 || dec_ctx->channels <= 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "CFHD_AudioTranscoder: stream #0:%d has no sample rate "
+               "or channel count\n", ist->index);
+        return false;
+    }
+
+    enc_ctx->sample_rate = dec_ctx->sample_rate;
+    enc_ctx->channels = dec_ctx->channels;
+    enc_ctx->channel_layout = dec_ctx->channel_layout ? dec_ctx->channel_layout :
+                              av_get_default_channel_layout(dec_ctx->channels);
+    enc_ctx->sample_fmt = codec_id == AV_CODEC_ID_PCM_S16LE ? AV_SAMPLE_FMT_S16 : AV_SAMPLE_FMT_S32;
+    enc_ctx->bits_per_raw_sample = codec_id == AV_CODEC_ID_PCM_S16LE ? 16 : 24;
+    enc_ctx->time_base = av_make_q(1, enc_ctx->sample_rate);
+    if ((ret = avcodec_open2(enc_ctx, enc, nullptr)) < 0 ||
+        (ret = avcodec_parameters_from_context(ost->codecpar, enc_ctx)) < 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "CFHD_AudioTranscoder: opening the %s encoder failed:\n%s\n",
+               enc->name, av_err2str(ret));
+        return false;
+    }
+    ost->codecpar->codec_tag = 0;
+    ost->time_base = enc_ctx->time_base;
+    return true;
+}
+
+
+// Queues a new reference to pkt, in the input stream's time base.
+bool CFHD_AudioTranscoder::write(const AVPacket *pkt)
+{
+    AVPacket *ref = av_packet_alloc();
+
+    if (! ref || av_packet_ref(ref, pkt) < 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "CFHD_AudioTranscoder: av_packet_ref failed\n");
+        av_packet_free(&ref);
+        return false;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this] { return queue.size() < max_packets || ! b_ok; });
+    if (! b_ok)
+    {
+        av_packet_free(&ref);
+        return false;
+    }
+    queue.push_back(ref);
+    cv.notify_all();
+    return true;
+}
+
+
+// Converts what is queued, drains the decoder and encoder into the muxer and stops the
+// thread.
+bool CFHD_AudioTranscoder::finish()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        b_finish = true;
+    }
+    cv.notify_all();
+    if (thread.joinable())
+        thread.join();
+    return b_ok;
+}
+
+
+// Abandons whatever is queued.
+void CFHD_AudioTranscoder::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        b_stop = true;
+    }
+    cv.notify_all();
+    if (thread.joinable())
+        thread.join();
+}
+
+
+void CFHD_AudioTranscoder::worker()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (1)
+    {
+        cv.wait(lock, [this] { return ! queue.empty() || b_finish || b_stop; });
+        if (b_stop || ! b_ok)
+            return;
+        if (queue.empty())
+            break;
+        AVPacket *in = queue.front();
+        queue.pop_front();
+        cv.notify_all();
+        lock.unlock();
+        bool b_done = decode(in);
+        av_packet_free(&in);
+        lock.lock();
+        if (! b_done)
+        {
+            b_ok = false;
+            cv.notify_all();
+            return;
+        }
+    }
+    lock.unlock();
+    // a null packet and frame flush the decoder and the encoder
+    bool b_done = decode(nullptr) && encode(nullptr);
+    lock.lock();
+    b_ok = b_ok && b_done;
+}
+
+
+bool CFHD_AudioTranscoder::decode(const AVPacket *in)
+{
+    int ret;
+
+    // a damaged packet loses its samples, as in FFmpeg, rather than the whole job
+    if ((ret = avcodec_send_packet(dec_ctx, in)) < 0)
+        av_log(nullptr, AV_LOG_WARNING, "Skipping an audio packet of stream #0:%d:\n%s\n",
+               ist->index, av_err2str(ret));
+    while ((ret = avcodec_receive_frame(dec_ctx, frame)) >= 0)
+    {
+        bool b_done = encode(frame);
+        av_frame_unref(frame);
+        if (! b_done)
+            return false;
+    }
+    if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "CFHD_AudioTranscoder: avcodec_receive_frame failed:\n%s\n",
+               av_err2str(ret));
+        return false;
+    }
+    return true;
+}
+
+
+bool CFHD_AudioTranscoder::encode(const AVFrame *in)
+{
+    int ret;
+
+    if (in)
+    {
+        if (in->channels != enc_ctx->channels)
+        {
+            av_log(nullptr, AV_LOG_WARNING, "Dropping audio of stream #0:%d with %d channels "
+                   "instead of %d\n", ist->index, in->channels, enc_ctx->channels);
+            return true;
+        }
+        pcm->format = enc_ctx->sample_fmt;
+        pcm->channels = enc_ctx->channels;
+        pcm->channel_layout = enc_ctx->channel_layout;
+        pcm->sample_rate = enc_ctx->sample_rate;
+        pcm->nb_samples = in->nb_samples;
+        if ((ret = av_frame_get_buffer(pcm, 0)) < 0)
+        {
+            av_log(nullptr, AV_LOG_ERROR, "CFHD_AudioTranscoder: av_frame_get_buffer failed:\n%s\n",
+                   av_err2str(ret));
+            return false;
+        }
+        pack_samples(in, pcm);
+        // samples follow on from the last frame where the decoder gives no timestamp
+        if (in->best_effort_timestamp != AV_NOPTS_VALUE)
+            next_pts = av_rescale_q(in->best_effort_timestamp, ist->time_base, enc_ctx->time_base);
+        pcm->pts = next_pts;
+        next_pts += in->nb_samples;
+    }
+    ret = avcodec_send_frame(enc_ctx, in ? pcm : nullptr);
+    av_frame_unref(pcm);
+    if (ret < 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "CFHD_AudioTranscoder: avcodec_send_frame failed:\n%s\n",
+               av_err2str(ret));
+        return false;
+    }
+    while ((ret = avcodec_receive_packet(enc_ctx, pkt)) >= 0)
+    {
+        av_packet_rescale_ts(pkt, enc_ctx->time_base, ost->time_base);
+        pkt->stream_index = ost->index;
+        bool b_done = muxer->write(pkt);
+        av_packet_unref(pkt);
+        if (! b_done)
+            return false;
+    }
+    if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "CFHD_AudioTranscoder: avcodec_receive_packet failed:\n%s\n",
+               av_err2str(ret));
+        return false;
+    }
+    return true;
+}
+
+
+// Box downscaling for proxies: each output sample is the mean of a scale x scale block.
+// Source rows are summed first, a whole row of samples at a time, then the sums are folded
+// horizontally.  Only the row sums vectorize; the folding is scalar.
+template <typename T>
+static void sum_rows(const uint8_t *src, int stride, int samples, int scale, uint32_t *acc)
+{
+    const T *row = (const T*)src;
+    for (int i = 0; i < samples; i++)
+        acc[i] = row[i];
+    for (int r = 1; r < scale; r++)
+    {
+        row = (const T*)(src + (ptrdiff_t)stride * r);
+        for (int i = 0; i < samples; i++)
+            acc[i] += row[i];
+    }
+}
+
+
+// Shrinks one plane of 16-bit samples.  step is the number of interleaved components:
+// 1 for a planar format, 3 for packed RGB.
+static void box_plane16(const AVFrame *src, AVFrame *dst, int plane, int width, int step,
+                        int scale, int y0, int y1, std::vector<uint32_t> &acc)
+{
+    int shift = scale == 4 ? 4 : 2;
+    int samples = width * scale * step;
+
+    acc.resize(samples);
+    for (int y = y0; y < y1; y++)
+    {
+        sum_rows<uint16_t>(src->data[plane] + (ptrdiff_t)src->linesize[plane] * y * scale,
+                           src->linesize[plane], samples, scale, acc.data());
+        uint16_t *out = (uint16_t*)(dst->data[plane] + (ptrdiff_t)dst->linesize[plane] * y);
+        for (int x = 0; x < width; x++)
+            for (int c = 0; c < step; c++)
+            {
+                uint32_t sum = 0;
+                for (int k = 0; k < scale; k++)
+                    sum += acc[(x * scale + k) * step + c];
+                out[x * step + c] = (uint16_t)((sum + (1 << (shift - 1))) >> shift);
+            }
+    }
+}
+
+
+// Shrinks packed YUYV.  Luma is averaged per pixel and chroma per macropixel.
+static void box_yuyv(const AVFrame *src, AVFrame *dst, int width, int scale, int y0, int y1,
+                     std::vector<uint32_t> &acc)
+{
+    int shift = scale == 4 ? 4 : 2;
+    int round = 1 << (shift - 1);
+    int samples = width * scale * 2;
+
+    acc.resize(samples);
+    for (int y = y0; y < y1; y++)
+    {
+        sum_rows<uint8_t>(src->data[0] + (ptrdiff_t)src->linesize[0] * y * scale,
+                          src->linesize[0], samples, scale, acc.data());
+        uint8_t *out = dst->data[0] + (ptrdiff_t)dst->linesize[0] * y;
+        for (int x = 0; x < width; x += 2)
+        {
+            uint32_t luma0 = 0, luma1 = 0, u = 0, v = 0;
+            for (int k = 0; k < scale; k++)
+            {
+                luma0 += acc[2 * (x * scale + k)];
+                luma1 += acc[2 * ((x + 1) * scale + k)];
+                u += acc[4 * (x / 2 * scale + k) + 1];
+                v += acc[4 * (x / 2 * scale + k) + 3];
+            }
+            out[2 * x] = (uint8_t)((luma0 + round) >> shift);
+            out[2 * x + 1] = (uint8_t)((u + round) >> shift);
+            out[2 * x + 2] = (uint8_t)((luma1 + round) >> shift);
+            out[2 * x + 3] = (uint8_t)((v + round) >> shift);
+        }
+    }
+}
+
+
+// Shrinks rows [y0, y1) of dst from src.  dst is one of the encoder input formats.
+static void box_down(const AVFrame *src, AVFrame *dst, int scale, int y0, int y1)
+{
+    std::vector<uint32_t> acc;
+
+    switch (dst->format)
+    {
+        case AV_PIX_FMT_YUYV422:
+            box_yuyv(src, dst, dst->width, scale, y0, y1, acc);
+            break;
+        case AV_PIX_FMT_RGB48LE:
+            box_plane16(src, dst, 0, dst->width, 3, scale, y0, y1, acc);
+            break;
+        case AV_PIX_FMT_YUV422P10LE:
+            box_plane16(src, dst, 0, dst->width, 1, scale, y0, y1, acc);
+            box_plane16(src, dst, 1, dst->width / 2, 1, scale, y0, y1, acc);
+            box_plane16(src, dst, 2, dst->width / 2, 1, scale, y0, y1, acc);
+            break;
+        default:
+            break;
+    }
+}
+
+
+// Fixed-point YUV <-> RGB conversion driven by the stream's color tags (-matrix fixed).
+// Samples are widened to 16-bit planar rows first, so one set of kernels serves every bit
+// depth and layout; the matrix then runs on whole rows, and packing to the encoder format
+// is a pass of its own.  YUV -> RGB uses Q13 coefficients and RGB -> YUV uses Q15, which
+// keeps every sum within 32 bits.  Each band brings its own scratch rows (scratch_size()).
+struct CFHD_ColorMatrix
+{
+    // YUV -> full range RGB48
+    int32_t y_offset;
+    int32_t cy, crv, cgu, cgv, cbu;
+    // full range RGB -> limited range YUV
+    int32_t yr, yg, yb, ur, ug, ub, vr, vg, vb;
+    // the input format and size, fixed for the whole encode
+    const AVPixFmtDescriptor *desc;
+    int width;
+    int height;
+
+    CFHD_ColorMatrix()
+    {
+        desc = nullptr;
+        width = 0;
+        height = 0;
+    }
+
+    void init(AVColorSpace colorspace, bool b_full_range, AVPixelFormat src, int width,
+              int height);
+    static bool supports(AVPixelFormat src, AVPixelFormat dst);
+    size_t scratch_size() const;
+    void yuv_to_rgb48(const AVFrame*, AVFrame*, int, int, uint16_t*) const;
+    void rgb_to_yuv422(const AVFrame*, AVFrame*, int, int, uint16_t*) const;
+};
+
+
+// b_full_range describes YUV input; RGB is always taken as full range.
+void CFHD_ColorMatrix::init(AVColorSpace colorspace, bool b_full_range, AVPixelFormat src,
+                            int width, int height)
+{
+    desc = av_pix_fmt_desc_get(src);
+    this->width = width;
+    this->height = height;
+    int depth = desc->comp[0].depth;
+
+    double kr = 0.2126, kb = 0.0722;
+    if (colorspace == AVCOL_SPC_BT470BG || colorspace == AVCOL_SPC_SMPTE170M)
+    {
+        kr = 0.299;
+        kb = 0.114;
+    }
+    else if (colorspace == AVCOL_SPC_BT2020_NCL)
+    {
+        kr = 0.2627;
+        kb = 0.0593;
+    }
+    double kg = 1 - kr - kb;
+
+    // input ranges in 16-bit terms
+    double y_range = 56064, c_range = 57344;
+    y_offset = 4096;
+    if (b_full_range)
+    {
+        y_range = c_range = (double)(((1 << depth) - 1) << (16 - depth));
+        y_offset = 0;
+    }
+    double sy = 65535 / y_range * 8192, sc = 65535 / c_range * 8192;
+    cy = (int32_t)lrint(sy);
+    crv = (int32_t)lrint(2 * (1 - kr) * sc);
+    cgu = (int32_t)lrint(2 * kb * (1 - kb) / kg * sc);
+    cgv = (int32_t)lrint(2 * kr * (1 - kr) / kg * sc);
+    cbu = (int32_t)lrint(2 * (1 - kb) * sc);
+
+    double dy = 56064.0 / 65535 * 32768, dc = 57344.0 / 65535 * 32768;
+    yr = (int32_t)lrint(kr * dy);
+    yg = (int32_t)lrint(kg * dy);
+    yb = (int32_t)lrint(kb * dy);
+    ur = (int32_t)lrint(-kr / (2 * (1 - kb)) * dc);
+    ug = (int32_t)lrint(-kg / (2 * (1 - kb)) * dc);
+    ub = (int32_t)lrint(0.5 * dc);
+    vr = (int32_t)lrint(0.5 * dc);
+    vg = (int32_t)lrint(-kg / (2 * (1 - kr)) * dc);
+    vb = (int32_t)lrint(-kb / (2 * (1 - kr)) * dc);
+}
+
+
+// The kernels take 8 to 16-bit YUV with 4:4:4, 4:2:2 or 4:2:0 chroma, planar, semi-planar
+// or packed, to RGB48, and 8 to 16-bit RGB in any layout to YUYV or yuv422p10.  swscale
+// does everything else, including XYZ, which has three components but is neither.
+bool CFHD_ColorMatrix::supports(AVPixelFormat src, AVPixelFormat dst)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(src);
+
+    if (! desc || desc->nb_components < 3 || strncmp(desc->name, "xyz", 3) == 0 ||
+        (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_HWACCEL |
+                        AV_PIX_FMT_FLAG_FLOAT | AV_PIX_FMT_FLAG_BAYER)))
+        return false;
+    for (int c = 0; c < 3; c++)
+    {
+        const AVComponentDescriptor &comp = desc->comp[c];
+        int word = comp.depth > 8 ? 16 : 8;
+        if (comp.depth < 8 || comp.depth > 16 || comp.shift + comp.depth > word)
+            return false;
+    }
+    if (desc->flags & AV_PIX_FMT_FLAG_RGB)
+        return dst == AV_PIX_FMT_YUYV422 || dst == AV_PIX_FMT_YUV422P10LE;
+    return dst == AV_PIX_FMT_RGB48LE && desc->log2_chroma_w <= 1 && desc->log2_chroma_h <= 1;
+}
+
+
+// Reads component c of row y as 16-bit samples.  b_stretch maps the sample's full range
+// onto 16 bits (for RGB); otherwise the sample is only shifted up, which keeps YUV black
+// level and chroma center exact.
+static void read_component(const AVFrame *frame, const AVPixFmtDescriptor *desc, int c, int y,
+                           int count, bool b_stretch, uint16_t *line)
+{
+    const AVComponentDescriptor &comp = desc->comp[c];
+    const uint8_t *row = frame->data[comp.plane] + (ptrdiff_t)frame->linesize[comp.plane] * y +
+                         comp.offset;
+    unsigned mask = (1u << comp.depth) - 1;
+    int up = 16 - comp.depth;
+    int down = b_stretch ? comp.depth - up : 16;
+
+    if (comp.depth > 8)
+    {
+        bool b_be = desc->flags & AV_PIX_FMT_FLAG_BE;
+        for (int x = 0; x < count; x++)
+        {
+            const uint8_t *p = row + (ptrdiff_t)x * comp.step;
+            unsigned v = b_be ? (p[0] << 8 | p[1]) : (p[1] << 8 | p[0]);
+            v = (v >> comp.shift) & mask;
+            line[x] = (uint16_t)(v << up | v >> down);
+        }
+    }
+    else
+        for (int x = 0; x < count; x++)
+        {
+            unsigned v = (row[(ptrdiff_t)x * comp.step] >> comp.shift) & mask;
+            line[x] = (uint16_t)(v << up | v >> down);
+        }
+}
+
+
+static inline uint16_t clip16(int32_t v)
+{
+    return (uint16_t)std::min(std::max(v, 0), 65535);
+}
+
+
+// The matrix passes work on separate rows, which the __restrict qualifiers promise the
+// compiler, so that each is a single loop over independent samples.
+static void matrix_to_rgb(const CFHD_ColorMatrix &m, const uint16_t *__restrict luma,
+                          const uint16_t *__restrict u, const uint16_t *__restrict v,
+                          uint16_t *__restrict r, uint16_t *__restrict g,
+                          uint16_t *__restrict b, int width)
+{
+    const int32_t y_offset = m.y_offset, cy = m.cy, crv = m.crv, cgu = m.cgu, cgv = m.cgv,
+                  cbu = m.cbu;
+    for (int x = 0; x < width; x++)
+    {
+        int32_t yy = cy * ((int32_t)luma[x] - y_offset) + (1 << 12);
+        int32_t uu = (int32_t)u[x] - 32768;
+        int32_t vv = (int32_t)v[x] - 32768;
+        r[x] = clip16((yy + crv * vv) >> 13);
+        g[x] = clip16((yy - cgu * uu - cgv * vv) >> 13);
+        b[x] = clip16((yy + cbu * uu) >> 13);
+    }
+}
+
+
+static void interleave_rgb(const uint16_t *__restrict r, const uint16_t *__restrict g,
+                           const uint16_t *__restrict b, uint16_t *__restrict out, int width)
+{
+    for (int x = 0; x < width; x++)
+    {
+        out[3 * x] = r[x];
+        out[3 * x + 1] = g[x];
+        out[3 * x + 2] = b[x];
+    }
+}
+
+
+// Luma for every pixel, and chroma for each pair from the pair's mean.  r, g and b hold
+// an even number of samples.
+static void matrix_to_yuv(const CFHD_ColorMatrix &m, const uint16_t *__restrict r,
+                          const uint16_t *__restrict g, const uint16_t *__restrict b,
+                          uint16_t *__restrict luma, uint16_t *__restrict u,
+                          uint16_t *__restrict v, int width)
+{
+    const int32_t yr = m.yr, yg = m.yg, yb = m.yb, ur = m.ur, ug = m.ug, ub = m.ub,
+                  vr = m.vr, vg = m.vg, vb = m.vb;
+    for (int x = 0; x < width; x++)
+        luma[x] = clip16((yr * r[x] + yg * g[x] + yb * b[x] + (4096 << 15) + (1 << 14)) >> 15);
+    for (int i = 0; i < (width + 1) / 2; i++)
+    {
+        int32_t ra = (r[2 * i] + r[2 * i + 1] + 1) >> 1;
+        int32_t ga = (g[2 * i] + g[2 * i + 1] + 1) >> 1;
+        int32_t ba = (b[2 * i] + b[2 * i + 1] + 1) >> 1;
+        u[i] = clip16((ur * ra + ug * ga + ub * ba + (32768 << 15) + (1 << 14)) >> 15);
+        v[i] = clip16((vr * ra + vg * ga + vb * ba + (32768 << 15) + (1 << 14)) >> 15);
+    }
+}
+
+
+// Samples of scratch a band needs: at most eight 16-bit rows, for either direction
+size_t CFHD_ColorMatrix::scratch_size() const
+{
+    return (size_t)(width + 1) * 8;
+}
+
+
+// Converts rows [y0, y1).  Chroma is interpolated up to full size assuming MPEG-2 siting:
+// horizontally co-sited with even pixels, vertically between two luma rows.
+void CFHD_ColorMatrix::yuv_to_rgb48(const AVFrame *src, AVFrame *dst, int y0, int y1,
+                                    uint16_t *scratch) const
+{
+    int cw = (width + (1 << desc->log2_chroma_w) - 1) >> desc->log2_chroma_w;
+    int ch = (height + (1 << desc->log2_chroma_h) - 1) >> desc->log2_chroma_h;
+    uint16_t *luma = scratch, *u = luma + width, *v = u + width;
+    uint16_t *r = v + width, *g = r + width, *b = g + width;
+    uint16_t *near = b + width, *far = near + cw;
+
+    for (int y = y0; y < y1; y++)
+    {
+        read_component(src, desc, 0, y, width, false, luma);
+        for (int c = 1; c < 3; c++)
+        {
+            uint16_t *full = c == 1 ? u : v;
+            uint16_t *line = desc->log2_chroma_w ? near : full;
+            if (desc->log2_chroma_h)
+            {
+                // weight the nearer chroma row 3:1
+                int row = y >> 1;
+                int other = y & 1 ? std::min(row + 1, ch - 1) : std::max(row - 1, 0);
+                read_component(src, desc, c, row, cw, false, line);
+                read_component(src, desc, c, other, cw, false, far);
+                for (int i = 0; i < cw; i++)
+                    line[i] = (uint16_t)((3 * line[i] + far[i] + 2) >> 2);
+            }
+            else
+                read_component(src, desc, c, y, cw, false, line);
+            // even pixels take their chroma sample, odd ones the mean of the two around
+            // them; the last pixel repeats the last sample
+            if (desc->log2_chroma_w)
+            {
+                for (int i = 0; i + 1 < cw; i++)
+                {
+                    full[2 * i] = line[i];
+                    full[2 * i + 1] = (uint16_t)((line[i] + line[i + 1] + 1) >> 1);
+                }
+                full[2 * cw - 2] = line[cw - 1];
+                if (2 * cw == width)
+                    full[2 * cw - 1] = line[cw - 1];
+            }
+        }
+
+        matrix_to_rgb(*this, luma, u, v, r, g, b, width);
+        interleave_rgb(r, g, b, (uint16_t*)(dst->data[0] + (ptrdiff_t)dst->linesize[0] * y),
+                       width);
+    }
+}
+
+
+// Converts rows [y0, y1) to YUYV or yuv422p10.  Each chroma sample comes from the mean of
+// its pair of pixels.
+void CFHD_ColorMatrix::rgb_to_yuv422(const AVFrame *src, AVFrame *dst, int y0, int y1,
+                                     uint16_t *scratch) const
+{
+    int cw = (width + 1) / 2;
+    // one sample more than the width, so that an odd last pixel pairs with itself
+    uint16_t *r = scratch, *g = r + width + 1, *b = g + width + 1, *luma = b + width + 1;
+    uint16_t *u = luma + width, *v = u + cw;
+
+    for (int y = y0; y < y1; y++)
+    {
+        read_component(src, desc, 0, y, width, true, r);
+        read_component(src, desc, 1, y, width, true, g);
+        read_component(src, desc, 2, y, width, true, b);
+        r[width] = r[width - 1];
+        g[width] = g[width - 1];
+        b[width] = b[width - 1];
+        matrix_to_yuv(*this, r, g, b, luma, u, v, width);
+
+        if (dst->format == AV_PIX_FMT_YUYV422)
+        {
+            uint8_t *out = dst->data[0] + (ptrdiff_t)dst->linesize[0] * y;
+            for (int i = 0; i < width / 2; i++)
+            {
+                out[4 * i]     = (uint8_t)std::min((luma[2 * i] + 128) >> 8, 255);
+                out[4 * i + 1] = (uint8_t)std::min((u[i] + 128) >> 8, 255);
+                out[4 * i + 2] = (uint8_t)std::min((luma[2 * i + 1] + 128) >> 8, 255);
+                out[4 * i + 3] = (uint8_t)std::min((v[i] + 128) >> 8, 255);
+            }
+        }
+        else
+        {
+            uint16_t *py = (uint16_t*)(dst->data[0] + (ptrdiff_t)dst->linesize[0] * y);
+            uint16_t *pu = (uint16_t*)(dst->data[1] + (ptrdiff_t)dst->linesize[1] * y);
+            uint16_t *pv = (uint16_t*)(dst->data[2] + (ptrdiff_t)dst->linesize[2] * y);
+            for (int x = 0; x < width; x++)
+                py[x] = (uint16_t)std::min((luma[x] + 32) >> 6, 1023);
+            for (int i = 0; i < cw; i++)
+            {
+                pu[i] = (uint16_t)std::min((u[i] + 32) >> 6, 1023);
+                pv[i] = (uint16_t)std::min((v[i] + 32) >> 6, 1023);
+            }
+        }
+    }
+}
+
+
+// Kernels for the input formats that reach an encoder input format without a color matrix:
+// 8-bit YUV to YUY2, deeper YUV straight to V210 (instead of swscale to yuv422p10 and then
+// libavcodec's v210 packer), and RGB of any depth and layout to RG48.  Each is a template
+// over the sample layout, so bit depth, byte order, chroma subsampling, pixel step and
+// component positions are constants, and a kernel looks nothing up per call.  Rows that
+// need staging go through scratch the caller owns (scratch_size() words per band).  On
+// x86 every kernel is built three times, for SSE2, AVX2 and AVX-512, and CFHD_Kernels
+// picks the widest the CPU runs.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    #define CFHD_KERNEL_DISPATCH 1
+#else
+    #define CFHD_KERNEL_DISPATCH 0
+#endif
+#define CFHD_KERNEL_INLINE inline __attribute__((always_inline))
+
+// Converts rows [y0, y1) of src into the encoder input at dst, pitch bytes per row, with
+// CFHD_Kernels::scratch_size() words of scratch
+typedef void (*CFHD_KernelFn)(const AVFrame*, uint8_t*, int, int, int, uint32_t*);
+
+
+// One sample of Depth bits, from a byte or from a 16-bit word of either byte order
+template <int Depth, bool BigEndian>
+static CFHD_KERNEL_INLINE unsigned load_sample(const uint8_t *p)
+{
+    if (Depth <= 8)
+        return p[0];
+    unsigned v = BigEndian ? (unsigned)p[0] << 8 | p[1] : (unsigned)p[1] << 8 | p[0];
+    return v & ((1u << Depth) - 1);
+}
+
+
+// 8-bit planar YUV to YUY2.  Chroma is sited and interpolated as in CFHD_ColorMatrix:
+// vertically subsampled rows weight the nearer row 3:1, and full chroma is averaged in pairs.
+template <int ChromaW, int ChromaH>
+struct CFHD_YUV8ToYUY2
+{
+    static CFHD_KERNEL_INLINE unsigned chroma(const uint8_t *near, const uint8_t *far, int i)
+    {
+        unsigned a = ChromaW ? near[i] : (near[2 * i] + near[2 * i + 1] + 1) >> 1;
+        if (! ChromaH)
+            return a;
+        unsigned b = ChromaW ? far[i] : (far[2 * i] + far[2 * i + 1] + 1) >> 1;
+        return (3 * a + b + 2) >> 2;
+    }
+
+    static CFHD_KERNEL_INLINE void run(const AVFrame *src, uint8_t *dst, int pitch, int y0, int y1,
+                                       uint32_t*)
+    {
+        int pairs = src->width / 2;
+        int ch = (src->height + ChromaH) >> ChromaH;
+
+        for (int y = y0; y < y1; y++)
+        {
+            int row = y >> ChromaH;
+            int other = ! ChromaH ? row : y & 1 ? std::min(row + 1, ch - 1) : std::max(row - 1, 0);
+            const uint8_t *luma = src->data[0] + (ptrdiff_t)src->linesize[0] * y;
+            const uint8_t *u0 = src->data[1] + (ptrdiff_t)src->linesize[1] * row;
+            const uint8_t *u1 = src->data[1] + (ptrdiff_t)src->linesize[1] * other;
+            const uint8_t *v0 = src->data[2] + (ptrdiff_t)src->linesize[2] * row;
+            const uint8_t *v1 = src->data[2] + (ptrdiff_t)src->linesize[2] * other;
+            uint8_t *out = dst + (ptrdiff_t)pitch * y;
+
+            for (int i = 0; i < pairs; i++)
+            {
+                out[4 * i]     = luma[2 * i];
+                out[4 * i + 1] = (uint8_t)chroma(u0, u1, i);
+                out[4 * i + 2] = luma[2 * i + 1];
+                out[4 * i + 3] = (uint8_t)chroma(v0, v1, i);
+            }
+        }
+    }
+};
+
+
+// 9 to 16-bit planar YUV to V210, which packs 6 pixels in four little-endian words of three
+// 10-bit samples: U0 Y0 V0, Y1 U1 Y2, V1 Y3 U2, Y4 V2 Y5.  Chroma is brought to 4:2:2 as for
+// YUY2 and deeper samples are rounded to 10 bits.  A partial group at the end of a row
+// repeats the last pixel.
+template <int Depth, bool BigEndian, int ChromaW, int ChromaH>
+struct CFHD_YUVToV210
+{
+    static const int bytes = 2;
+    static const int up = Depth < 10 ? 10 - Depth : 0;
+    static const int down = Depth > 10 ? Depth - 10 : 0;
+
+    static CFHD_KERNEL_INLINE unsigned to10(unsigned v)
+    {
+        if (Depth < 10)
+            return v << up;
+        return std::min((v + (1u << down >> 1)) >> down, 1023u);
+    }
+
+    static CFHD_KERNEL_INLINE unsigned sample(const uint8_t *row, int x)
+    {
+        return load_sample<Depth, BigEndian>(row + (ptrdiff_t)x * bytes);
+    }
+
+    // chroma sample i of a row, at 4:2:2 width, from samples a and b of a 4:4:4 row
+    static CFHD_KERNEL_INLINE unsigned chroma422(const uint8_t *row, int i, int a, int b)
+    {
+        if (ChromaW)
+            return sample(row, i);
+        return (sample(row, a) + sample(row, b) + 1) >> 1;
+    }
+
+    static CFHD_KERNEL_INLINE unsigned chroma(const uint8_t *near, const uint8_t *far, int i,
+                                              int a, int b)
+    {
+        unsigned c = chroma422(near, i, a, b);
+        if (! ChromaH)
+            return to10(c);
+        return to10((3 * c + chroma422(far, i, a, b) + 2) >> 2);
+    }
+
+    // Packs a row staged in the scratch, which never overlaps the picture
+    static CFHD_KERNEL_INLINE void pack(const uint32_t *__restrict luma,
+                                        const uint32_t *__restrict u,
+                                        const uint32_t *__restrict v, uint32_t *__restrict out,
+                                        int groups)
+    {
+        for (int g = 0; g < groups; g++)
+        {
+            const uint32_t *gy = luma + 6 * g, *gu = u + 3 * g, *gv = v + 3 * g;
+            out[4 * g]     = gu[0] | gy[0] << 10 | gv[0] << 20;
+            out[4 * g + 1] = gy[1] | gu[1] << 10 | gy[2] << 20;
+            out[4 * g + 2] = gv[1] | gy[3] << 10 | gu[2] << 20;
+            out[4 * g + 3] = gy[4] | gv[2] << 10 | gy[5] << 20;
+        }
+    }
+
+    static CFHD_KERNEL_INLINE void run(const AVFrame *src, uint8_t *dst, int pitch, int y0, int y1,
+                                       uint32_t *scratch)
+    {
+        int width = src->width;
+        int groups = (width + 5) / 6;
+        int cw = (width + 1) / 2;
+        // 4:4:4 chroma of an odd width has a last sample with no pair, taken on its own
+        int pairs = ChromaW ? cw : width / 2;
+        int ch = (src->height + ChromaH) >> ChromaH;
+        uint32_t *luma = scratch, *u = luma + groups * 6, *v = u + groups * 3;
+
+        for (int y = y0; y < y1; y++)
+        {
+            int row = y >> ChromaH;
+            int other = ! ChromaH ? row : y & 1 ? std::min(row + 1, ch - 1) : std::max(row - 1, 0);
+            const uint8_t *py = src->data[0] + (ptrdiff_t)src->linesize[0] * y;
+            const uint8_t *u0 = src->data[1] + (ptrdiff_t)src->linesize[1] * row;
+            const uint8_t *u1 = src->data[1] + (ptrdiff_t)src->linesize[1] * other;
+            const uint8_t *v0 = src->data[2] + (ptrdiff_t)src->linesize[2] * row;
+            const uint8_t *v1 = src->data[2] + (ptrdiff_t)src->linesize[2] * other;
+
+            for (int x = 0; x < width; x++)
+                luma[x] = to10(sample(py, x));
+            for (int i = 0; i < pairs; i++)
+            {
+                u[i] = chroma(u0, u1, i, 2 * i, 2 * i + 1);
+                v[i] = chroma(v0, v1, i, 2 * i, 2 * i + 1);
+            }
+            if (pairs < cw)
+            {
+                u[pairs] = chroma(u0, u1, pairs, width - 1, width - 1);
+                v[pairs] = chroma(v0, v1, pairs, width - 1, width - 1);
+            }
+            for (int x = width; x < groups * 6; x++)
+                luma[x] = luma[width - 1];
+            for (int i = cw; i < groups * 3; i++)
+            {
+                u[i] = u[cw - 1];
+                v[i] = v[cw - 1];
+            }
+            pack(luma, u, v, (uint32_t*)(dst + (ptrdiff_t)pitch * y), groups);
+        }
+    }
+};
+
+
+// RGB to RG48, each sample's range stretched onto 16 bits as read_component does.  Step is
+// the distance in bytes between one pixel's sample of a component and the next one's, so
+// planar and packed layouts share the kernel.  Planar formats (Step 1 or 2) are FFmpeg's
+// GBR plane order; packed ones hold R, G and B at byte offsets ROff, GOff and BOff.
+template <int Depth, bool BigEndian, int Step, int ROff = 0, int GOff = 0, int BOff = 0>
+struct CFHD_RGBToRG48
+{
+    static const bool planar = Step <= 2;
+
+    static CFHD_KERNEL_INLINE uint16_t stretch(unsigned v)
+    {
+        return (uint16_t)(v << (16 - Depth) | v >> (2 * Depth - 16 > 0 ? 2 * Depth - 16 : 0));
+    }
+
+    static CFHD_KERNEL_INLINE void run(const AVFrame *src, uint8_t *dst, int pitch, int y0, int y1,
+                                       uint32_t*)
+    {
+        int width = src->width;
+
+        for (int y = y0; y < y1; y++)
+        {
+            const uint8_t *r = src->data[planar ? 2 : 0] +
+                               (ptrdiff_t)src->linesize[planar ? 2 : 0] * y + ROff;
+            const uint8_t *g = src->data[0] + (ptrdiff_t)src->linesize[0] * y + GOff;
+            const uint8_t *b = src->data[planar ? 1 : 0] +
+                               (ptrdiff_t)src->linesize[planar ? 1 : 0] * y + BOff;
+            uint16_t *out = (uint16_t*)(dst + (ptrdiff_t)pitch * y);
+
+            for (int x = 0; x < width; x++)
+            {
+                out[3 * x]     = stretch(load_sample<Depth, BigEndian>(r + (ptrdiff_t)x * Step));
+                out[3 * x + 1] = stretch(load_sample<Depth, BigEndian>(g + (ptrdiff_t)x * Step));
+                out[3 * x + 2] = stretch(load_sample<Depth, BigEndian>(b + (ptrdiff_t)x * Step));
+            }
+        }
+    }
+};
+
+
+// The same kernel compiled for each instruction set.  The kernel's run() is inlined, so its
+// loops are compiled for the instruction set of the function they land in; which of them
+// the compiler vectorizes is listed by -fopt-info-vec.
+template <class K>
+static void kernel_base(const AVFrame *src, uint8_t *dst, int pitch, int y0, int y1,
+                        uint32_t *scratch)
+{
+    K::run(src, dst, pitch, y0, y1, scratch);
+}
+
+#if CFHD_KERNEL_DISPATCH
+template <class K>
+__attribute__((target("avx2")))
+static void kernel_avx2(const AVFrame *src, uint8_t *dst, int pitch, int y0, int y1,
+                        uint32_t *scratch)
+{
+    K::run(src, dst, pitch, y0, y1, scratch);
+}
+
+template <class K>
+__attribute__((target("avx512f,avx512bw")))
+static void kernel_avx512(const AVFrame *src, uint8_t *dst, int pitch, int y0, int y1,
+                          uint32_t *scratch)
+{
+    K::run(src, dst, pitch, y0, y1, scratch);
+}
+
+    #define CFHD_KERNEL(src, dst, ...) \
+        { src, dst, { kernel_base<__VA_ARGS__>, kernel_avx2<__VA_ARGS__>, \
+                      kernel_avx512<__VA_ARGS__> } }
+#else
+    #define CFHD_KERNEL(src, dst, ...) \
+        { src, dst, { kernel_base<__VA_ARGS__>, kernel_base<__VA_ARGS__>, \
+                      kernel_base<__VA_ARGS__> } }
+#endif
+
+
+struct CFHD_Kernels
+{
+    enum Isa { ISA_BASE, ISA_AVX2, ISA_AVX512, ISA_COUNT };
+
+    struct Entry
+    {
+        AVPixelFormat src;
+        CFHD_PixelFormat dst;
+        CFHD_KernelFn fn[ISA_COUNT];
+    };
+
+    static const Entry *table(size_t*);
+    static int isa();
+    static const char *isa_name(int);
+    static CFHD_KernelFn find(AVPixelFormat, CFHD_PixelFormat);
+    static int pitch(CFHD_PixelFormat, int);
+    static size_t scratch_size(int);
+};
+
+
+#define CFHD_YUY2 CFHD_PIXEL_FORMAT_YUY2
+#define CFHD_V210 CFHD_PIXEL_FORMAT_V210
+#define CFHD_RG48 CFHD_PIXEL_FORMAT_RG48
+#define CFHD_V210_KERNELS(sub, w, h) \
+    CFHD_KERNEL(AV_PIX_FMT_YUV##sub##P9LE,  CFHD_V210, CFHD_YUVToV210<9,  false, w, h>), \
+    CFHD_KERNEL(AV_PIX_FMT_YUV##sub##P9BE,  CFHD_V210, CFHD_YUVToV210<9,  true,  w, h>), \
+    CFHD_KERNEL(AV_PIX_FMT_YUV##sub##P10LE, CFHD_V210, CFHD_YUVToV210<10, false, w, h>), \
+    CFHD_KERNEL(AV_PIX_FMT_YUV##sub##P10BE, CFHD_V210, CFHD_YUVToV210<10, true,  w, h>), \
+    CFHD_KERNEL(AV_PIX_FMT_YUV##sub##P12LE, CFHD_V210, CFHD_YUVToV210<12, false, w, h>), \
+    CFHD_KERNEL(AV_PIX_FMT_YUV##sub##P12BE, CFHD_V210, CFHD_YUVToV210<12, true,  w, h>), \
+    CFHD_KERNEL(AV_PIX_FMT_YUV##sub##P14LE, CFHD_V210, CFHD_YUVToV210<14, false, w, h>), \
+    CFHD_KERNEL(AV_PIX_FMT_YUV##sub##P14BE, CFHD_V210, CFHD_YUVToV210<14, true,  w, h>), \
+    CFHD_KERNEL(AV_PIX_FMT_YUV##sub##P16LE, CFHD_V210, CFHD_YUVToV210<16, false, w, h>), \
+    CFHD_KERNEL(AV_PIX_FMT_YUV##sub##P16BE, CFHD_V210, CFHD_YUVToV210<16, true,  w, h>)
+
+const CFHD_Kernels::Entry *CFHD_Kernels::table(size_t *count)
+{
+    static const Entry entries[] =
+    {
+        CFHD_KERNEL(AV_PIX_FMT_YUV420P, CFHD_YUY2, CFHD_YUV8ToYUY2<1, 1>),
+        CFHD_KERNEL(AV_PIX_FMT_YUV422P, CFHD_YUY2, CFHD_YUV8ToYUY2<1, 0>),
+        CFHD_KERNEL(AV_PIX_FMT_YUV444P, CFHD_YUY2, CFHD_YUV8ToYUY2<0, 0>),
+        CFHD_KERNEL(AV_PIX_FMT_YUV440P, CFHD_YUY2, CFHD_YUV8ToYUY2<0, 1>),
+        CFHD_V210_KERNELS(420, 1, 1),
+        CFHD_V210_KERNELS(422, 1, 0),
+        CFHD_V210_KERNELS(444, 0, 0),
+        CFHD_KERNEL(AV_PIX_FMT_GBRP,      CFHD_RG48, CFHD_RGBToRG48<8,  false, 1>),
+        CFHD_KERNEL(AV_PIX_FMT_GBRP9LE,   CFHD_RG48, CFHD_RGBToRG48<9,  false, 2>),
+        CFHD_KERNEL(AV_PIX_FMT_GBRP9BE,   CFHD_RG48, CFHD_RGBToRG48<9,  true,  2>),
+        CFHD_KERNEL(AV_PIX_FMT_GBRP10LE,  CFHD_RG48, CFHD_RGBToRG48<10, false, 2>),
+        CFHD_KERNEL(AV_PIX_FMT_GBRP10BE,  CFHD_RG48, CFHD_RGBToRG48<10, true,  2>),
+        CFHD_KERNEL(AV_PIX_FMT_GBRP12LE,  CFHD_RG48, CFHD_RGBToRG48<12, false, 2>),
+        CFHD_KERNEL(AV_PIX_FMT_GBRP12BE,  CFHD_RG48, CFHD_RGBToRG48<12, true,  2>),
+        CFHD_KERNEL(AV_PIX_FMT_GBRP14LE,  CFHD_RG48, CFHD_RGBToRG48<14, false, 2>),
+        CFHD_KERNEL(AV_PIX_FMT_GBRP14BE,  CFHD_RG48, CFHD_RGBToRG48<14, true,  2>),
+        CFHD_KERNEL(AV_PIX_FMT_GBRP16LE,  CFHD_RG48, CFHD_RGBToRG48<16, false, 2>),
+        CFHD_KERNEL(AV_PIX_FMT_GBRP16BE,  CFHD_RG48, CFHD_RGBToRG48<16, true,  2>),
+        CFHD_KERNEL(AV_PIX_FMT_RGB24,     CFHD_RG48, CFHD_RGBToRG48<8,  false, 3, 0, 1, 2>),
+        CFHD_KERNEL(AV_PIX_FMT_BGR24,     CFHD_RG48, CFHD_RGBToRG48<8,  false, 3, 2, 1, 0>),
+        CFHD_KERNEL(AV_PIX_FMT_RGBA,      CFHD_RG48, CFHD_RGBToRG48<8,  false, 4, 0, 1, 2>),
+        CFHD_KERNEL(AV_PIX_FMT_BGRA,      CFHD_RG48, CFHD_RGBToRG48<8,  false, 4, 2, 1, 0>),
+        CFHD_KERNEL(AV_PIX_FMT_ARGB,      CFHD_RG48, CFHD_RGBToRG48<8,  false, 4, 1, 2, 3>),
+        CFHD_KERNEL(AV_PIX_FMT_ABGR,      CFHD_RG48, CFHD_RGBToRG48<8,  false, 4, 3, 2, 1>),
+        CFHD_KERNEL(AV_PIX_FMT_RGB0,      CFHD_RG48, CFHD_RGBToRG48<8,  false, 4, 0, 1, 2>),
+        CFHD_KERNEL(AV_PIX_FMT_BGR0,      CFHD_RG48, CFHD_RGBToRG48<8,  false, 4, 2, 1, 0>),
+        CFHD_KERNEL(AV_PIX_FMT_0RGB,      CFHD_RG48, CFHD_RGBToRG48<8,  false, 4, 1, 2, 3>),
+        CFHD_KERNEL(AV_PIX_FMT_0BGR,      CFHD_RG48, CFHD_RGBToRG48<8,  false, 4, 3, 2, 1>),
+        CFHD_KERNEL(AV_PIX_FMT_RGB48LE,   CFHD_RG48, CFHD_RGBToRG48<16, false, 6, 0, 2, 4>),
+        CFHD_KERNEL(AV_PIX_FMT_RGB48BE,   CFHD_RG48, CFHD_RGBToRG48<16, true,  6, 0, 2, 4>),
+        CFHD_KERNEL(AV_PIX_FMT_BGR48LE,   CFHD_RG48, CFHD_RGBToRG48<16, false, 6, 4, 2, 0>),
+        CFHD_KERNEL(AV_PIX_FMT_BGR48BE,   CFHD_RG48, CFHD_RGBToRG48<16, true,  6, 4, 2, 0>),
+        CFHD_KERNEL(AV_PIX_FMT_RGBA64LE,  CFHD_RG48, CFHD_RGBToRG48<16, false, 8, 0, 2, 4>),
+        CFHD_KERNEL(AV_PIX_FMT_RGBA64BE,  CFHD_RG48, CFHD_RGBToRG48<16, true,  8, 0, 2, 4>),
+        CFHD_KERNEL(AV_PIX_FMT_BGRA64LE,  CFHD_RG48, CFHD_RGBToRG48<16, false, 8, 4, 2, 0>),
+        CFHD_KERNEL(AV_PIX_FMT_BGRA64BE,  CFHD_RG48, CFHD_RGBToRG48<16, true,  8, 4, 2, 0>),
+    };
+    *count = sizeof(entries) / sizeof(entries[0]);
+    return entries;
+}
+
+#undef CFHD_V210_KERNELS
+#undef CFHD_YUY2
+#undef CFHD_V210
+#undef CFHD_RG48
+#undef CFHD_KERNEL
+
+
+// The widest instruction set the CPU and OS run, checked once
+int CFHD_Kernels::isa()
+{
+    static int level = []
+    {
+        int best = ISA_BASE;
+#if CFHD_KERNEL_DISPATCH
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+            best = ISA_AVX512;
+        else if (__builtin_cpu_supports("avx2"))
+            best = ISA_AVX2;
+#endif
+        return best;
+    }();
+    return level;
+}
+
+
+const char *CFHD_Kernels::isa_name(int isa)
+{
+#if CFHD_KERNEL_DISPATCH
+    static const char *names[] = { "sse2", "avx2", "avx512" };
+    return names[isa];
+#else
+    return isa == ISA_BASE ? "base" : "n/a";
+#endif
+}
+
+
+// The kernel from src to dst for this CPU, or nullptr when swscale does the conversion
+CFHD_KernelFn CFHD_Kernels::find(AVPixelFormat src, CFHD_PixelFormat dst)
+{
+    size_t count;
+    const Entry *entries = table(&count);
+
+    for (size_t i = 0; i < count; i++)
+        if (entries[i].src == src && entries[i].dst == dst)
+            return entries[i].fn[isa()];
+    return nullptr;
+}
+
+
+// Words of scratch a band's kernel needs: the v210 kernels stage a row of each plane,
+// padded to whole groups.  The others need none.
+size_t CFHD_Kernels::scratch_size(int width)
+{
+    return (size_t)(width + 5) / 6 * 12;
+}
+
+
+// Bytes per row of an encoder input picture.  v210 rows are padded to 128 bytes.
+int CFHD_Kernels::pitch(CFHD_PixelFormat pix_fmt, int width)
+{
+    if (pix_fmt == CFHD_PIXEL_FORMAT_V210)
+        return (width + 47) / 48 * 128;
+    if (pix_fmt == CFHD_PIXEL_FORMAT_RG48)
+        return width * 6;
+    return width * 2;
+}
+
+
+static double frames_per_second(const std::function<bool()> &convert)
+{
+    int frames = 0;
+    int64_t start = now_us(), elapsed = 0;
+
+    while (frames < 5 || elapsed < 500000)
+    {
+        if (! convert())
+            return 0;
+        frames++;
+        elapsed = now_us() - start;
+    }
+    return frames * 1000000.0 / elapsed;
+}
+
+
+// -kernel_bench: times each kernel on every instruction set the CPU runs, and the swscale
+// conversion it replaces (with libavcodec's v210 packer after it, for v210), one thread and
+// one frame of noise at a time.  Then the same for the -matrix fixed conversions, against
+// swscale with the accurate rounding and flags -matrix swscale uses.  Prints frames per
+// second.
+static void bench_kernels(int video_width, int video_height)
+{
+    int width = video_width > 0 ? video_width : 1920;
+    int height = video_height > 0 ? video_height : 1080;
+    size_t count;
+    const CFHD_Kernels::Entry *entries = CFHD_Kernels::table(&count);
+    AVFrame *src = av_frame_alloc();
+    AVFrame *scaled = av_frame_alloc();
+    AVPacket *pkt = av_packet_alloc();
+
+    if (! (src && scaled && pkt))
+    {
+        av_log(nullptr, AV_LOG_ERROR, "bench_kernels: allocation failed\n");
+        throw 4;
+    }
+
+    printf("%dx%d, one thread\n%-14s %-5s", width, height, "input", "to");
+    for (int isa = 0; isa <= CFHD_Kernels::isa(); isa++)
+        printf(" %9s", CFHD_Kernels::isa_name(isa));
+    printf(" %9s %8s\n", "swscale", "speedup");
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const CFHD_Kernels::Entry &entry = entries[i];
+        const char *target = entry.dst == CFHD_PIXEL_FORMAT_V210 ? "v210" :
+                             entry.dst == CFHD_PIXEL_FORMAT_RG48 ? "rg48" : "yuy2";
+        AVPixelFormat sws_fmt = entry.dst == CFHD_PIXEL_FORMAT_V210 ? AV_PIX_FMT_YUV422P10LE :
+                                entry.dst == CFHD_PIXEL_FORMAT_RG48 ? AV_PIX_FMT_RGB48LE :
+                                AV_PIX_FMT_YUYV422;
+        int pitch = CFHD_Kernels::pitch(entry.dst, width);
+        std::vector<uint8_t> out((size_t)pitch * height);
+        std::vector<uint32_t> lines(CFHD_Kernels::scratch_size(width));
+        double best = 0;
+        int ret;
+
+        av_frame_unref(src);
+        av_frame_unref(scaled);
+        src->format = entry.src;
+        src->width = width;
+        src->height = height;
+        scaled->format = sws_fmt;
+        scaled->width = width;
+        scaled->height = height;
+        if ((ret = av_frame_get_buffer(src, 32)) < 0 || (ret = av_frame_get_buffer(scaled, 32)) < 0)
+        {
+            av_log(nullptr, AV_LOG_ERROR, "bench_kernels: av_frame_get_buffer failed:\n%s\n",
+                   av_err2str(ret));
+            throw 4;
+        }
+        for (int p = 0; p < 4 && src->buf[p]; p++)
+            for (int k = 0; k < src->buf[p]->size; k++)
+                src->buf[p]->data[k] = (uint8_t)rand();
+
+        printf("%-14s %-5s", av_get_pix_fmt_name(entry.src), target);
+        for (int isa = 0; isa <= CFHD_Kernels::isa(); isa++)
+        {
+            double fps = frames_per_second([&]
+            {
+                entry.fn[isa](src, out.data(), pitch, 0, height, lines.data());
+                return true;
+            });
+            best = std::max(best, fps);
+            printf(" %9.1f", fps);
+        }
+
+        SwsContext *sws = sws_getContext(width, height, entry.src, width, height, sws_fmt,
+                                         SWS_BICUBIC, nullptr, nullptr, nullptr);
+        AVCodecContext *v210_ctx = nullptr;
+        const AVCodec *v210 = avcodec_find_encoder_by_name("v210");
+        if (entry.dst == CFHD_PIXEL_FORMAT_V210 && v210 &&
+            (v210_ctx = avcodec_alloc_context3(v210)))
+        {
+            v210_ctx->width = width;
+            v210_ctx->height = height;
+            v210_ctx->time_base = av_make_q(1, 25);
+            v210_ctx->pix_fmt = AV_PIX_FMT_YUV422P10LE;
+            if (avcodec_open2(v210_ctx, v210, nullptr) < 0)
+                avcodec_free_context(&v210_ctx);
+        }
+        double sws_fps = 0;
+        if (sws && (entry.dst != CFHD_PIXEL_FORMAT_V210 || v210_ctx))
+            sws_fps = frames_per_second([&]
+            {
+                if (sws_scale(sws, src->data, src->linesize, 0, height, scaled->data,
+                              scaled->linesize) <= 0)
+                    return false;
+                if (! v210_ctx)
+                    return true;
+                av_packet_unref(pkt);
+                return avcodec_send_frame(v210_ctx, scaled) == 0 &&
+                       avcodec_receive_packet(v210_ctx, pkt) == 0;
+            });
+        if (sws_fps > 0)
+            printf(" %9.1f %7.1fx\n", sws_fps, best / sws_fps);
+        else
+            printf(" %9s %8s\n", "n/a", "");
+        sws_freeContext(sws);
+        if (v210_ctx) avcodec_free_context(&v210_ctx);
+    }
+
+    static const AVPixelFormat matrix_pairs[][2] =
+    {
+        { AV_PIX_FMT_YUV420P,     AV_PIX_FMT_RGB48LE },
+        { AV_PIX_FMT_YUV422P10LE, AV_PIX_FMT_RGB48LE },
+        { AV_PIX_FMT_YUV444P12LE, AV_PIX_FMT_RGB48LE },
+        { AV_PIX_FMT_GBRP,        AV_PIX_FMT_YUYV422 },
+        { AV_PIX_FMT_GBRP10LE,    AV_PIX_FMT_YUV422P10LE },
+        { AV_PIX_FMT_RGB48LE,     AV_PIX_FMT_YUV422P10LE },
+    };
+    const int *table = sws_getCoefficients(AVCOL_SPC_BT709);
+    printf("\n%-14s %-12s %9s %9s %8s\n", "input", "to", "fixed", "swscale", "speedup");
+    for (const AVPixelFormat *pair : matrix_pairs)
+    {
+        bool b_rgb = av_pix_fmt_desc_get(pair[0])->flags & AV_PIX_FMT_FLAG_RGB;
+        CFHD_ColorMatrix matrix;
+        int ret;
+
+        av_frame_unref(src);
+        av_frame_unref(scaled);
+        src->format = pair[0];
+        src->width = width;
+        src->height = height;
+        scaled->format = pair[1];
+        scaled->width = width;
+        scaled->height = height;
+        if ((ret = av_frame_get_buffer(src, 32)) < 0 || (ret = av_frame_get_buffer(scaled, 32)) < 0)
+        {
+            av_log(nullptr, AV_LOG_ERROR, "bench_kernels: av_frame_get_buffer failed:\n%s\n",
+                   av_err2str(ret));
+            throw 4;
+        }
+        for (int p = 0; p < 4 && src->buf[p]; p++)
+            for (int k = 0; k < src->buf[p]->size; k++)
+                src->buf[p]->data[k] = (uint8_t)rand();
+
+        matrix.init(AVCOL_SPC_BT709, false, pair[0], width, height);
+        std::vector<uint16_t> lines(matrix.scratch_size());
+        double fixed_fps = frames_per_second([&]
+        {
+            if (b_rgb)
+                matrix.rgb_to_yuv422(src, scaled, 0, height, lines.data());
+            else
+                matrix.yuv_to_rgb48(src, scaled, 0, height, lines.data());
+            return true;
+        });
+
+        SwsContext *sws = sws_getContext(width, height, pair[0], width, height, pair[1],
+                                         SWS_BICUBIC | SWS_ACCURATE_RND | SWS_FULL_CHR_H_INT,
+                                         nullptr, nullptr, nullptr);
+        double sws_fps = 0;
+        if (sws)
+        {
+            sws_setColorspaceDetails(sws, table, b_rgb ? 1 : 0, table, b_rgb ? 0 : 1, 0, 1 << 16,
+                                     1 << 16);
+            sws_fps = frames_per_second([&]
+            {
+                return sws_scale(sws, src->data, src->linesize, 0, height, scaled->data,
+                                 scaled->linesize) > 0;
+            });
+        }
+        printf("%-14s %-12s %9.1f", av_get_pix_fmt_name(pair[0]), av_get_pix_fmt_name(pair[1]),
+               fixed_fps);
+        if (sws_fps > 0)
+            printf(" %9.1f %7.1fx\n", sws_fps, fixed_fps / sws_fps);
+        else
+            printf(" %9s %8s\n", "n/a", "");
+        sws_freeContext(sws);
+    }
+    av_packet_free(&pkt);
+    av_frame_free(&scaled);
+    av_frame_free(&src);
+}
+
+
+// One output file: its own Cineform encoder pool, quality and container.
+struct CFHD_Output
+{
+    std::string path;
+    std::string quality;
+    bool b_rgb;
+    std::string format;
+    bool b_video_only;
+    AVFormatContext *ofmt_ctx;
+    CFHD_Encoder *cfhd;
+    CFHD_Analyzer *analyzer;
+    CFHD_RateControl *rate;
+    CFHD_Muxer *muxer;
+    CFHD_PipeWriter *pipe_writer;
+    // by input stream index, for audio converted to PCM rather than copied
+    std::vector<CFHD_AudioTranscoder*> audio;
+    AVPacket *pkt;
+    // the CFHD_Transcoder conversion that feeds this output's encoder
+    int conversion;
+    int scale;
+    int width;
+    int height;
+    // Cineform input is rewrapped rather than re-encoded when b_copy is set
+    bool b_quality_set;
+    bool b_copy_asked;
+    bool b_copy;
+    uint32_t copied;
+    float target_bitrate;
+    float target_size;
+    // A frame identical to the one before it is not encoded again.  Its sample is written
+    // once the sample of the run's first frame (run_source) comes back, or at once from
+    // held if that has already been written.
+    struct Repeat
+    {
+        uint32_t source;
+        uint32_t frame_num;
+        int64_t pts;
+        int64_t duration;
+    };
+    // whether a picture has been encoded yet, and the hash of the last one; the picture
+    // itself goes back to its pool once the encoder is done with it
+    bool b_encoded;
+    uint8_t last_hash[16];
+    AVMurMur3 *murmur;
+    uint32_t run_source;
+    std::deque<Repeat> repeats;
+    std::vector<uint8_t> held;
+    uint32_t held_frame;
+    CFHD_EncodingQuality held_quality;
+    uint32_t reused;
+    // -realtime: frames the encoder was too late for, and repeats that filled input gaps
+    uint32_t late;
+    uint32_t filled;
+    // the region of the converted picture this output encodes, in full size pixels
+    int crop_x;
+    int crop_y;
+    int crop_width;
+    int crop_height;
+    int tile;
+    int tile_cols;
+    int tile_rows;
+
+    CFHD_Output(const CliOutput &cliout)
+    {
+        path = cliout.path;
+        quality = cliout.quality;
+        b_rgb = cliout.b_rgb;
+        format = cliout.format;
+        b_video_only = cliout.b_video_only;
+        scale = cliout.scale;
+        width = 0;
+        height = 0;
+        b_quality_set = cliout.b_quality_set;
+        b_copy_asked = cliout.b_copy;
+        b_copy = false;
+        copied = 0;
+        ofmt_ctx = nullptr;
+        cfhd = nullptr;
+        analyzer = nullptr;
+        rate = nullptr;
+        muxer = nullptr;
+        target_bitrate = cliout.target_bitrate;
+        target_size = cliout.target_size;
+        b_encoded = false;
+        memset(last_hash, 0, sizeof(last_hash));
+        murmur = nullptr;
+        run_source = 0;
+        held_frame = 0;
+        held_quality = CFHD_ENCODING_QUALITY_DEFAULT;
+        reused = 0;
+        late = 0;
+        filled = 0;
+        crop_x = cliout.crop_x;
+        crop_y = cliout.crop_y;
+        crop_width = cliout.crop_width;
+        crop_height = cliout.crop_height;
+        tile = cliout.tile;
+        tile_cols = cliout.tile_cols;
+        tile_rows = cliout.tile_rows;
+        pipe_writer = nullptr;
+        pkt = av_packet_alloc();
+        conversion = -1;
+    }
+
+    ~CFHD_Output()
+    {
+        // the audio threads write into the muxer thread, which writes through ofmt_ctx
+        for (CFHD_AudioTranscoder *a : audio)
+            if (a) delete a;
+        if (muxer) delete muxer;
+        if (analyzer) delete analyzer;
+        if (rate) delete rate;
+        av_free(murmur);
+        if (cfhd) delete cfhd;
+        av_packet_free(&pkt);
+        if (! ofmt_ctx)
+            return;
+        if (pipe_writer)
+        {
+            delete pipe_writer;
+            ofmt_ctx->pb = nullptr;
+        }
+        else if (ofmt_ctx->oformat && !(ofmt_ctx->oformat->flags & AVFMT_NOFILE))
+            avio_closep(&ofmt_ctx->pb);
+        avformat_free_context(ofmt_ctx);
+        ofmt_ctx = nullptr;
+    }
+
+    // output streams keep the input's numbering unless only the video is muxed
+    int video_index(AVStream *input) { return b_video_only ? 0 : input->index; }
+
+    bool cropped() const { return crop_width > 0 || tile_cols > 0; }
+
+    // Proxies round down to even dimensions, which 4:2:2 needs.  Tiles split the picture
+    // evenly, but with columns on 48 pixel boundaries, so each encoder reads rows that start
+    // on 16 bytes in every input format (96 bytes of YUY2, 288 of RG48, 8 v210 groups of
+    // 16); the last row and column take what is left over.
+    void set_size(int source_width, int source_height)
+    {
+        if (tile_cols > 0)
+        {
+            int col = tile % tile_cols;
+            int row = tile / tile_cols;
+            int tile_width = source_width / tile_cols / 48 * 48;
+            int tile_height = source_height / tile_rows;
+            crop_x = col * tile_width;
+            crop_y = row * tile_height;
+            crop_width = col == tile_cols - 1 ? source_width - crop_x : tile_width;
+            crop_height = row == tile_rows - 1 ? source_height - crop_y : tile_height;
+        }
+        if (cropped())
+        {
+            width = crop_width;
+            height = crop_height;
+            return;
+        }
+        width = scale > 1 ? (source_width / scale) & ~1 : source_width;
+        height = scale > 1 ? (source_height / scale) & ~1 : source_height;
+    }
+
+    // where the crop starts in a picture of the encoder input format
+    size_t crop_offset(CFHD_PixelFormat pix_fmt, int pitch) const
+    {
+        size_t x = (size_t)crop_x * 2;
+        if (pix_fmt == CFHD_PIXEL_FORMAT_RG48)
+            x = (size_t)crop_x * 6;
+        else if (pix_fmt == CFHD_PIXEL_FORMAT_V210)
+            x = (size_t)crop_x / 6 * 16;
+        return (size_t)pitch * crop_y + x;
+    }
+};
+
+
+// Pictures handed to a job from outside rather than read from a file, such as frames the
+// job server maps from a client's memfd.  They are already in the encoder's input
+// format, and each holds a reference to its memory, which the encoder reads from directly.
+struct CFHD_FrameQueue
+{
+    struct Frame
+    {
+        AVBufferRef *buf;
+        uint8_t *data;
+        int pitch;
+        int64_t pts;
+    };
+
+    std::deque<Frame> frames;
+    size_t max_frames;
+    // no more frames will come
+    bool b_end;
+    bool b_abort;
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    CFHD_FrameQueue()
+    {
+        max_frames = 8;
+        b_end = false;
+        b_abort = false;
+    }
+
+    ~CFHD_FrameQueue()
+    {
+        for (Frame &frame : frames)
+            av_buffer_unref(&frame.buf);
+    }
+
+    // Takes over frame's reference.  Waits while the queue is full.
+    bool push(Frame &frame)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return frames.size() < max_frames || b_abort; });
+        if (b_abort || b_end)
+        {
+            av_buffer_unref(&frame.buf);
+            return false;
+        }
+        frames.push_back(frame);
+        cv.notify_all();
+        return true;
+    }
+
+    // False once every frame has been taken, or when the queue is aborted.
+    bool pop(Frame &frame)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return ! frames.empty() || b_end || b_abort; });
+        if (frames.empty() || b_abort)
+            return false;
+        frame = frames.front();
+        frames.pop_front();
+        cv.notify_all();
+        return true;
+    }
+
+    void end()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        b_end = true;
+        cv.notify_all();
+    }
+
+    void abort()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        b_abort = true;
+        cv.notify_all();
+    }
+};
+
+
+// A job's progress and outcome, shared with whoever queued it (-watch or the job server).
+// The job's thread writes them while other threads report them, so each is atomic.
+struct CFHD_JobState
+{
+    enum { QUEUED, RUNNING, DONE, FAILED, CANCELLED };
+    std::atomic<int> phase;
+    std::atomic<uint32_t> frames;
+    std::atomic<int64_t> total_frames;
+    std::atomic<bool> b_cancel;
+    std::atomic<int> exit_code;
+    std::atomic<float> seconds;
+    // the job's pictures, when they do not come from a file
+    std::shared_ptr<CFHD_FrameQueue> frames_in;
+
+    CFHD_JobState() : phase(QUEUED), frames(0), total_frames(0), b_cancel(false), exit_code(0),
+                      seconds(0)
+    {
+    }
+
+    const char *phase_name() const
+    {
+        static const char *names[] = { "queued", "running", "done", "failed", "cancelled" };
+        return names[phase];
+    }
+
+    void cancel()
+    {
+        b_cancel = true;
+        if (frames_in)
+            frames_in->abort();
+    }
+};
+
+
+struct CFHD_Transcoder
+{
+    AVFormatContext *ifmt_ctx;
+    AVCodecContext *dec_ctx;
+    AVStream *input;
+    // Scaling runs in horizontal bands on the task pool, with one SwsContext per band.
+    // Sources with vertically subsampled chroma convert a few extra rows around each band
+    // into a scratch frame, so chroma interpolation sees the same neighbours it would in a
+    // single full-frame pass.
+    struct ScaleBand
+    {
+        SwsContext *ctx;
+        AVFrame *scratch;
+        int y;
+        int rows;
+        int pad_top;
+        int pad_bottom;
+        // scratch rows for CFHD_ColorMatrix or the kernel, the band's for the whole encode
+        std::vector<uint16_t> lines;
+        std::vector<uint32_t> kernel_lines;
+    };
+    // Each decoded frame is converted once per encoder input format and size, and every
+    // output that takes that format encodes from the same picture.  Pictures come from a
+    // buffer pool because encoders hold on to them until their samples are done.  Proxies
+    // are box filtered from the full size picture of their format.
+    struct Conversion
+    {
+        // what swscale converts to, or AV_PIX_FMT_NONE to take decoded frames as they are
+        AVPixelFormat pix_fmt;
+        std::vector<ScaleBand> bands;
+        // YUV <-> RGB goes through our own kernels when they take the input format
+        bool b_matrix;
+        CFHD_ColorMatrix matrix;
+        // or the input goes straight into the encoder input through a CFHD_Kernels kernel,
+        // with rows kernel_pitch bytes apart
+        CFHD_KernelFn kernel;
+        int kernel_pitch;
+        // the encoder takes v210, packed by the kernel or else by libavcodec
+        bool b_v210;
+        int scale;
+        int width;
+        int height;
+        // for proxies, the full size conversion they shrink
+        int source;
+        AVBufferPool *pool;
+        AVFrame *frame;
+        // the picture for the current frame, before any v210 packing
+        AVFrame *picture;
+        // Cineform input decoded by the SDK straight into the encoder input format
+        CFHD_DecoderRef decoder;
+        CFHD_PixelFormat decode_fmt;
+        // yuv422p10 is packed into v210 by libavcodec after scaling
+        AVCodecContext *v210_ctx;
+        AVPacket *v210_pkt;
+        // the encoder input for the current frame
+        AVBufferRef *buf;
+        uint8_t *data;
+        int pitch;
+    };
+
+    enum Stage { STAGE_DEMUX, STAGE_DECODE, STAGE_CONVERT, STAGE_ENCODE, STAGE_COUNT };
+
+    std::vector<CFHD_Output*> outputs;
+    std::vector<Conversion> conversions;
+    CFHD_TaskPool *taskpool;
+    AVPacket *in_pkt;
+    AVPacket *copy_pkt;
+    AVFrame *in_frame;
+    int width;
+    int height;
+    // the input's color matrix, range and tags, from its stream or from -trc
+    AVColorSpace colorspace;
+    bool b_full_range;
+    AVColorPrimaries color_primaries;
+    AVColorTransferCharacteristic color_trc;
+    bool b_progress;
+    // Cineform input that is re-encoded is decoded by the Cineform SDK, not libavcodec
+    bool b_sdk_decode;
+    // image sequence input is read by CFHD_SequenceReader rather than through ifmt_ctx
+    bool b_sequence;
+    int sequence_start;
+    // a Vapoursynth script's frames come from its reader, also outside ifmt_ctx
+    CFHD_VapourSynthReader *script;
+    // frames handed to the encoders so far, counting any frames kept from a resumed run
+    uint32_t frame_count;
+    // Checkpointing flushes a fragment of the output every <checkpoint> frames, then records
+    // the frame count, the last frame's pts and the file size in a sidecar next to the output.
+    // It needs a single output.
+    int checkpoint;
+    std::string checkpoint_path;
+    std::string partial_path;
+    // what a resumed run carries over: frames and pts (input time base) up to the checkpoint,
+    // and the last pts of each output stream copied from the partial file
+    uint32_t resume_frames;
+    int64_t resume_pts;
+    int64_t resume_bytes;
+    std::vector<int64_t> resume_last_pts;
+    // the rate control state of <outfile> at the checkpoint
+    std::vector<std::pair<std::string, int64_t>> resume_rate;
+    // what a checkpoint is only good for: the input file as it was (size and modification
+    // time, or -1 when it is not a regular file) and a hash of the encode settings
+    int64_t input_bytes;
+    int64_t input_mtime;
+    int64_t settings_hash;
+    // wall time spent in each stage on the main thread, to find the bottleneck
+    int64_t stage_us[STAGE_COUNT];
+    // Growth of the process's peak resident set, credited to whatever was running on the
+    // main thread when it was measured: opening the files, starting the encoder pools, then
+    // each stage.  Worker threads allocate alongside, so the split is a guide.
+    int64_t peak_rss;
+    int64_t start_rss;
+    int64_t open_rss;
+    int64_t pool_rss;
+    int64_t stage_rss[STAGE_COUNT];
+    // -max_memory: fewer pictures in flight, and none kept that need not be
+    bool b_low_memory;
+    // libavcodec's decoding threads, which come out of the thread budget [0 = none]
+    int decode_threads;
+    // -matrix fixed
+    bool b_fixed_matrix;
+    // -dedup
+    bool b_dedup;
+    // -trace
+    CFHD_Trace *trace;
+    // -realtime: the latency bound, and the wall clock grid frames are stamped on, counted
+    // in frames from the first one (live_start).  Latencies of encoded frames are kept by
+    // the millisecond, the last bucket taking everything from 10 seconds.
+    int64_t realtime_us;
+    bool b_late_repeat;
+    AVRational live_rate;
+    int64_t live_start;
+    int64_t live_slot;
+    std::vector<uint32_t> live_latency;
+    // Takes samples as they are done while the input stalls.  live_mutex keeps it and the
+    // thread feeding the encoders off the outputs at the same time.
+    std::thread live_collector;
+    std::mutex live_mutex;
+    std::condition_variable live_cv;
+    bool b_live_stop;
+    bool b_live_failed;
+    // the exact frame count and key frames of the input, with -scan
+    CFHD_FrameIndex frame_index;
+    // warm encoder pools to start from, when running several jobs in one process
+    CFHD_EncoderCache *encoders;
+    // progress and cancellation for -watch and the job server
+    CFHD_JobState *state;
+
+    CFHD_Transcoder(CliOptions *cliopt, CFHD_TaskPool *taskpool, CFHD_EncoderCache *encoders,
+                    CFHD_JobState *state)
+    {
+        ifmt_ctx = avformat_alloc_context();
+        dec_ctx = avcodec_alloc_context3(nullptr);
+        input = nullptr;
+        this->taskpool = taskpool;
+        this->encoders = encoders;
+        this->state = state;
+        in_pkt = av_packet_alloc();
+        copy_pkt = av_packet_alloc();
+        in_frame = nullptr;
+        width = 0;
+        height = 0;
+        colorspace = AVCOL_SPC_BT709;
+        b_full_range = false;
+        color_primaries = AVCOL_PRI_UNSPECIFIED;
+        color_trc = AVCOL_TRC_UNSPECIFIED;
+        b_progress = cliopt->b_progress;
+        b_sdk_decode = false;
+        b_sequence = false;
+        sequence_start = 0;
+        script = nullptr;
+        frame_count = 0;
+        checkpoint = cliopt->checkpoint;
+        resume_frames = 0;
+        resume_pts = AV_NOPTS_VALUE;
+        resume_bytes = 0;
+        identify_checkpoint(cliopt);
+        for (int i = 0; i < STAGE_COUNT; i++)
+        {
+            stage_us[i] = 0;
+            stage_rss[i] = 0;
+        }
+        peak_rss = start_rss = peak_resident_bytes();
+        open_rss = 0;
+        pool_rss = 0;
+        b_low_memory = cliopt->max_memory > 0;
+        decode_threads = 0;
+        b_fixed_matrix = cliopt->b_fixed_matrix;
+        trace = nullptr;
+        realtime_us = (int64_t)cliopt->realtime * 1000;
+        b_late_repeat = cliopt->b_late_repeat;
+        // a live encode keeps the time of hashing each frame off its latency
+        b_dedup = cliopt->dedup >= 0 ? cliopt->dedup == 1 : realtime_us == 0;
+        live_rate.num = 0;
+        live_rate.den = 1;
+        live_start = AV_NOPTS_VALUE;
+        live_slot = -1;
+        b_live_stop = false;
+        b_live_failed = false;
+
+        bool b_ok = ifmt_ctx && dec_ctx && in_pkt && copy_pkt;
+        for (const CliOutput &cliout : cliopt->outputs)
+        {
+            outputs.push_back(new CFHD_Output(cliout));
+            b_ok = b_ok && outputs.back()->pkt;
+        }
+        if (! b_ok)
+        {
+            av_log(nullptr, AV_LOG_ERROR, "CFHD_Transcoder: initialization failed\n");
+            throw 4;
+        }
+    }
+
+    ~CFHD_Transcoder()
+    {
+        av_log(nullptr, AV_LOG_DEBUG, "CFHD_Transcoder destructor called.\n");
+        stop_live();
+        // encoders first, since they hold references to converted pictures
+        for (CFHD_Output *out : outputs)
+            delete out;
+        for (Conversion &conv : conversions)
+        {
+            for (ScaleBand &band : conv.bands)
+            {
+                sws_freeContext(band.ctx);
+                if (band.scratch) av_frame_free(&band.scratch);
+            }
+            if (conv.v210_ctx) avcodec_free_context(&conv.v210_ctx);
+            if (conv.decoder) CFHD_CloseDecoder(conv.decoder);
+            av_packet_free(&conv.v210_pkt);
+            av_frame_free(&conv.frame);
+            av_buffer_pool_uninit(&conv.pool);
+        }
+        if (in_frame) av_frame_free(&in_frame);
+        // after in_frame, which may hold the planes of one of its frames
+        delete script;
+        // after the outputs, whose muxer threads write to it
+        delete trace;
+        av_packet_free(&copy_pkt);
+        av_packet_free(&in_pkt);
+        avcodec_free_context(&dec_ctx);
+        avformat_close_input(&ifmt_ctx);
+    }
+
+    void open_input(CliOptions*);
+    void open_frames(CliOptions*);
+    void open_script(CliOptions*);
+    void open_output(CliOptions*);
+    void resume();
+    void process(CliOptions*);
+
+private:
+    void guess_channel_layout(AVStream*, int);
+    void open_audio(CliOptions*, CFHD_Output*, AVStream*, AVStream*);
+    void pick_colors(int);
+    void open_output_file(CliOptions*, CFHD_Output*);
+    bool encode();
+    bool transcode();
+    bool transcode_sequence(CliOptions*);
+    bool transcode_script(CliOptions*);
+    bool encode_frames();
+    bool transcode_packet();
+    bool transcode_frame();
+    bool encode_frame(int64_t, int64_t);
+    bool push_frame(CFHD_Output*, AVBufferRef*, uint8_t*, int, int64_t, int64_t);
+    bool repeat_frame(CFHD_Output*, int64_t, int64_t);
+    void start_live();
+    void collect_live();
+    void stop_live();
+    bool live_stamp(int64_t*, int64_t*);
+    void log_latency();
+    void start_rate_control(CFHD_Output*, CliOptions*);
+    bool decode_cfhd();
+    int add_decoder(CFHD_PixelFormat, int);
+    bool decode_sample(Conversion&, AVPacket*);
+    bool copy_packet(AVPacket*);
+    bool copy_video(AVPacket*);
+    void show_progress(uint32_t);
+    int add_conversion(AVPixelFormat, bool, bool, int);
+    bool convert(Conversion&);
+    bool get_picture(Conversion&, AVPixelFormat);
+    bool downscale(Conversion&);
+    bool init_scaler(Conversion&, bool);
+    bool scale_frame(Conversion&);
+    bool scale_band(Conversion&, ScaleBand&);
+    CFHD_TaskPool::Priority convert_priority();
+    void end_stage(Stage, int64_t);
+    void count_peak(int64_t*);
+    void log_stage_times();
+    void limit_memory(CliOptions*);
+    int read_ahead(CliOptions*);
+    bool init_v210_encoder(Conversion&);
+    bool encode_v210(Conversion&, AVFrame*);
+    bool write_cfhd_sample(CFHD_Output*);
+    bool write_video(CFHD_Output*, const uint8_t*, size_t, CFHD_EncodingQuality, uint32_t,
+                     int64_t, int64_t);
+    bool write_analysis(CliOptions*);
+    void identify_checkpoint(CliOptions*);
+    void load_checkpoint(CliOptions*);
+    bool write_checkpoint(uint32_t, int64_t);
+    bool skip_resumed(AVPacket*);
+};
+
+
+void CFHD_Transcoder::open_input(CliOptions *cliopt)
+{
+    int ret;
+    AVCodec *dec;
+
+    if (state && state->frames_in)
+    {
+        open_frames(cliopt);
+        return;
+    }
+    if (is_script(cliopt->input))
+    {
+        open_script(cliopt);
+        return;
+    }
+    // a live input is read as it comes, without the demuxer buffering ahead
+    if (cliopt->realtime > 0)
+        ifmt_ctx->flags |= AVFMT_FLAG_NOBUFFER;
+    // If video_size has a value, then...
+    // 1 - we assume this is raw video.
+    // 2 - pix_fmt_name and framerate must also be set per CliOptions validation
+    if (cliopt->video_size)
+    {
+        AVInputFormat *fmt = av_find_input_format("rawvideo");
+        AVDictionary *options = nullptr;
+        av_dict_set(&options, "video_size", cliopt->video_size, 0);
+        av_dict_set(&options, "pixel_format", cliopt->pix_fmt_name, 0);
+        av_dict_set(&options, "framerate", cliopt->framerate, 0);
+        if ((ret = avformat_open_input(&ifmt_ctx, cliopt->input, fmt, &options)) < 0)
+        {
+            av_log(nullptr, AV_LOG_ERROR,
+                   "Failed to open '%s':\n%s\n", cliopt->input, av_err2str(ret));
+            throw 2;
+        }
+        av_dict_free(&options);
+    }
+    // A numbered pattern like plate.%06d.dpx is an image sequence.  The image2 demuxer
+    // describes the stream; the frames themselves come from CFHD_SequenceReader.
+    else if (av_filename_number_test(cliopt->input))
+    {
+        AVInputFormat *fmt = av_find_input_format("image2");
+        AVDictionary *options = nullptr;
+        char path[4096];
+
+        b_sequence = true;
+        sequence_start = cliopt->start_number;
+        // like image2, look for the first file among the first few numbers
+        for (int i = 0; sequence_start < 0 && i < 5; i++)
+            if (av_get_frame_filename(path, sizeof(path), cliopt->input, i) == 0 &&
+                access(path, F_OK) == 0)
+                sequence_start = i;
+        if (sequence_start < 0)
+        {
+            av_log(nullptr, AV_LOG_ERROR, "No files found for '%s'\n", cliopt->input);
+            throw 2;
+        }
+        av_dict_set_int(&options, "start_number", sequence_start, 0);
+        if (cliopt->framerate)
+            av_dict_set(&options, "framerate", cliopt->framerate, 0);
+        ret = avformat_open_input(&ifmt_ctx, cliopt->input, fmt, &options);
+        av_dict_free(&options);
+        if (ret < 0)
+        {
+            av_log(nullptr, AV_LOG_ERROR,
+                   "Failed to open '%s':\n%s\n", cliopt->input, av_err2str(ret));
+            throw 2;
+        }
+    }
+    else if ((ret = avformat_open_input(&ifmt_ctx, cliopt->input, nullptr, nullptr)) < 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR,
+               "Failed to open '%s':\n%s\n", cliopt->input, av_err2str(ret));
+        throw 2;
+    }
+
+    if ((ret = av_find_best_stream(ifmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &dec, 0)) < 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR,
+               "Error finding video stream in '%s':\n%s\n", cliopt->input, av_err2str(ret));
+        throw 2;
+    }
+    input = ifmt_ctx->streams[ret];
+    // these may already be set, but they might not be, and this causes no harm if they are
+    width = input->codecpar->width;
+    height = input->codecpar->height;
+
+    if (cliopt->framerate)
+    {
+        input->avg_frame_rate = cliopt->r_frame_rate;
+        input->r_frame_rate = cliopt->r_frame_rate;
+    }
+    
+    if (cliopt->aspect.num != 0)
+        input->display_aspect_ratio = cliopt->aspect;
+    else if (input->sample_aspect_ratio.num == 0)
+    {
+        input->sample_aspect_ratio.num = 1;
+        input->sample_aspect_ratio.den = 1;
+    }
+    // this sets SAR from DAR (if DAR is set)
+    avformat_find_stream_info(ifmt_ctx, nullptr);
+    // this is needed...
+    input->codecpar->sample_aspect_ratio = input->sample_aspect_ratio;
+
+    // -resume seeks by the key frames
+    if ((cliopt->b_scan || cliopt->b_resume) && ! b_sequence &&
+        frame_index.build(cliopt->input, ifmt_ctx, input, taskpool))
+        input->nb_frames = frame_index.frames;
+    else if (input->nb_frames == 0 && ifmt_ctx->duration > 0)
+    {
+        av_log(nullptr, AV_LOG_INFO, "Estimating frame count from duration\n");
+        float dur = (float)ifmt_ctx->duration / 1000000;
+        float rate = (float)input->r_frame_rate.num / (float)input->r_frame_rate.den;
+        input->nb_frames = (int64_t)(dur * rate);
+    }
+
+    av_dump_format(ifmt_ctx, 0, cliopt->input, 0);
+    pick_colors(cliopt->trc);
+    if (state)
+        state->total_frames = input->nb_frames;
+
+    // Cineform input goes into full size outputs as it is when -copy asks for it, or when
+    // nothing asks for a different quality or color model.  The packets are rewrapped, with
+    // no decode and no generation loss.
+    if (input->codecpar->codec_id == AV_CODEC_ID_CFHD)
+    {
+        const AVPixFmtDescriptor *desc =
+            av_pix_fmt_desc_get((AVPixelFormat)input->codecpar->format);
+        bool input_is_rgb = desc && (desc->flags & AV_PIX_FMT_FLAG_RGB);
+        for (CFHD_Output *out : outputs)
+            out->b_copy = out->scale == 1 && ! out->cropped() &&
+                          (out->b_copy_asked || (! out->b_quality_set && out->b_rgb == input_is_rgb));
+    }
+    else
+        for (CFHD_Output *out : outputs)
+            if (out->b_copy_asked)
+                av_log(nullptr, AV_LOG_WARNING,
+                       "The input is not Cineform, so '%s' is encoded rather than copied.\n",
+                       out->path.c_str());
+
+    // The SDK decodes Cineform for the outputs that re-encode it, at their size and straight
+    // into their encoder input format, so neither libavcodec nor swscale is involved.
+    if (input->codecpar->codec_id == AV_CODEC_ID_CFHD && ! cliopt->b_ffmpeg_decoder)
+        for (CFHD_Output *out : outputs)
+            b_sdk_decode = b_sdk_decode || ! out->b_copy;
+    if (b_sdk_decode)
+    {
+        av_log(nullptr, AV_LOG_INFO, "Decoding with the Cineform SDK\n");
+        return;
+    }
+
+    // Check if the video is already in a format that we can send direct to the cfhd encoder
+    // of every output.
+    bool b_direct = true;
+    for (CFHD_Output *out : outputs)
+    {
+        if (out->b_copy)
+            continue;
+        // proxies are shrunk from decoded frames
+        if (out->scale > 1)
+            b_direct = false;
+        else if (input->codecpar->codec_id == AV_CODEC_ID_V210)
+            b_direct = b_direct && ! out->b_rgb;
+        else if (input->codecpar->codec_id == AV_CODEC_ID_RAWVIDEO)
+        {
+            AVPixelFormat want = out->b_rgb ? AV_PIX_FMT_RGB48LE : AV_PIX_FMT_YUYV422;
+            b_direct = b_direct && (AVPixelFormat)input->codecpar->format == want;
+        }
+        else
+            b_direct = false;
+    }
+    if (b_direct)
+        return;
+
+    // Otherwise we need to decode/scale it.
+    dec_ctx = avcodec_alloc_context3(dec);
+    if (!dec_ctx)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "open_input: avcodec_alloc_context3 failed\n");
+        throw 2;
+    }
+    if ((ret = avcodec_parameters_to_context(dec_ctx, input->codecpar)) < 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR,
+               "open_input: avcodec_parameters_to_context failed:\n%s\n", av_err2str(ret));
+        throw 2;
+    }
+    // libavcodec decodes on one thread unless told otherwise.  Give it a quarter of the
+    // thread budget; the encoder is the heavy stage and gets the rest (see process()).
+    // (Image sequences decode on the task pool, one file per task.)
+    if (b_sequence)
+        dec_ctx->thread_count = 1;
+    else
+    {
+        dec_ctx->thread_count = std::max(1, (cliopt->threads > 0 ? cliopt->threads
+                                                                  : default_threads()) / 4);
+        // Every frame thread holds a frame of its own, and delays the output by a frame.
+        if (cliopt->max_memory > 0 || cliopt->realtime > 0)
+            dec_ctx->thread_type = FF_THREAD_SLICE;
+        else
+            dec_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+        if (cliopt->realtime > 0)
+            dec_ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+        decode_threads = dec_ctx->thread_count;
+        av_log(nullptr, AV_LOG_INFO, "Decoding threads: %d\n", dec_ctx->thread_count);
+    }
+    if ((ret = avcodec_open2(dec_ctx, dec, nullptr)) < 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR,
+               "open_input: avcodec_open2 failed:\n%s\n", av_err2str(ret));
+        throw 2;
+    }
+}
+
+
+// Describes pictures from a frame queue as a raw video stream, so that the outputs are set up
+// as for any input.  The pictures go to the encoders as they are, so they must already be in
+// the format of every encoder: yuyv422 for YUV output, rgb48le for RGB.
+void CFHD_Transcoder::open_frames(CliOptions *cliopt)
+{
+    AVPixelFormat pix_fmt = av_get_pix_fmt(cliopt->pix_fmt_name);
+
+    width = cliopt->video_width;
+    height = cliopt->video_height;
+    if (! (input = avformat_new_stream(ifmt_ctx, nullptr)) || width <= 0 || height <= 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "open_frames: no frame size, or out of memory\n");
+        throw 2;
+    }
+    input->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+    input->codecpar->codec_id = AV_CODEC_ID_RAWVIDEO;
+    input->codecpar->format = pix_fmt;
+    input->codecpar->width = width;
+    input->codecpar->height = height;
+    input->time_base = av_inv_q(cliopt->r_frame_rate);
+    input->r_frame_rate = cliopt->r_frame_rate;
+    input->avg_frame_rate = cliopt->r_frame_rate;
+    input->sample_aspect_ratio = av_make_q(1, 1);
+    if (cliopt->aspect.num != 0)
+        input->sample_aspect_ratio = av_mul_q(cliopt->aspect, av_make_q(height, width));
+    input->codecpar->sample_aspect_ratio = input->sample_aspect_ratio;
+    pick_colors(cliopt->trc);
+
+    for (CFHD_Output *out : outputs)
+        if (out->scale > 1 ||
+            pix_fmt != (out->b_rgb ? AV_PIX_FMT_RGB48LE : AV_PIX_FMT_YUYV422))
+        {
+            av_log(nullptr, AV_LOG_ERROR, "Frames for '%s' must be %s at full size\n",
+                   out->path.c_str(), out->b_rgb ? "rgb48le" : "yuyv422");
+            throw 2;
+        }
+}
+
+
+// Describes a Vapoursynth script's output as a raw video stream, as open_frames does.  Its
+// frames are always converted, since Vapoursynth has no packed formats.
+void CFHD_Transcoder::open_script(CliOptions *cliopt)
+{
+    script = new CFHD_VapourSynthReader(cliopt->input);
+    if (! (input = avformat_new_stream(ifmt_ctx, nullptr)))
+    {
+        av_log(nullptr, AV_LOG_ERROR, "open_script: avformat_new_stream failed\n");
+        throw 2;
+    }
+    if (! script->open(input->codecpar))
+        throw 2;
+    width = input->codecpar->width;
+    height = input->codecpar->height;
+
+    AVRational rate = cliopt->framerate ? cliopt->r_frame_rate : script->frame_rate;
+    input->time_base = av_inv_q(rate);
+    input->r_frame_rate = rate;
+    input->avg_frame_rate = rate;
+    input->nb_frames = script->frames;
+    ifmt_ctx->duration = av_rescale_q(script->frames, input->time_base,
+                                      av_make_q(1, AV_TIME_BASE));
+    if (cliopt->aspect.num != 0)
+        input->codecpar->sample_aspect_ratio =
+            av_mul_q(cliopt->aspect, av_make_q(height, width));
+    else if (input->codecpar->sample_aspect_ratio.num == 0)
+        input->codecpar->sample_aspect_ratio = av_make_q(1, 1);
+    input->sample_aspect_ratio = input->codecpar->sample_aspect_ratio;
+
+    av_log(nullptr, AV_LOG_INFO, "Vapoursynth script '%s': %dx%d %s, %" PRId64
+           " frames at %d/%d fps\n", cliopt->input, width, height,
+           av_get_pix_fmt_name((AVPixelFormat)input->codecpar->format), input->nb_frames,
+           rate.num, rate.den);
+    pick_colors(cliopt->trc);
+    if (state)
+        state->total_frames = input->nb_frames;
+    for (CFHD_Output *out : outputs)
+        if (out->b_copy_asked)
+            av_log(nullptr, AV_LOG_WARNING,
+                   "The input is not Cineform, so '%s' is encoded rather than copied.\n",
+                   out->path.c_str());
+}
+
+
+// Takes the input's color matrix from -trc, else from its tags, else guesses it from the
+// frame width.  Primaries and transfer are passed through, or follow the matrix when the
+// input does not say.
+void CFHD_Transcoder::pick_colors(int trc)
+{
+    AVCodecParameters *par = input->codecpar;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat)par->format);
+
+    switch (trc)
+    {
+        case 601:
+            colorspace = AVCOL_SPC_BT470BG;
+            break;
+        case 709:
+            colorspace = AVCOL_SPC_BT709;
+            break;
+        case 2020:
+            colorspace = AVCOL_SPC_BT2020_NCL;
+            break;
+        default:
+            switch (par->color_space)
+            {
+                case AVCOL_SPC_BT709:
+                case AVCOL_SPC_BT470BG:
+                case AVCOL_SPC_SMPTE170M:
+                case AVCOL_SPC_BT2020_NCL:
+                    colorspace = par->color_space;
+                    break;
+                // constant luminance is not supported; the non-constant matrix is close
+                case AVCOL_SPC_BT2020_CL:
+                    colorspace = AVCOL_SPC_BT2020_NCL;
+                    break;
+                default:
+                    if (width <= 720)
+                        colorspace = AVCOL_SPC_BT470BG;
+                    else if (width <= 1920)
+                        colorspace = AVCOL_SPC_BT709;
+                    else
+                        colorspace = AVCOL_SPC_BT2020_NCL;
+            }
+    }
+    // yuvj formats are full range whether or not they are tagged
+    b_full_range = par->color_range == AVCOL_RANGE_JPEG ||
+                   (desc && strncmp(desc->name, "yuvj", 4) == 0);
+
+    color_primaries = par->color_primaries;
+    color_trc = par->color_trc;
+    if (color_primaries == AVCOL_PRI_UNSPECIFIED || color_primaries == AVCOL_PRI_RESERVED0)
+    {
+        if (colorspace == AVCOL_SPC_BT470BG)
+            color_primaries = AVCOL_PRI_BT470BG;
+        else if (colorspace == AVCOL_SPC_SMPTE170M)
+            color_primaries = AVCOL_PRI_SMPTE170M;
+        else if (colorspace == AVCOL_SPC_BT2020_NCL)
+            color_primaries = AVCOL_PRI_BT2020;
+        else
+            color_primaries = AVCOL_PRI_BT709;
+    }
+    if (color_trc == AVCOL_TRC_UNSPECIFIED || color_trc == AVCOL_TRC_RESERVED0)
+    {
+        if (colorspace == AVCOL_SPC_BT2020_NCL)
+            color_trc = AVCOL_TRC_BT2020_10;
+        else if (colorspace == AVCOL_SPC_BT709)
+            color_trc = AVCOL_TRC_BT709;
+        else
+            color_trc = AVCOL_TRC_SMPTE170M;
+    }
+    av_log(nullptr, AV_LOG_INFO, "Color: %s, %s range\n",
+           av_color_space_name(colorspace), b_full_range ? "full" : "limited");
+}
+
+
+void CFHD_Transcoder::guess_channel_layout(AVStream *ist, int i)
+{
+    char layout_name[256];
+
+    ist->codecpar->channel_layout = av_get_default_channel_layout(ist->codecpar->channels);
+    av_get_channel_layout_string(layout_name, sizeof(layout_name),
+                                 ist->codecpar->channels, ist->codecpar->channel_layout);
+    av_log(NULL, AV_LOG_WARNING, "Guessed channel layout for stream #0:%u: %s\n", i, layout_name);
+}
+
+
+// Audio the output container cannot hold is converted to PCM in the same pass, instead of
+// failing at the header, unless -audio copy is set.  -audio pcm converts every audio stream.
+void CFHD_Transcoder::open_audio(CliOptions *cliopt, CFHD_Output *out, AVStream *ist,
+                                 AVStream *ost)
+{
+    const AVOutputFormat *ofmt = out->ofmt_ctx->oformat;
+    AVCodecID codec_id = ist->codecpar->codec_id;
+    AVCodecID pcm = CFHD_AudioTranscoder::pcm_codec(ist->codecpar);
+
+    if (cliopt->audio == CliOptions::AUDIO_COPY || codec_id == pcm)
+        return;
+    // a muxer that cannot say whether it takes the codec is given it as it is
+    if (cliopt->audio == CliOptions::AUDIO_AUTO &&
+        avformat_query_codec(ofmt, codec_id, FF_COMPLIANCE_NORMAL) != 0)
+        return;
+    if (avformat_query_codec(ofmt, pcm, FF_COMPLIANCE_NORMAL) == 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR,
+               "'%s' cannot hold audio stream #0:%d as %s or as PCM.  Use -vo, or mov, avi or "
+               "matroska output.\n", out->path.c_str(), ist->index, avcodec_get_name(codec_id));
+        throw 3;
+    }
+
+    out->audio[ist->index] = new CFHD_AudioTranscoder(ist, ost);
+    if (! out->audio[ist->index]->open(pcm))
+        throw 3;
+    av_log(nullptr, AV_LOG_INFO, "Converting audio stream #0:%d from %s to %s for '%s'\n",
+           ist->index, avcodec_get_name(codec_id), avcodec_get_name(pcm), out->path.c_str());
+}
+
+
+void CFHD_Transcoder::open_output(CliOptions *cliopt)
+{
+    if (cliopt->trace)
+    {
+        trace = new CFHD_Trace();
+        if (! trace->open(cliopt->trace))
+            throw 3;
+    }
+    for (CFHD_Output *out : outputs)
+        open_output_file(cliopt, out);
+}
+
+
+void CFHD_Transcoder::open_output_file(CliOptions *cliopt, CFHD_Output *out)
+{
+    int i, ret;
+    AVStream *ist, *ost;
+    AVDictionaryEntry *tag = nullptr;
+    AVDictionary *options = nullptr;
+    const char *path = out->path.c_str();
+    bool b_pipe = strncmp(path, "pipe:", 5) == 0;
+    const char *format = out->format.empty() ? nullptr : out->format.c_str();
+    float frag = cliopt->frag;
+    AVFormatContext *ofmt_ctx = nullptr;
+
+    // A pipe cannot seek back to write an index, so mov/mp4 go out fragmented, and a pipe
+    // without -f gets fragmented mov.  The cfhd format is FFmpeg's raw muxer, which writes
+    // samples back to back.
+    if (b_pipe && ! format)
+        format = "mov";
+    if (format && strcmp(format, "cfhd") == 0)
+        format = "rawvideo";
+    
+    if ((ret = avformat_alloc_output_context2(&ofmt_ctx, nullptr, format, path)) < 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR,
+               "open_output: avformat_alloc_output_context2 failed:\n%s\n", av_err2str(ret));
+        throw 3;
+    }
+    out->ofmt_ctx = ofmt_ctx;
+    out->set_size(width, height);
+    if (out->cropped() &&
+        (out->width < 2 || out->height < 1 || out->crop_x + out->width > width ||
+         out->crop_y + out->height > height))
+    {
+        av_log(nullptr, AV_LOG_ERROR, "'%s' would take %dx%d+%d+%d of the %dx%d picture.\n",
+               path, out->width, out->height, out->crop_x, out->crop_y, width, height);
+        throw 3;
+    }
+    // a live output reaches the file or pipe packet by packet
+    if (cliopt->realtime > 0)
+        ofmt_ctx->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+
+    // checkpoints and -resume come with a single output
+    checkpoint_path = out->path + ".cfenc";
+    partial_path = out->path + ".partial";
+    if (cliopt->b_resume)
+        load_checkpoint(cliopt);
+    if (b_pipe && frag == 0 &&
+        (strcmp(ofmt_ctx->oformat->name, "mov") == 0 || strcmp(ofmt_ctx->oformat->name, "mp4") == 0))
+        frag = 1;
+    if (b_pipe && strcmp(ofmt_ctx->oformat->name, "avi") == 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "AVI output needs a seekable file.  Try -f mov or matroska.\n");
+        throw 3;
+    }
+    // Fragmented mov/mp4 carries its index in each fragment instead of one moov at the end,
+    // so the file can be read while it grows, survives a crash up to the last fragment and
+    // keeps the muxer's index memory flat however long the encode runs.  Fragments are cut
+    // every -frag seconds, and at every checkpoint, where we flush the muxer ourselves.
+    // mov and mp4 always get a colr atom, so players see the color tags set below.
+    bool b_mov = strcmp(ofmt_ctx->oformat->name, "mov") == 0 ||
+                 strcmp(ofmt_ctx->oformat->name, "mp4") == 0;
+    std::string movflags = "write_colr";
+    if (checkpoint > 0 || frag > 0)
+    {
+        if (! b_mov)
+        {
+            av_log(nullptr, AV_LOG_ERROR, "Fragmented output and checkpoints need mov or mp4.\n");
+            throw 3;
+        }
+        movflags += "+empty_moov+default_base_moof";
+        if (checkpoint > 0)
+            movflags += "+frag_custom";
+        if (frag > 0)
+            av_dict_set_int(&options, "frag_duration", (int64_t)(frag * 1000000), 0);
+        // hand each fragment to the OS as soon as it is cut so that readers can see it
+        ofmt_ctx->flush_packets = 1;
+    }
+    if (b_mov)
+        av_dict_set(&options, "movflags", movflags.c_str(), 0);
+
+    // copy container metadata
+    while ((tag = av_dict_get(ifmt_ctx->metadata, "", tag, AV_DICT_IGNORE_SUFFIX)))
+        // ignore these tags
+        if (strcmp(tag->key, "major_brand") != 0 && strcmp(tag->key, "minor_version") != 0 &&
+            strcmp(tag->key, "compatible_brands") !=0 && strcmp(tag->key, "encoder") != 0)
+        {
+            if ((ret = av_dict_set(&ofmt_ctx->metadata, tag->key, tag->value, 0)) < 0)
+                av_log(nullptr,
+                       AV_LOG_WARNING, "Error copying container metadata:\n%s\n", av_err2str(ret));
+        }
+
+    out->audio.assign(ifmt_ctx->nb_streams, nullptr);
+    for (i = 0; i < ifmt_ctx->nb_streams; i++)
+    {
+        ist = ifmt_ctx->streams[i];
+        
+        if (out->b_video_only && ist != input)
+            continue;
+
+        if (! (ost = avformat_new_stream(ofmt_ctx, nullptr)))
+        {
+            av_log(nullptr, AV_LOG_ERROR,
+                   "open_output: avformat_new_stream failed for for stream #0:%u\n", i);
+            throw 3;
+        }
+
+        // Copy track language
+        if ((tag = av_dict_get(ist->metadata, "language", nullptr, 0)))
+            if ((ret = av_dict_set(&ost->metadata, tag->key, tag->value, 0)) < 0)
+                av_log(nullptr, AV_LOG_WARNING, "Error copying language for stream #0:%u:\n%s\n",
+                                                i, av_err2str(ret));
+
+        if (ist == input)
+        {
+            if (out->b_copy)
+            {
+                if (avcodec_parameters_copy(ost->codecpar, ist->codecpar) < 0)
+                {
+                    av_log(nullptr, AV_LOG_ERROR,
+                           "open_output: avcodec_parameters_copy failed for stream #0:%u\n", i);
+                    throw 3;
+                }
+                // let the muxer pick the tag for its container
+                ost->codecpar->codec_tag = 0;
+                av_log(nullptr, AV_LOG_INFO, "Copying the Cineform video into '%s'\n", path);
+            }
+            ost->codecpar->codec_id = AV_CODEC_ID_CFHD;
+            ost->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+            // Encoded video keeps the input's primaries and transfer.  RGB is full range
+            // and YUV is limited range in the input's matrix, as converted.
+            if (! out->b_copy)
+            {
+                ost->codecpar->format = out->b_rgb ? AV_PIX_FMT_GBRP12LE : AV_PIX_FMT_YUV422P10LE;
+                ost->codecpar->color_space = out->b_rgb ? AVCOL_SPC_RGB : colorspace;
+                ost->codecpar->color_range = out->b_rgb ? AVCOL_RANGE_JPEG : AVCOL_RANGE_MPEG;
+                ost->codecpar->color_primaries = color_primaries;
+                ost->codecpar->color_trc = color_trc;
+            }
+            ost->codecpar->width = out->width;
+            ost->codecpar->height = out->height;
+            ost->codecpar->video_delay = ist->codecpar->video_delay;
+            ost->time_base = av_inv_q(ist->r_frame_rate);
+            ost->r_frame_rate = ist->r_frame_rate;
+            ost->avg_frame_rate = ist->avg_frame_rate;
+            // this is required for mov files
+            ost->codecpar->sample_aspect_ratio = ist->sample_aspect_ratio;
+            // this is required for avi files
+            ost->sample_aspect_ratio = ist->sample_aspect_ratio;
+        }
+        else
+        {
+            ost->time_base = ist->time_base;
+            if ((avcodec_parameters_copy(ost->codecpar, ist->codecpar)) < 0)
+            {
+                av_log(nullptr, AV_LOG_ERROR,
+                       "open_output: avcodec_parameters_copy failed for stream #0:%u\n", i);
+                throw 3;
+            }
+            // As FFmpeg does for stream copy, the input's tag is kept only where the output
+            // container reads it as the same codec, or has no tag of its own for the codec.
+            // Otherwise the muxer picks its tag, such as for PCM going from MOV to AVI.
+            const AVOutputFormat *ofmt = ofmt_ctx->oformat;
+            AVCodecID codec_id = ist->codecpar->codec_id;
+            unsigned int codec_tag;
+            if (ofmt->codec_tag &&
+                av_codec_get_id(ofmt->codec_tag, ist->codecpar->codec_tag) != codec_id &&
+                av_codec_get_tag2(ofmt->codec_tag, codec_id, &codec_tag))
+                ost->codecpar->codec_tag = 0;
+            if (ist->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+            {
+                if (! ost->codecpar->channel_layout)
+                    guess_channel_layout(ost, i);
+                open_audio(cliopt, out, ist, ost);
+            }
+        }
+    }
+
+    if (b_pipe)
+    {
+        int fd = path[5] ? atoi(path + 5) : 1;
+        out->pipe_writer = new CFHD_PipeWriter(fd, cliopt->pipe_size);
+        if (! out->pipe_writer->open())
+            throw 3;
+        ofmt_ctx->pb = out->pipe_writer->pb;
+        out->pipe_writer->b_flush = cliopt->realtime > 0;
+    }
+    else if ((ret = avio_open(&ofmt_ctx->pb, path, AVIO_FLAG_WRITE)) < 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "open_output: avio_open failed:\n%s\n", av_err2str(ret));
+        throw 3;
+    }
+    ret = avformat_write_header(ofmt_ctx, &options);
+    av_dict_free(&options);
+    if (ret < 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "open_output: avformat_write_header failed:\n%s\n",
+               av_err2str(ret));
+        throw 3;
+    }
+    out->muxer = new CFHD_Muxer(ofmt_ctx, out->path);
+    out->muxer->trace = trace;
+    // the writer still gets a few 8K samples ahead of the disk
+    if (b_low_memory)
+        out->muxer->max_bytes = 64 << 20;
+    out->muxer->start();
+    for (CFHD_AudioTranscoder *audio : out->audio)
+        if (audio)
+            audio->start(out->muxer);
+
+    av_dump_format(ofmt_ctx, 0, path, 1);
+}
+
+
+bool CFHD_Transcoder::write_cfhd_sample(CFHD_Output *out)
+{
+    CFHD_Encoder *cfhd = out->cfhd;
+    CFHD_Encoder::CFHD_Sample &sample = cfhd->sample;
+
+    if (sample.size > 0)
+    {
+        if (! write_video(out, sample.data, sample.size, sample.quality, sample.frame_num,
+                          sample.pts, sample.duration))
+            return false;
+        if (trace)
+            trace->encoded(out->path, sample.frame_num, sample.submit_us, sample.done_us);
+        if (realtime_us > 0)
+        {
+            int64_t ms = (now_us() - sample.submit_us) / 1000;
+            live_latency[(size_t)std::min<int64_t>(ms, live_latency.size() - 1)]++;
+        }
+        if (out->analyzer &&
+            ! out->analyzer->submit(sample.data, sample.size, sample.picture,
+                                    sample.picture_data, sample.picture_pitch, sample.frame_num))
+            return false;
+
+        // repeats of the frame being held still may come after this
+        if (sample.frame_num == out->run_source)
+        {
+            out->held.assign(sample.data, sample.data + sample.size);
+            out->held_frame = sample.frame_num;
+            out->held_quality = sample.quality;
+        }
+        while (! out->repeats.empty() && out->repeats.front().source == sample.frame_num)
+        {
+            const CFHD_Output::Repeat &r = out->repeats.front();
+            if (! write_video(out, sample.data, sample.size, sample.quality, r.frame_num, r.pts,
+                              r.duration))
+                return false;
+            out->repeats.pop_front();
+        }
+
+        av_buffer_unref(&sample.picture);
+        sample.data = nullptr;
+        sample.size = 0;
+        CFHD_ReleaseSampleBuffer(cfhd->pool, sample.buffer);
+    }
+    return true;
+}
+
+
+// Muxes one Cineform sample, encoded at quality, as frame frame_num.  pts and duration are
+// in the input time base.
+bool CFHD_Transcoder::write_video(CFHD_Output *out, const uint8_t *data, size_t size,
+                                  CFHD_EncodingQuality quality, uint32_t frame_num, int64_t pts,
+                                  int64_t duration)
+{
+    AVPacket *out_pkt = out->pkt;
+
+    if (state && state->b_cancel)
+    {
+        av_log(nullptr, AV_LOG_INFO, "Cancelled '%s'\n", out->path.c_str());
+        return false;
+    }
+    out_pkt->data = (uint8_t*)data;
+    out_pkt->size = (int)size;
+    out_pkt->flags |= AV_PKT_FLAG_KEY;
+    out_pkt->duration = duration;
+    out_pkt->pts = out_pkt->dts = pts;
+    out_pkt->stream_index = out->video_index(input);
+    AVStream *output = out->ofmt_ctx->streams[out_pkt->stream_index];
+    av_packet_rescale_ts(out_pkt, input->time_base, output->time_base);
+
+    int64_t start = now_us();
+    if (! out->muxer->write(out_pkt))
+        return false;
+    if (trace)
+        trace->span("mux", start, frame_num);
+    // the first output reports for all of them
+    if (out == outputs[0])
+    {
+        show_progress(frame_num);
+        if (state)
+            state->frames = frame_num;
+    }
+    if (out->rate)
+        out->rate->add_sample(size, quality);
+
+    if (checkpoint > 0 && frame_num % checkpoint == 0)
+        return write_checkpoint(frame_num, pts);
+    return true;
+}
+
+
+void CFHD_Transcoder::show_progress(uint32_t frame_num)
+{
+    if (! b_progress)
+        return;
+    if (input->nb_frames > 0)
+        av_log(nullptr, AV_LOG_INFO, "           Frame: %u / %lld\r", frame_num, input->nb_frames);
+    else
+        av_log(nullptr, AV_LOG_INFO, "           Frame: %u\r", frame_num);
+}
+
+
+// Rewraps a packet of the Cineform input for the outputs that copy the video.
+bool CFHD_Transcoder::copy_video(AVPacket *pkt)
+{
+    int ret;
+
+    // frames the resumed output already has
+    if (resume_pts != AV_NOPTS_VALUE && pkt->pts != AV_NOPTS_VALUE && pkt->pts <= resume_pts)
+        return true;
+    for (CFHD_Output *out : outputs)
+    {
+        if (! out->b_copy)
+            continue;
+        if ((ret = av_packet_ref(copy_pkt, pkt)) < 0)
+        {
+            av_log(nullptr, AV_LOG_ERROR, "copy_video: av_packet_ref failed:\n%s\n",
+                   av_err2str(ret));
+            return false;
+        }
+        copy_pkt->stream_index = out->video_index(input);
+        av_packet_rescale_ts(copy_pkt, input->time_base,
+                             out->ofmt_ctx->streams[copy_pkt->stream_index]->time_base);
+        bool b_ok = out->muxer->write(copy_pkt);
+        av_packet_unref(copy_pkt);
+        if (! b_ok)
+            return false;
+        out->copied++;
+        if (out == outputs[0])
+            show_progress(out->copied);
+        if (checkpoint > 0 && out->copied % checkpoint == 0 &&
+            ! write_checkpoint(out->copied, pkt->pts))
+            return false;
+    }
+    return true;
+}
+
+
+// Settles what a checkpoint must match to be resumed: the same input file, unchanged, and
+// the same settings for everything that decides the bitstream of the output.
+void CFHD_Transcoder::identify_checkpoint(CliOptions *cliopt)
+{
+    struct stat st;
+    input_bytes = -1;
+    input_mtime = -1;
+    if (cliopt->input && stat(cliopt->input, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        input_bytes = st.st_size;
+        input_mtime = st.st_mtime;
+    }
+
+    const CliOutput &out = cliopt->outputs[0];
+    std::string settings = out.quality + " " + std::to_string(out.b_rgb) + " " + out.format +
+        " " + std::to_string(out.b_video_only) + " " + std::to_string(out.scale) + " " +
+        std::to_string(out.b_copy) + " " + std::to_string(out.target_bitrate) + " " +
+        std::to_string(out.target_size) + " " + std::to_string(out.crop_x) + " " +
+        std::to_string(out.crop_y) + " " + std::to_string(out.crop_width) + " " +
+        std::to_string(out.crop_height) + " " + std::to_string(cliopt->trc) + " " +
+        std::to_string(cliopt->aspect.num) + ":" + std::to_string(cliopt->aspect.den) + " " +
+        std::to_string(cliopt->audio) + " " + std::to_string(cliopt->b_ffmpeg_decoder) + " " +
+        std::to_string(cliopt->b_fixed_matrix);
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : settings)
+        hash = (hash ^ c) * 1099511628211ULL;
+    settings_hash = (int64_t)(hash >> 1);
+}
+
+
+void CFHD_Transcoder::load_checkpoint(CliOptions *cliopt)
+{
+    std::ifstream file(checkpoint_path);
+    std::string key;
+    int64_t value;
+    int interval = 0;
+    int64_t bytes = -1, mtime = -1, settings = -1;
+    bool b_bytes = false, b_mtime = false, b_settings = false;
+
+    if (! file)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "No checkpoint found for '%s'\n", cliopt->output);
+        throw 3;
+    }
+    while (file >> key >> value)
+    {
+        if (key == "interval") interval = (int)value;
+        else if (key == "frames") resume_frames = (uint32_t)value;
+        else if (key == "pts") resume_pts = value;
+        else if (key == "bytes") resume_bytes = value;
+        else if (key == "input_bytes") bytes = value, b_bytes = true;
+        else if (key == "input_mtime") mtime = value, b_mtime = true;
+        else if (key == "settings") settings = value, b_settings = true;
+        else if (key.compare(0, 5, "rate_") == 0)
+            resume_rate.push_back(std::make_pair(key.substr(5), value));
+    }
+    if (resume_frames == 0 || resume_pts == AV_NOPTS_VALUE || resume_bytes <= 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "Checkpoint '%s' is incomplete\n", checkpoint_path.c_str());
+        throw 3;
+    }
+    // without the input and the settings it was written for there is nothing to check a
+    // resume against, so a checkpoint that lacks them cannot be resumed
+    if (! b_bytes || ! b_mtime || ! b_settings)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "Checkpoint '%s' does not record the input and settings "
+               "it was written for; encode '%s' again\n", checkpoint_path.c_str(), cliopt->output);
+        throw 3;
+    }
+    if (bytes != input_bytes || mtime != input_mtime)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "'%s' has changed since checkpoint '%s' was written\n",
+               cliopt->input, checkpoint_path.c_str());
+        throw 2;
+    }
+    if (settings != settings_hash)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "Checkpoint '%s' was written with other encode settings; "
+               "resume with the settings of the interrupted run\n", checkpoint_path.c_str());
+        throw 1;
+    }
+    if (checkpoint == 0)
+        checkpoint = interval;
+
+    // If a partial file is already there, an earlier resume died before its first checkpoint
+    // and the partial file is still the good copy.
+    if (access(partial_path.c_str(), F_OK) != 0 &&
+        rename(cliopt->output, partial_path.c_str()) != 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "Failed to rename '%s' to '%s'\n",
+               cliopt->output, partial_path.c_str());
+        throw 3;
+    }
+    // drop anything written after the checkpoint, such as half a fragment
+    if (truncate(partial_path.c_str(), resume_bytes) != 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "Failed to truncate '%s'\n", partial_path.c_str());
+        throw 3;
+    }
+    av_log(nullptr, AV_LOG_INFO, "Resuming '%s' after frame %u\n", cliopt->output, resume_frames);
+}
+
+
+// fsync()s a file, or a directory so that a rename in it is on disk.
+static bool sync_path(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    bool b_ok = fsync(fd) == 0;
+    close(fd);
+    return b_ok;
+}
+
+
+// Flushes the current fragment, then replaces the sidecar so that it never describes more
+// than what is on disk.  The output reaches the disk before the new sidecar is written, and
+// the sidecar before it is renamed into place, so a power loss leaves a checkpoint that
+// points at data the disk has.
+bool CFHD_Transcoder::write_checkpoint(uint32_t frame_num, int64_t pts)
+{
+    int ret;
+    std::string tmp_path = checkpoint_path + ".tmp";
+    AVFormatContext *ofmt_ctx = outputs[0]->ofmt_ctx;
+
+    // everything up to here goes into the fragment, including what waits to be interleaved
+    if (! outputs[0]->muxer->sync())
+        return false;
+    if ((ret = av_interleaved_write_frame(ofmt_ctx, nullptr)) < 0 ||
+        (ret = av_write_frame(ofmt_ctx, nullptr)) < 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR,
+               "write_checkpoint: flushing the muxer failed:\n%s\n", av_err2str(ret));
+        return false;
+    }
+    avio_flush(ofmt_ctx->pb);
+    if (! sync_path(outputs[0]->path))
+    {
+        av_log(nullptr, AV_LOG_ERROR, "write_checkpoint: failed to sync '%s'\n",
+               outputs[0]->path.c_str());
+        return false;
+    }
+
+    std::ofstream file(tmp_path, std::ios::trunc);
+    file << "interval " << checkpoint << "\n"
+         << "frames " << frame_num << "\n"
+         << "pts " << pts << "\n"
+         << "bytes " << avio_tell(ofmt_ctx->pb) << "\n"
+         << "input_bytes " << input_bytes << "\n"
+         << "input_mtime " << input_mtime << "\n"
+         << "settings " << settings_hash << "\n";
+    if (outputs[0]->rate)
+        outputs[0]->rate->save(file);
+    file.close();
+    size_t slash = checkpoint_path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : checkpoint_path.substr(0, slash + 1);
+    if (! file || ! sync_path(tmp_path) || rename(tmp_path.c_str(), checkpoint_path.c_str()) != 0 ||
+        ! sync_path(dir))
+    {
+        av_log(nullptr, AV_LOG_ERROR, "write_checkpoint: failed to write '%s'\n",
+               checkpoint_path.c_str());
+        return false;
+    }
+    // the new output now holds everything the partial file did
+    if (resume_frames)
+        remove(partial_path.c_str());
+    return true;
+}
+
+
+// Copies the committed part of an interrupted encode into the new output, then seeks the
+// input back to the keyframe before the last committed frame.  Frames up to and including
+// that one are decoded and dropped.  The frame index names the key frame, which is sought by
+// its position where the input is split by bytes and by its own timestamp elsewhere; without
+// an index the demuxer picks the key frame for the committed timestamp.
+void CFHD_Transcoder::resume()
+{
+    AVFormatContext *partial = nullptr;
+    AVPacket *pkt;
+    int ret;
+    uint32_t frames = 0;
+    AVFormatContext *ofmt_ctx = outputs[0]->ofmt_ctx;
+    int video_index = outputs[0]->video_index(input);
+
+    if ((ret = avformat_open_input(&partial, partial_path.c_str(), nullptr, nullptr)) < 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR,
+               "Failed to open '%s':\n%s\n", partial_path.c_str(), av_err2str(ret));
+        throw 3;
+    }
+    if (partial->nb_streams != ofmt_ctx->nb_streams || ! (pkt = av_packet_alloc()))
+    {
+        av_log(nullptr, AV_LOG_ERROR,
+               "resume: '%s' does not match the new output\n", partial_path.c_str());
+        avformat_close_input(&partial);
+        throw 3;
+    }
+
+    resume_last_pts.assign(ofmt_ctx->nb_streams, AV_NOPTS_VALUE);
+    while (av_read_frame(partial, pkt) >= 0)
+    {
+        int i = pkt->stream_index;
+        if (i == video_index)
+        {
+            if (frames == resume_frames)
+            {
+                av_packet_unref(pkt);
+                continue;
+            }
+            frames++;
+        }
+        av_packet_rescale_ts(pkt, partial->streams[i]->time_base, ofmt_ctx->streams[i]->time_base);
+        if (pkt->pts != AV_NOPTS_VALUE &&
+            (resume_last_pts[i] == AV_NOPTS_VALUE || pkt->pts > resume_last_pts[i]))
+            resume_last_pts[i] = pkt->pts;
+        ret = av_write_frame(ofmt_ctx, pkt);
+        av_packet_unref(pkt);
+        if (ret < 0)
+        {
+            av_log(nullptr, AV_LOG_ERROR, "resume: av_write_frame failed:\n%s\n", av_err2str(ret));
+            break;
+        }
+    }
+    av_packet_free(&pkt);
+    avformat_close_input(&partial);
+
+    if (ret < 0 || frames < resume_frames)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "resume: '%s' holds %u of %u checkpointed frames\n",
+               partial_path.c_str(), frames, resume_frames);
+        throw 3;
+    }
+    const CFHD_FrameIndex::KeyFrame *key = frame_index.key_before(resume_frames, resume_pts);
+    if (key)
+        av_log(nullptr, AV_LOG_DEBUG, "Resuming from key frame %" PRId64 "\n", key->frame);
+    if (key && key->pos >= 0 && CFHD_FrameIndex::by_bytes(ifmt_ctx))
+        ret = av_seek_frame(ifmt_ctx, input->index, key->pos, AVSEEK_FLAG_BYTE);
+    else
+        ret = av_seek_frame(ifmt_ctx, input->index,
+                            key && key->ts != AV_NOPTS_VALUE ? key->ts : resume_pts,
+                            AVSEEK_FLAG_BACKWARD);
+    if (ret < 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "resume: av_seek_frame failed:\n%s\n", av_err2str(ret));
+        throw 3;
+    }
+    frame_count = resume_frames;
+    outputs[0]->copied = resume_frames;
+}
+
+
+// True for a packet of a copied stream that the resumed output already has.
+bool CFHD_Transcoder::skip_resumed(AVPacket *pkt)
+{
+    if (resume_last_pts.empty() || pkt->pts == AV_NOPTS_VALUE)
+        return false;
+    int64_t last = resume_last_pts[pkt->stream_index];
+    if (last == AV_NOPTS_VALUE)
+        return false;
+    return av_rescale_q(pkt->pts, ifmt_ctx->streams[pkt->stream_index]->time_base,
+                        outputs[0]->ofmt_ctx->streams[pkt->stream_index]->time_base) <= last;
+}
+
+
+bool CFHD_Transcoder::init_v210_encoder(Conversion &conv)
+{
+    int ret;
+
+    const AVCodec *v210 = avcodec_find_encoder_by_name("v210");
+    if (! v210)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "v210 codec not found with libavcodec.\n");
+        av_log(nullptr, AV_LOG_ERROR, "Check the version and build options for libavcodec.\n");
+        return false;
+    }
+    if (! (conv.v210_ctx = avcodec_alloc_context3(v210)))
+    {
+        av_log(nullptr, AV_LOG_ERROR, "init_v210_encoder: avcodec_alloc_context3 failed\n");
+        return false;
+    }
+
+    conv.v210_ctx->width = conv.width;
+    conv.v210_ctx->height = conv.height;
+    conv.v210_ctx->time_base = input->time_base;
+    conv.v210_ctx->pix_fmt = AV_PIX_FMT_YUV422P10LE;
+
+    if ((ret = avcodec_open2(conv.v210_ctx, v210, nullptr)) < 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR,
+               "init_v210_encoder: avcodec_open2 failed:\n%s\n", av_err2str(ret));
+        return false;
+    }
+    return true;
+}
+
+
+// Packs a yuv422p10 frame into v210.  Every packet gets a buffer of its own, which the
+// encoders can hold on to.
+bool CFHD_Transcoder::encode_v210(Conversion &conv, AVFrame *frame)
+{
+    int ret;
+
+    av_packet_unref(conv.v210_pkt);
+    if ((ret = avcodec_send_frame(conv.v210_ctx, frame)) < 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR,
+               "encode_v210: avcodec_send_frame failed:\n%s\n", av_err2str(ret));
+        return false;
+    }
+    while (1)
+    {
+        ret = avcodec_receive_packet(conv.v210_ctx, conv.v210_pkt);
+        if (ret == 0)
+        {
+            conv.buf = conv.v210_pkt->buf;
+            conv.data = conv.v210_pkt->buf->data;
+            conv.pitch = conv.v210_pkt->buf->size / conv.height;
+            return true;
+        }
+        else if (ret != AVERROR(EAGAIN))
+        {
+            av_log(nullptr, AV_LOG_ERROR,
+                   "encode_v210: avcodec_receive_packet failed:\n%s\n", av_err2str(ret));
+            return false;
+        }
+    }
+}
+
+
+// Returns the conversion for an encoder input format and size, setting it up the first time
+// an output asks for it.
+int CFHD_Transcoder::add_conversion(AVPixelFormat pix_fmt, bool b_v210, bool accurate, int scale)
+{
+    int source = -1;
+
+    for (size_t i = 0; i < conversions.size(); i++)
+        if (conversions[i].pix_fmt == pix_fmt && conversions[i].scale == scale &&
+            conversions[i].b_v210 == b_v210)
+            return (int)i;
+
+    // A proxy needs the full size picture, whether or not an output encodes it.  A kernel
+    // that packs v210 never makes that picture, so the proxy gets a conversion of its own.
+    if (scale > 1)
+    {
+        for (size_t i = 0; i < conversions.size() && source < 0; i++)
+            if (conversions[i].pix_fmt == pix_fmt && conversions[i].scale == 1 &&
+                ! (conversions[i].kernel && conversions[i].b_v210))
+                source = (int)i;
+        if (source < 0 && (source = add_conversion(pix_fmt, false, accurate, 1)) < 0)
+            return -1;
+    }
+
+    conversions.push_back(Conversion());
+    Conversion &conv = conversions.back();
+    conv.pix_fmt = pix_fmt;
+    conv.scale = scale;
+    conv.width = scale > 1 ? (width / scale) & ~1 : width;
+    conv.height = scale > 1 ? (height / scale) & ~1 : height;
+    conv.source = source;
+    conv.b_matrix = false;
+    conv.kernel = nullptr;
+    conv.kernel_pitch = 0;
+    conv.b_v210 = b_v210;
+    conv.pool = nullptr;
+    conv.picture = nullptr;
+    conv.frame = av_frame_alloc();
+    conv.decoder = nullptr;
+    conv.decode_fmt = CFHD_PIXEL_FORMAT_UNKNOWN;
+    conv.v210_ctx = nullptr;
+    conv.v210_pkt = av_packet_alloc();
+    conv.buf = nullptr;
+    conv.data = nullptr;
+    conv.pitch = 0;
+    if (! (conv.frame && conv.v210_pkt))
+    {
+        av_log(nullptr, AV_LOG_ERROR, "add_conversion: allocation failed\n");
+        return -1;
+    }
+
+    // Kernels keep the range of the samples, so full range YUV is left to swscale
+    CFHD_PixelFormat target = b_v210 ? CFHD_PIXEL_FORMAT_V210 :
+                              pix_fmt == AV_PIX_FMT_RGB48LE ? CFHD_PIXEL_FORMAT_RG48 :
+                              pix_fmt == AV_PIX_FMT_YUYV422 ? CFHD_PIXEL_FORMAT_YUY2 :
+                              CFHD_PIXEL_FORMAT_UNKNOWN;
+    const AVPixFmtDescriptor *src_desc =
+        av_pix_fmt_desc_get((AVPixelFormat)input->codecpar->format);
+    bool b_same_range = ! b_full_range || (src_desc && (src_desc->flags & AV_PIX_FMT_FLAG_RGB));
+    if (scale == 1 && target != CFHD_PIXEL_FORMAT_UNKNOWN && b_same_range)
+        conv.kernel = CFHD_Kernels::find((AVPixelFormat)input->codecpar->format, target);
+
+    if (conv.kernel)
+    {
+        conv.kernel_pitch = CFHD_Kernels::pitch(target, width);
+        if (! (conv.pool = av_buffer_pool_init(conv.kernel_pitch * height, nullptr)))
+        {
+            av_log(nullptr, AV_LOG_ERROR, "add_conversion: av_buffer_pool_init failed\n");
+            return -1;
+        }
+        if (! init_scaler(conv, accurate))
+            return -1;
+    }
+    else if (pix_fmt != AV_PIX_FMT_NONE || scale > 1)
+    {
+        // only yuv422p10 input is taken as decoded
+        AVPixelFormat picture_fmt = pix_fmt;
+        if (picture_fmt == AV_PIX_FMT_NONE)
+            picture_fmt = (AVPixelFormat)input->codecpar->format;
+        int size = av_image_get_buffer_size(picture_fmt, conv.width, conv.height, 32);
+        if (size < 0 || ! (conv.pool = av_buffer_pool_init(size, nullptr)))
+        {
+            av_log(nullptr, AV_LOG_ERROR, "add_conversion: av_buffer_pool_init failed\n");
+            return -1;
+        }
+        if (scale == 1 && ! init_scaler(conv, accurate))
+            return -1;
+    }
+    if (b_v210 && ! conv.kernel && ! init_v210_encoder(conv))
+        return -1;
+    return (int)(conversions.size() - 1);
+}
+
+
+// Points conv.frame at a fresh picture from the pool.  Pictures still being encoded are
+// never written over.
+bool CFHD_Transcoder::get_picture(Conversion &conv, AVPixelFormat pix_fmt)
+{
+    av_frame_unref(conv.frame);
+    if (! (conv.frame->buf[0] = av_buffer_pool_get(conv.pool)))
+    {
+        av_log(nullptr, AV_LOG_ERROR, "get_picture: av_buffer_pool_get failed\n");
+        return false;
+    }
+    conv.frame->width = conv.width;
+    conv.frame->height = conv.height;
+    conv.frame->format = pix_fmt;
+    // a kernel writes the encoder input itself, which has no AVPixelFormat when it is v210
+    if (conv.kernel)
+    {
+        conv.frame->data[0] = conv.frame->buf[0]->data;
+        conv.frame->linesize[0] = conv.kernel_pitch;
+        return true;
+    }
+    av_image_fill_arrays(conv.frame->data, conv.frame->linesize, conv.frame->buf[0]->data,
+                         pix_fmt, conv.width, conv.height, 32);
+    return true;
+}
+
+
+// Leaves the encoder input for the decoded in_frame in conv.buf, conv.data and conv.pitch.
+bool CFHD_Transcoder::convert(Conversion &conv)
+{
+    AVFrame *frame = in_frame;
+
+    if (conv.scale > 1)
+    {
+        AVFrame *source = conversions[conv.source].picture;
+        if (! (get_picture(conv, (AVPixelFormat)source->format) && downscale(conv)))
+            return false;
+        frame = conv.frame;
+    }
+    else if (! conv.bands.empty())
+    {
+        if (! (get_picture(conv, conv.pix_fmt) && scale_frame(conv)))
+            return false;
+        frame = conv.frame;
+    }
+    conv.picture = frame;
+    if (conv.v210_ctx)
+        return encode_v210(conv, frame);
+
+    conv.buf = frame->buf[0];
+    conv.data = frame->data[0];
+    conv.pitch = frame->linesize[0];
+    return true;
+}
+
+
+bool CFHD_Transcoder::init_scaler(Conversion &conv, bool accurate)
+{
+    const AVPixelFormat src_pix_fmt = (AVPixelFormat)input->codecpar->format;
+    const AVPixFmtDescriptor *src_desc = av_pix_fmt_desc_get(src_pix_fmt);
+    int flags = SWS_BICUBIC;
+    const int *table;
+    int ret;
+
+    if (accurate)
+        flags |= SWS_ACCURATE_RND | SWS_FULL_CHR_H_INT;
+
+    table = sws_getCoefficients(colorspace);
+    bool b_src_rgb = src_desc->flags & AV_PIX_FMT_FLAG_RGB;
+    int src_range = b_src_rgb || b_full_range ? 1 : 0;
+    int dst_range = conv.pix_fmt == AV_PIX_FMT_RGB48LE ? 1 : 0;
+
+    conv.b_matrix = b_fixed_matrix && ! conv.kernel &&
+                    CFHD_ColorMatrix::supports(src_pix_fmt, conv.pix_fmt);
+    if (conv.b_matrix)
+        conv.matrix.init(colorspace, b_full_range, src_pix_fmt, width, height);
+
+    // Bands below 64 rows are not worth a task.  Band edges stay on 16-row boundaries so
+    // they line up with chroma rows for every subsampling.
+    int count = 1;
+    if (taskpool)
+        count = std::max(1, std::min(taskpool->size() + 1, height / 64));
+    // our kernels read chroma rows directly, so they need no padding
+    int pad = src_desc->log2_chroma_h && ! conv.b_matrix && ! conv.kernel ? 8 : 0;
+    // Low-memory mode scales such sources in one band, with no scratch frames.
+    if (pad && b_low_memory)
+    {
+        count = 1;
+        pad = 0;
+    }
+    int rows = (height + count - 1) / count;
+    rows = (rows + 15) & ~15;
+
+    for (int y = 0; y < height; y += rows)
+    {
+        ScaleBand band;
+        band.y = y;
+        band.rows = std::min(rows, height - y);
+        band.pad_top = y > 0 ? pad : 0;
+        band.pad_bottom = y + band.rows < height ? pad : 0;
+        band.scratch = nullptr;
+        band.ctx = nullptr;
+        int src_rows = band.pad_top + band.rows + band.pad_bottom;
+
+        if (conv.b_matrix || conv.kernel)
+        {
+            if (conv.b_matrix)
+                band.lines.resize(conv.matrix.scratch_size());
+            else
+                band.kernel_lines.resize(CFHD_Kernels::scratch_size(width));
+            conv.bands.push_back(band);
+            continue;
+        }
+        band.ctx = sws_getContext(width, src_rows, src_pix_fmt,
+                                  width, src_rows, conv.pix_fmt,
+                                  flags, nullptr, nullptr, nullptr);
+        if (! band.ctx)
+        {
+            av_log(nullptr, AV_LOG_ERROR, "init_scaler: sws_getContext failed\n");
+            return false;
+        }
+        conv.bands.push_back(band);
+        sws_setColorspaceDetails(band.ctx, table, src_range, table, dst_range, 0, 1 << 16, 1 << 16);
+
+        if (band.pad_top || band.pad_bottom)
+        {
+            AVFrame *scratch = av_frame_alloc();
+            if (! scratch)
+            {
+                av_log(nullptr, AV_LOG_ERROR, "init_scaler: frame allocation failed\n");
+                return false;
+            }
+            conv.bands.back().scratch = scratch;
+            scratch->width = width;
+            scratch->height = src_rows;
+            scratch->format = conv.pix_fmt;
+            if ((ret = av_frame_get_buffer(scratch, 0)) < 0)
+            {
+                av_log(nullptr, AV_LOG_ERROR,
+                       "init_scaler: av_frame_get_buffer failed:\n%s\n", av_err2str(ret));
+                return false;
+            }
+        }
+    }
+    if (conv.kernel)
+        av_log(nullptr, AV_LOG_DEBUG, "Converting to %s with the %s kernel in %zu bands of "
+               "%d rows\n", conv.b_v210 ? "v210" : av_get_pix_fmt_name(conv.pix_fmt),
+               CFHD_Kernels::isa_name(CFHD_Kernels::isa()), conv.bands.size(), rows);
+    else
+        av_log(nullptr, AV_LOG_DEBUG, "Converting to %s with %s in %zu bands of %d rows\n",
+               av_get_pix_fmt_name(conv.pix_fmt), conv.b_matrix ? "our kernels" : "swscale",
+               conv.bands.size(), rows);
+    return true;
+}
+
+
+bool CFHD_Transcoder::scale_band(Conversion &conv, ScaleBand &band)
+{
+    AVFrame *out_frame = conv.frame;
+    const AVPixFmtDescriptor *src_desc = av_pix_fmt_desc_get((AVPixelFormat)in_frame->format);
+    const AVPixFmtDescriptor *dst_desc = av_pix_fmt_desc_get((AVPixelFormat)out_frame->format);
+    const uint8_t *src[4] = { nullptr };
+    uint8_t *dst[4] = { nullptr };
+    int dst_stride[4] = { 0 };
+    int top = band.y - band.pad_top;
+    int src_rows = band.pad_top + band.rows + band.pad_bottom;
+
+    if (conv.kernel)
+    {
+        conv.kernel(in_frame, out_frame->data[0], out_frame->linesize[0], band.y,
+                    band.y + band.rows, band.kernel_lines.data());
+        return true;
+    }
+    if (conv.b_matrix)
+    {
+        if (src_desc->flags & AV_PIX_FMT_FLAG_RGB)
+            conv.matrix.rgb_to_yuv422(in_frame, out_frame, band.y, band.y + band.rows,
+                                      band.lines.data());
+        else
+            conv.matrix.yuv_to_rgb48(in_frame, out_frame, band.y, band.y + band.rows,
+                                     band.lines.data());
+        return true;
+    }
+
+    for (int p = 0; p < 4; p++)
+    {
+        if (! in_frame->data[p])
+            continue;
+        // the palette of paletted formats is not an image plane
+        if (p == 1 && (src_desc->flags & AV_PIX_FMT_FLAG_PAL))
+            src[p] = in_frame->data[p];
+        else
+        {
+            int shift = (p == 1 || p == 2) ? src_desc->log2_chroma_h : 0;
+            src[p] = in_frame->data[p] + (ptrdiff_t)in_frame->linesize[p] * (top >> shift);
+        }
+    }
+
+    for (int p = 0; p < 4; p++)
+    {
+        if (band.scratch)
+        {
+            dst[p] = band.scratch->data[p];
+            dst_stride[p] = band.scratch->linesize[p];
+        }
+        else if (out_frame->data[p])
+        {
+            int shift = (p == 1 || p == 2) ? dst_desc->log2_chroma_h : 0;
+            dst[p] = out_frame->data[p] + (ptrdiff_t)out_frame->linesize[p] * (band.y >> shift);
+            dst_stride[p] = out_frame->linesize[p];
+        }
+    }
+
+    if (sws_scale(band.ctx, src, in_frame->linesize, 0, src_rows, dst, dst_stride) <= 0)
+        return false;
+
+    if (band.scratch)
+    {
+        int bytewidth[4];
+        av_image_fill_linesizes(bytewidth, (AVPixelFormat)out_frame->format, width);
+        for (int p = 0; p < 4 && out_frame->data[p]; p++)
+        {
+            int shift = (p == 1 || p == 2) ? dst_desc->log2_chroma_h : 0;
+            av_image_copy_plane(
+                out_frame->data[p] + (ptrdiff_t)out_frame->linesize[p] * (band.y >> shift),
+                out_frame->linesize[p],
+                band.scratch->data[p] + (ptrdiff_t)band.scratch->linesize[p] * (band.pad_top >> shift),
+                band.scratch->linesize[p], bytewidth[p], band.rows >> shift);
+        }
+    }
+    return true;
+}
+
+
+// JSON has no infinity, so identical pictures are reported as 100 dB.
+static double psnr(double mse, int max_value)
+{
+    if (mse <= 0)
+        return 100;
+    return std::min(100.0, 10 * log10((double)max_value * max_value / mse));
+}
+
+
+// Waits for the analysis of every encoded output, logs a summary and writes the per-frame
+// and overall numbers to the -analyze file.  Overall PSNR comes from the mean squared error
+// of the whole encode, and "all" weights the components by their sample counts.
+bool CFHD_Transcoder::write_analysis(CliOptions *cliopt)
+{
+    FILE *file = fopen(cliopt->analyze, "w");
+    if (! file)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "Failed to open '%s': %s\n", cliopt->analyze,
+               strerror(errno));
+        return false;
+    }
+
+    bool b_ok = true;
+    bool b_first = true;
+    fprintf(file, "{\n  \"input\": ");
+    write_json_string(file, cliopt->input);
+    fprintf(file, ",\n  \"outputs\": [");
+    for (CFHD_Output *out : outputs)
+    {
+        CFHD_Analyzer *analyzer = out->analyzer;
+        if (! analyzer)
+            continue;
+        if (! analyzer->finish())
+        {
+            b_ok = false;
+            continue;
+        }
+
+        const char *names = analyzer->is_rgb() ? "rgb" : "yuv";
+        // 4:2:2 chroma has half as many samples as luma
+        double weight[3] = { 1.0 / 3, 1.0 / 3, 1.0 / 3 };
+        if (! analyzer->is_rgb())
+        {
+            weight[0] = 0.5;
+            weight[1] = weight[2] = 0.25;
+        }
+        double mse[4] = { 0, 0, 0, 0 }, ssim[4] = { 0, 0, 0, 0 };
+        double min_psnr = 100, min_ssim = 1;
+        size_t frames = analyzer->results.size();
+
+        fprintf(file, "%s\n    {\n      \"path\": ", b_first ? "" : ",");
+        write_json_string(file, out->path);
+        fprintf(file, ",\n      \"quality\": \"%s\",\n      \"format\": \"%s\",\n"
+                "      \"width\": %d,\n      \"height\": %d,\n      \"skipped\": %u,\n"
+                "      \"frames\": [",
+                out->quality.c_str(), analyzer->is_rgb() ? "rgb444" : "yuv422",
+                out->width, out->height, analyzer->skipped);
+        b_first = false;
+        for (size_t i = 0; i < frames; i++)
+        {
+            const CFHD_Analyzer::Result &r = analyzer->results[i];
+            double frame_mse = 0, frame_ssim = 0;
+            fprintf(file, "%s\n        { \"frame\": %u", i ? "," : "", r.frame_num);
+            for (int c = 0; c < 3; c++)
+            {
+                frame_mse += weight[c] * r.mse[c];
+                frame_ssim += weight[c] * r.ssim[c];
+                mse[c] += r.mse[c];
+                ssim[c] += r.ssim[c];
+                fprintf(file, ", \"psnr_%c\": %.4f, \"ssim_%c\": %.6f",
+                        names[c], psnr(r.mse[c], analyzer->max_value), names[c], r.ssim[c]);
+            }
+            mse[3] += frame_mse;
+            ssim[3] += frame_ssim;
+            min_psnr = std::min(min_psnr, psnr(frame_mse, analyzer->max_value));
+            min_ssim = std::min(min_ssim, frame_ssim);
+            fprintf(file, ", \"psnr\": %.4f, \"ssim\": %.6f }",
+                    psnr(frame_mse, analyzer->max_value), frame_ssim);
+        }
+        fprintf(file, "\n      ]");
+
+        for (int i = 0; i < 4 && frames > 0; i++)
+        {
+            mse[i] /= frames;
+            ssim[i] /= frames;
+        }
+        for (int m = 0; m < 2; m++)
+        {
+            double *values = m == 0 ? mse : ssim;
+            fprintf(file, ",\n      \"%s\": { ", m == 0 ? "psnr" : "ssim");
+            for (int c = 0; c < 3; c++)
+                fprintf(file, m == 0 ? "\"%c\": %.4f, " : "\"%c\": %.6f, ", names[c],
+                        m == 0 ? psnr(values[c], analyzer->max_value) : values[c]);
+            if (m == 0)
+                fprintf(file, "\"all\": %.4f, \"min\": %.4f }",
+                        psnr(mse[3], analyzer->max_value), min_psnr);
+            else
+                fprintf(file, "\"all\": %.6f, \"min\": %.6f }", ssim[3], min_ssim);
+        }
+        fprintf(file, "\n    }");
+
+        av_log(nullptr, AV_LOG_INFO,
+               "Analysis of '%s': PSNR %.2f dB (worst frame %.2f), SSIM %.4f (worst frame %.4f)\n",
+               out->path.c_str(), psnr(mse[3], analyzer->max_value), min_psnr, ssim[3], min_ssim);
+        if (analyzer->skipped)
+            av_log(nullptr, AV_LOG_INFO, "Analysis of '%s' skipped %u frames to keep up with "
+                   "the encode\n", out->path.c_str(), analyzer->skipped);
+    }
+    fprintf(file, "\n  ]\n}\n");
+
+    if (fclose(file) != 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "Failed to write '%s': %s\n", cliopt->analyze,
+               strerror(errno));
+        return false;
+    }
+    if (! b_ok)
+        av_log(nullptr, AV_LOG_ERROR, "Analysis failed; '%s' is incomplete\n", cliopt->analyze);
+    return b_ok;
+}
+
+
+// Conversion tasks jump ahead of other work in the pool (such as another job's conversion)
+// while conversion is the slowest stage of this transcode.  While the encoders are slower
+// and every queue is full, a picture converted sooner would only wait for a slot, so other
+// work goes first.
+CFHD_TaskPool::Priority CFHD_Transcoder::convert_priority()
+{
+    int64_t convert = stage_us[STAGE_CONVERT];
+    if (convert >= std::max(std::max(stage_us[STAGE_DEMUX], stage_us[STAGE_DECODE]),
+                            stage_us[STAGE_ENCODE]))
+        return CFHD_TaskPool::PRIORITY_HIGH;
+
+    bool b_backlog = stage_us[STAGE_ENCODE] > convert;
+    for (CFHD_Output *out : outputs)
+        if (out->cfhd && out->cfhd->queued < out->cfhd->queue_size)
+            b_backlog = false;
+    return b_backlog ? CFHD_TaskPool::PRIORITY_LOW : CFHD_TaskPool::PRIORITY_NORMAL;
+}
+
+
+bool CFHD_Transcoder::scale_frame(Conversion &conv)
+{
+    CFHD_TaskPool::Group group;
+    std::atomic<bool> b_ok(true);
+    CFHD_TaskPool::Priority priority = convert_priority();
+
+    auto band = [this, &conv, &b_ok](size_t i)
+    {
+        int64_t start = now_us();
+        if (! scale_band(conv, conv.bands[i]))
+            b_ok = false;
+        if (trace)
+            trace->span("convert band", start, frame_count + 1);
+    };
+
+    // the calling thread converts the first band itself
+    for (size_t i = 1; i < conv.bands.size(); i++)
+        taskpool->submit(&group, priority, [&band, i] { band(i); });
+    band(0);
+    if (taskpool)
+        taskpool->wait(&group);
+
+    if (! b_ok)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "scale_frame: sws_scale failed\n");
+        return false;
+    }
+    return true;
+}
+
+
+// Shrinks the full size picture into conv.frame, in bands of rows on the task pool.
+bool CFHD_Transcoder::downscale(Conversion &conv)
+{
+    CFHD_TaskPool::Group group;
+    CFHD_TaskPool::Priority priority = convert_priority();
+    const AVFrame *src = conversions[conv.source].picture;
+    int count = 1;
+
+    if (taskpool)
+        count = std::max(1, std::min(taskpool->size() + 1, conv.height / 32));
+    int rows = (conv.height + count - 1) / count;
+
+    auto band = [this, &conv, src, rows](int y)
+    {
+        int64_t start = now_us();
+        box_down(src, conv.frame, conv.scale, y, std::min(y + rows, conv.height));
+        if (trace)
+            trace->span("downscale band", start, frame_count + 1);
+    };
+
+    // the calling thread shrinks the first band itself
+    for (int y = rows; y < conv.height; y += rows)
+        taskpool->submit(&group, priority, [&band, y] { band(y); });
+    band(0);
+    if (taskpool)
+        taskpool->wait(&group);
+    return true;
+}
+
+
+// Adds the time since start to a stage, and credits the stage with any rise in peak memory.
+void CFHD_Transcoder::end_stage(Stage stage, int64_t start)
+{
+    static const char *names[STAGE_COUNT] = { "demux", "decode", "convert", "encode" };
+
+    stage_us[stage] += now_us() - start;
+    count_peak(&stage_rss[stage]);
+    if (trace)
+        trace->span(names[stage], start);
+}
+
+
+void CFHD_Transcoder::count_peak(int64_t *rss)
+{
+    int64_t peak = peak_resident_bytes();
+    if (peak > peak_rss)
+    {
+        *rss += peak - peak_rss;
+        peak_rss = peak;
+    }
+}
+
+
+static long long megabytes(int64_t bytes)
+{
+    return (long long)((bytes + (1 << 19)) >> 20);
+}
+
+
+void CFHD_Transcoder::log_stage_times()
+{
+    av_log(nullptr, AV_LOG_DEBUG,
+           "Stage times: demux %1.2fs, decode %1.2fs, convert %1.2fs, encode %1.2fs\n",
+           (float)stage_us[STAGE_DEMUX] / 1000000, (float)stage_us[STAGE_DECODE] / 1000000,
+           (float)stage_us[STAGE_CONVERT] / 1000000, (float)stage_us[STAGE_ENCODE] / 1000000);
+    av_log(nullptr, b_low_memory ? AV_LOG_INFO : AV_LOG_DEBUG,
+           "Peak memory: %lld MB (%lld MB before this job, open +%lld, encoder pools +%lld, "
+           "demux +%lld, decode +%lld, convert +%lld, encode +%lld)\n",
+           megabytes(peak_rss), megabytes(start_rss), megabytes(open_rss), megabytes(pool_rss),
+           megabytes(stage_rss[STAGE_DEMUX]), megabytes(stage_rss[STAGE_DECODE]),
+           megabytes(stage_rss[STAGE_CONVERT]), megabytes(stage_rss[STAGE_ENCODE]));
+}
+
+
+bool CFHD_Transcoder::transcode_packet()
+{
+    int ret;
+
+    int64_t start = now_us();
+    ret = avcodec_send_packet(dec_ctx, in_pkt);
+    end_stage(STAGE_DECODE, start);
+    if (ret < 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR,
+               "transcode_packet: avcodec_send_packet failed:\n%s\n", av_err2str(ret));
+        return false;
+    }
+    while (1)
+    {
+        int64_t start = now_us();
+        ret = avcodec_receive_frame(dec_ctx, in_frame);
+        end_stage(STAGE_DECODE, start);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            return true;
+        else if (ret < 0)
+        {
+            av_log(nullptr, AV_LOG_ERROR,
+                   "transcode_packet: avcodec_receive_frame failed:\n%s\n", av_err2str(ret));
+            return false;
+        }
+        if (! transcode_frame())
+            return false;
+    }
+}
+
+
+// Converts the decoded in_frame and sends it to the encoder.
+bool CFHD_Transcoder::transcode_frame()
+{
+    // frames the resumed output already has
+    if (resume_pts != AV_NOPTS_VALUE && in_frame->pts != AV_NOPTS_VALUE &&
+        in_frame->pts <= resume_pts)
+    {
+        av_frame_unref(in_frame);
+        return true;
+    }
+
+    int64_t start = now_us();
+    for (Conversion &conv : conversions)
+        if (! convert(conv))
+            return false;
+    end_stage(STAGE_CONVERT, start);
+
+    if (! encode_frame(in_frame->pts, in_frame->pkt_duration))
+        return false;
+    av_frame_unref(in_frame);
+    return true;
+}
+
+
+// Sends the current picture of each output's conversion to the output's encoder.
+bool CFHD_Transcoder::encode_frame(int64_t pts, int64_t duration)
+{
+    int64_t start = now_us();
+
+    if (realtime_us > 0 && ! live_stamp(&pts, &duration))
+        return false;
+    frame_count++;
+    for (CFHD_Output *out : outputs)
+    {
+        if (out->b_copy)
+            continue;
+        Conversion &conv = conversions[out->conversion];
+        if (! push_frame(out, conv.buf, conv.data, conv.pitch, pts, duration))
+            return false;
+    }
+    end_stage(STAGE_ENCODE, start);
+    return true;
+}
+
+
+// Takes the 128-bit MurmurHash3 of an encoder input picture, row by row so the padding
+// at the end of each row is left out.  A hash is all that is kept of the last picture, so
+// dedup holds on to no picture buffer; two different pictures hashing alike is a 1 in
+// 2^128 chance.
+static void picture_hash(const CFHD_Encoder *cfhd, AVMurMur3 *murmur, const uint8_t *data,
+                         int pitch, uint8_t hash[16])
+{
+    size_t row = (size_t)cfhd->width * 2;
+    if (cfhd->pix_fmt == CFHD_PIXEL_FORMAT_RG48)
+        row = (size_t)cfhd->width * 6;
+    else if (cfhd->pix_fmt == CFHD_PIXEL_FORMAT_V210)
+        row = (size_t)(cfhd->width + 5) / 6 * 16;
+
+    av_murmur3_init(murmur);
+    for (int y = 0; y < cfhd->height; y++)
+        av_murmur3_update(murmur, data + (ptrdiff_t)pitch * y, (int)row);
+    av_murmur3_final(murmur, hash);
+}
+
+
+// Hands frame_count's picture to an output's encoder and writes whatever sample comes back.
+// A cropped output hands over its region of the picture, which stays in place; the encoder
+// reads it through the picture's pitch.  A picture identical to the last one reuses its
+// sample instead.  When rate control has picked a new quality, the samples already queued
+// are written first, at the quality they were encoded at, and the encoder is restarted at
+// the new quality; so every switch drains the whole pipeline once.
+bool CFHD_Transcoder::push_frame(CFHD_Output *out, AVBufferRef *buf, uint8_t *data, int pitch,
+                                 int64_t pts, int64_t duration)
+{
+    CFHD_Encoder *cfhd = out->cfhd;
+
+    if (out->cropped())
+        data += out->crop_offset(cfhd->pix_fmt, pitch);
+    // -realtime's collector takes samples from the same encoder
+    std::lock_guard<std::mutex> lock(live_mutex);
+    if (b_live_failed)
+        return false;
+    // -realtime: the pool is full and has been busy with its oldest frame for longer than
+    // the bound, so this frame would only be later
+    if (realtime_us > 0 && cfhd->queued >= cfhd->queue_size &&
+        now_us() - cfhd->oldest_submit() > realtime_us)
+    {
+        out->late++;
+        if (! (b_late_repeat && out->b_encoded))
+            return true;
+        return repeat_frame(out, pts, duration);
+    }
+    if (b_dedup)
+    {
+        uint8_t hash[16];
+        if (! out->murmur && ! (out->murmur = av_murmur3_alloc()))
+        {
+            av_log(nullptr, AV_LOG_ERROR, "push_frame: av_murmur3_alloc failed\n");
+            return false;
+        }
+        picture_hash(cfhd, out->murmur, data, pitch, hash);
+        if (out->b_encoded && memcmp(hash, out->last_hash, sizeof(hash)) == 0)
+        {
+            out->reused++;
+            return repeat_frame(out, pts, duration);
+        }
+        memcpy(out->last_hash, hash, sizeof(hash));
+    }
+    out->b_encoded = true;
+    out->run_source = frame_count;
+
+    if (out->rate && out->rate->quality() != cfhd->quality)
+    {
+        while (cfhd->queued)
+            if (! (cfhd->pop() && write_cfhd_sample(out)))
+                return false;
+        if (! cfhd->restart(out->rate->quality()))
+            return false;
+        av_log(nullptr, AV_LOG_DEBUG, "'%s': quality %s from frame %u\n",
+               out->path.c_str(), out->rate->name(), frame_count);
+    }
+    int64_t start = now_us();
+    if (! cfhd->push(buf, data, pitch, frame_count, pts, duration))
+        return false;
+    if (trace)
+        trace->span("submit", start, frame_count);
+    if (! write_cfhd_sample(out))
+        return false;
+    // samples go to the muxer as they are done, not when the pool needs the room, which
+    // also keeps their turnaround in the trace to the frame interval
+    bool b_taken = true;
+    while (b_taken)
+        if (! (cfhd->poll(&b_taken) && write_cfhd_sample(out)))
+            return false;
+    return true;
+}
+
+
+// Writes the last frame encoded for an output again as frame_count, once its sample is back.
+bool CFHD_Transcoder::repeat_frame(CFHD_Output *out, int64_t pts, int64_t duration)
+{
+    if (out->held_frame == out->run_source)
+        return write_video(out, out->held.data(), out->held.size(), out->held_quality,
+                           frame_count, pts, duration);
+    CFHD_Output::Repeat repeat = { out->run_source, frame_count, pts, duration };
+    out->repeats.push_back(repeat);
+    return true;
+}
+
+
+// -realtime.  A live encode runs one frame per encoding thread, so no frame waits in the
+// queue for a thread to come free, and takes each sample as soon as it is done (see
+// collect_live).  Frames are stamped on the input's frame grid by when they reach the
+// encoders rather than by the timestamps they came with, which a capture pipe may not have.
+void CFHD_Transcoder::start_live()
+{
+    live_rate = input->r_frame_rate;
+    if (live_rate.num <= 0 || live_rate.den <= 0)
+        live_rate = input->avg_frame_rate;
+    if (live_rate.num <= 0 || live_rate.den <= 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "-realtime needs the input frame rate; give it with -r.\n");
+        throw 2;
+    }
+    for (CFHD_Output *out : outputs)
+        if (out->cfhd)
+            out->cfhd->limit_queue(out->cfhd->threads);
+    live_latency.assign(10001, 0);
+    av_log(nullptr, AV_LOG_INFO, "Realtime: %lld ms latency bound, %s late frames\n",
+           (long long)(realtime_us / 1000), b_late_repeat ? "repeating" : "dropping");
+}
+
+
+// -realtime.  Samples are otherwise taken only when the next frame goes in, so while the
+// input stalls (the main thread waiting in the demuxer) they would sit in the pools.  This
+// thread polls the pools every millisecond instead, under live_mutex; blocking in
+// CFHD_WaitForSample would leave the SDK called from two threads at once.
+void CFHD_Transcoder::collect_live()
+{
+    std::unique_lock<std::mutex> lock(live_mutex);
+    while (! live_cv.wait_for(lock, std::chrono::milliseconds(1), [this] { return b_live_stop; }))
+        for (CFHD_Output *out : outputs)
+        {
+            bool b_taken = out->cfhd != nullptr;
+            while (b_taken)
+                if (! (out->cfhd->poll(&b_taken) && write_cfhd_sample(out)))
+                {
+                    // the next frame's push_frame fails the encode
+                    b_live_failed = true;
+                    return;
+                }
+        }
+}
+
+
+void CFHD_Transcoder::stop_live()
+{
+    if (! live_collector.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(live_mutex);
+        b_live_stop = true;
+        live_cv.notify_all();
+    }
+    live_collector.join();
+}
+
+
+// Stamps the frame about to be encoded with the wall clock slot it arrived in.  Frames that
+// come in a burst take the next free slots.  With -late repeat, slots the input skipped (a
+// stall) are filled with repeats of the last frame, so the output keeps its frame rate.
+bool CFHD_Transcoder::live_stamp(int64_t *pts, int64_t *duration)
+{
+    std::lock_guard<std::mutex> lock(live_mutex);
+    int64_t now = now_us();
+    if (live_start == AV_NOPTS_VALUE)
+        live_start = now;
+    int64_t slot = av_rescale_rnd(now - live_start, live_rate.num,
+                                  (int64_t)live_rate.den * 1000000, AV_ROUND_NEAR_INF);
+    slot = std::max(slot, live_slot + 1);
+
+    AVRational frame = av_inv_q(live_rate);
+    for (int64_t gap = live_slot + 1; b_late_repeat && gap < slot; gap++)
+    {
+        int64_t gap_pts = av_rescale_q(gap, frame, input->time_base);
+        int64_t gap_duration = av_rescale_q(gap + 1, frame, input->time_base) - gap_pts;
+        frame_count++;
+        for (CFHD_Output *out : outputs)
+        {
+            if (! (out->cfhd && out->b_encoded))
+                continue;
+            out->filled++;
+            if (! repeat_frame(out, gap_pts, gap_duration))
+                return false;
+        }
+    }
+    live_slot = slot;
+    *pts = av_rescale_q(slot, frame, input->time_base);
+    *duration = av_rescale_q(slot + 1, frame, input->time_base) - *pts;
+    return true;
+}
+
+
+void CFHD_Transcoder::log_latency()
+{
+    uint64_t count = 0;
+    for (uint32_t n : live_latency)
+        count += n;
+    if (count == 0)
+        return;
+
+    // the smallest latency (in ms) that q of the frames are within
+    auto within = [this, count](double q)
+    {
+        uint64_t seen = 0;
+        size_t ms = 0;
+        for (; ms < live_latency.size() - 1; ms++)
+            if ((seen += live_latency[ms]) >= q * count)
+                break;
+        return (int)ms;
+    };
+    int max = (int)live_latency.size() - 1;
+    while (max > 0 && live_latency[max] == 0)
+        max--;
+    av_log(nullptr, AV_LOG_INFO, "Realtime latency over %llu frames: median %d ms, p95 %d ms, "
+           "p99 %d ms, max %d%s ms\n", (unsigned long long)count, within(0.5), within(0.95),
+           within(0.99), max, max == (int)live_latency.size() - 1 ? "+" : "");
+    for (CFHD_Output *out : outputs)
+        if (out->late > 0 || out->filled > 0)
+            av_log(nullptr, AV_LOG_INFO, "'%s': %u late frames %s, %u repeats for input gaps\n",
+                   out->path.c_str(), out->late, b_late_repeat ? "repeated" : "dropped",
+                   out->filled);
+}
+
+
+// Works out the video's bit budget for -target_bitrate or -target_size and starts the
+// encoder at the highest quality allowed.  A size budget is spread over the input's
+// duration, less what the copied streams and the container will take.
+void CFHD_Transcoder::start_rate_control(CFHD_Output *out, CliOptions *cliopt)
+{
+    double fps = av_q2d(input->r_frame_rate);
+    double bitrate = out->target_bitrate * 1e6;
+
+    if (fps <= 0)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "A target bitrate or size needs a known frame rate.\n");
+        throw 4;
+    }
+    if (out->target_size > 0)
+    {
+        double seconds = 0;
+        if (ifmt_ctx->duration > 0)
+            seconds = (double)ifmt_ctx->duration / AV_TIME_BASE;
+        else if (input->nb_frames > 0)
+            seconds = input->nb_frames / fps;
+        if (seconds <= 0)
+        {
+            av_log(nullptr, AV_LOG_ERROR, "A target size needs an input of known duration.\n");
+            throw 4;
+        }
+        double bits = out->target_size * 8e6;
+        // allow for the muxer's index and headers
+        bits *= 0.995;
+        if (! out->b_video_only)
+            for (unsigned i = 0; i < ifmt_ctx->nb_streams; i++)
+                if (ifmt_ctx->streams[i] != input)
+                    bits -= (double)ifmt_ctx->streams[i]->codecpar->bit_rate * seconds;
+        if (bits <= 0)
+        {
+            av_log(nullptr, AV_LOG_ERROR, "The other streams alone fill %.0f MB.\n",
+                   out->target_size);
+            throw 4;
+        }
+        if (bitrate <= 0 || bits / seconds < bitrate)
+            bitrate = bits / seconds;
+    }
+
+    // -q is the ceiling, or Film Scan 3 when it is not given
+    CFHD_EncodingQuality ceiling = cliopt->b_quality_set ? out->cfhd->quality
+                                                         : CFHD_ENCODING_QUALITY_FILMSCAN3;
+    out->rate = new CFHD_RateControl(bitrate, fps, ceiling);
+    // a resumed encode carries on with the level and budget where the checkpoint left them
+    if (out == outputs[0])
+        for (const std::pair<std::string, int64_t> &state : resume_rate)
+            out->rate->restore(state.first, state.second);
+    if (out->rate->quality() != out->cfhd->quality && ! out->cfhd->restart(out->rate->quality()))
+        throw 4;
+    av_log(nullptr, AV_LOG_INFO, "Video budget for '%s': %.2f Mb/s\n",
+           out->path.c_str(), bitrate / 1e6);
+}
+
+
+// Returns the SDK decoder conversion for an encoder input format and size.
+int CFHD_Transcoder::add_decoder(CFHD_PixelFormat decode_fmt, int scale)
+{
+    CFHD_Error err;
+
+    for (size_t i = 0; i < conversions.size(); i++)
+        if (conversions[i].decode_fmt == decode_fmt && conversions[i].scale == scale)
+            return (int)i;
+
+    conversions.push_back(Conversion());
+    Conversion &conv = conversions.back();
+    conv.pix_fmt = AV_PIX_FMT_NONE;
+    conv.scale = scale;
+    conv.width = scale > 1 ? (width / scale) & ~1 : width;
+    conv.height = scale > 1 ? (height / scale) & ~1 : height;
+    conv.source = -1;
+    conv.pool = nullptr;
+    conv.picture = nullptr;
+    conv.frame = av_frame_alloc();
+    conv.decoder = nullptr;
+    conv.decode_fmt = decode_fmt;
+    conv.v210_ctx = nullptr;
+    conv.v210_pkt = nullptr;
+    conv.buf = nullptr;
+    conv.data = nullptr;
+    conv.pitch = 0;
+    if (! conv.frame)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "add_decoder: frame allocation failed\n");
+        return -1;
+    }
+    if ((err = CFHD_OpenDecoder(&conv.decoder, nullptr)))
+    {
+        av_log(nullptr, AV_LOG_ERROR,
+               "add_decoder: OpenDecoder failed with error code: %d\n", err);
+        return -1;
+    }
+    return (int)(conversions.size() - 1);
+}
+
+
+// Decodes a Cineform sample into a fresh picture.  Half and quarter size pictures come
+// from the lower bands of the wavelet, so the finer bands are never decoded.
+bool CFHD_Transcoder::decode_sample(Conversion &conv, AVPacket *pkt)
+{
+    CFHD_Error err;
+
+    // the decoder is set up from the first sample
+    if (! conv.pool)
+    {
+        int actual_width, actual_height;
+        CFHD_PixelFormat actual_fmt;
+        CFHD_DecodedResolution resolution = CFHD_DECODED_RESOLUTION_FULL;
+        if (conv.scale == 2) resolution = CFHD_DECODED_RESOLUTION_HALF;
+        else if (conv.scale == 4) resolution = CFHD_DECODED_RESOLUTION_QUARTER;
+
+        err = CFHD_PrepareToDecode(conv.decoder, conv.width, conv.height, conv.decode_fmt,
+                                   resolution, CFHD_DECODING_FLAGS_NONE, pkt->data, pkt->size,
+                                   &actual_width, &actual_height, &actual_fmt);
+        if (err)
+        {
+            av_log(nullptr, AV_LOG_ERROR,
+                   "decode_sample: PrepareToDecode failed with error code: %d\n", err);
+            return false;
+        }
+        if (actual_width != conv.width || actual_height != conv.height ||
+            actual_fmt != conv.decode_fmt)
+        {
+            av_log(nullptr, AV_LOG_ERROR,
+                   "decode_sample: the decoder gives %dx%d for a %dx%d output.  "
+                   "Try -decoder ffmpeg.\n", actual_width, actual_height, conv.width, conv.height);
+            return false;
+        }
+        // v210 packs 6 pixels in 16 bytes, and rows are padded to 128 bytes
+        if (conv.decode_fmt == CFHD_PIXEL_FORMAT_V210)
+            conv.pitch = (conv.width + 47) / 48 * 128;
+        else if (conv.decode_fmt == CFHD_PIXEL_FORMAT_RG48)
+            conv.pitch = conv.width * 6;
+        else
+            conv.pitch = conv.width * 2;
+        if (! (conv.pool = av_buffer_pool_init(conv.pitch * conv.height, nullptr)))
+        {
+            av_log(nullptr, AV_LOG_ERROR, "decode_sample: av_buffer_pool_init failed\n");
+            return false;
+        }
+    }
+
+    av_frame_unref(conv.frame);
+    if (! (conv.frame->buf[0] = av_buffer_pool_get(conv.pool)))
+    {
+        av_log(nullptr, AV_LOG_ERROR, "decode_sample: av_buffer_pool_get failed\n");
+        return false;
+    }
+    conv.buf = conv.frame->buf[0];
+    conv.data = conv.buf->data;
+    if ((err = CFHD_DecodeSample(conv.decoder, pkt->data, pkt->size, conv.data, conv.pitch)))
+    {
+        av_log(nullptr, AV_LOG_ERROR,
+               "decode_sample: DecodeSample failed with error code: %d\n", err);
+        return false;
+    }
+    return true;
+}
+
+
+// Cineform input decoded by the SDK.  Each sample is decoded once for every format and size
+// the outputs need, in parallel on the task pool.
+bool CFHD_Transcoder::decode_cfhd()
+{
+    int ret;
+
+    av_log(nullptr, AV_LOG_DEBUG,
+           "Decoding Cineform with the SDK then sending to the cfhd encoder.\n");
+    while (1)
+    {
+        int64_t start = now_us();
+        ret = av_read_frame(ifmt_ctx, in_pkt);
+        end_stage(STAGE_DEMUX, start);
+        if (ret < 0)
+            break;
+        if (ifmt_ctx->streams[in_pkt->stream_index] == input)
+        {
+            // frames the resumed output already has
+            if (resume_pts != AV_NOPTS_VALUE && in_pkt->pts != AV_NOPTS_VALUE &&
+                in_pkt->pts <= resume_pts)
+            {
+                av_packet_unref(in_pkt);
+                continue;
+            }
+            if (! copy_video(in_pkt))
+                return false;
+
+            CFHD_TaskPool::Group group;
+            std::atomic<bool> b_ok(true);
+            start = now_us();
+            for (size_t i = 1; i < conversions.size(); i++)
+                taskpool->submit(&group, CFHD_TaskPool::PRIORITY_HIGH, [this, i, &b_ok]
+                {
+                    int64_t start = now_us();
+                    if (! decode_sample(conversions[i], in_pkt))
+                        b_ok = false;
+                    if (trace)
+                        trace->span("decode sample", start, frame_count + 1);
+                });
+            if (! decode_sample(conversions[0], in_pkt))
+                b_ok = false;
+            taskpool->wait(&group);
+            end_stage(STAGE_DECODE, start);
+
+            if (! (b_ok && encode_frame(in_pkt->pts, in_pkt->duration)))
+                return false;
+        }
+        // remux other streams
+        else if (! copy_packet(in_pkt))
+            return false;
+        av_packet_unref(in_pkt);
+    }
+    return true;
+}
+
+
+// Copies a packet of a stream other than the video to every output that carries it.
+bool CFHD_Transcoder::copy_packet(AVPacket *pkt)
+{
+    int ret;
+    AVStream *ist = ifmt_ctx->streams[pkt->stream_index];
+
+    for (CFHD_Output *out : outputs)
+    {
+        if (out->b_video_only || skip_resumed(pkt))
+            continue;
+        if (out->audio[pkt->stream_index])
+        {
+            if (! out->audio[pkt->stream_index]->write(pkt))
+                return false;
+            continue;
+        }
+        // each muxer gets its own reference, in its own time base
+        if ((ret = av_packet_ref(copy_pkt, pkt)) < 0)
+        {
+            av_log(nullptr, AV_LOG_ERROR, "copy_packet: av_packet_ref failed:\n%s\n",
+                   av_err2str(ret));
+            return false;
+        }
+        av_packet_rescale_ts(copy_pkt, ist->time_base,
+                             out->ofmt_ctx->streams[pkt->stream_index]->time_base);
+        bool b_ok = out->muxer->write(copy_pkt);
+        av_packet_unref(copy_pkt);
+        if (! b_ok)
+            return false;
+    }
+    return true;
+}
+
+
+// Video data requires decoding/scaling to feed the CFHD encoder.
+bool CFHD_Transcoder::transcode()
+{
+    int ret;
+
+    av_log(nullptr, AV_LOG_DEBUG, "Decoding/scaling video then sending to the cfhd encoder.\n");
+    while (1)
+    {
+        int64_t start = now_us();
+        ret = av_read_frame(ifmt_ctx, in_pkt);
+        end_stage(STAGE_DEMUX, start);
+        if (ret < 0)
+            break;
+        // if this is the video stream...
+        if (ifmt_ctx->streams[in_pkt->stream_index] == input)
+        {
+            if (! (copy_video(in_pkt) && transcode_packet()))
+               return false;
+        }
+        // else remux other streams
+        else if (! copy_packet(in_pkt))
+            return false;
+        av_packet_unref(in_pkt);
+    }
+    // flush the decoder
+    av_packet_free(&in_pkt);
+    if (! transcode_packet())
+        return false;
+    return true;
+}
+
+
+// Low-memory mode.  Each frame in flight is a picture for every output, so -max_memory
+// decides how many frames the encoders may queue.  Besides the queues there are the decoded
+// frames (those read ahead, the one being converted), the pictures being made and the last
+// picture of each output, kept to spot repeats.  The Cineform SDK's own buffers come on top
+// and show in the peak memory report.
+void CFHD_Transcoder::limit_memory(CliOptions *cliopt)
+{
+    int64_t budget = (int64_t)cliopt->max_memory << 20;
+    int64_t pictures = 0;
+    int depth = INT_MAX;
+
+    for (CFHD_Output *out : outputs)
+        if (out->cfhd)
+        {
+            pictures += (int64_t)CFHD_Kernels::pitch(out->cfhd->pix_fmt, out->width) *
+                        out->height;
+            depth = std::min(depth, out->cfhd->queue_size);
+        }
+    if (pictures == 0)
+        return;
+    int64_t frame = av_image_get_buffer_size((AVPixelFormat)input->codecpar->format,
+                                             width, height, 1);
+    int frames = b_sequence || script ? read_ahead(cliopt) + 1 : 2;
+    int64_t fixed = std::max<int64_t>(frame, 0) * frames + pictures * 2;
+
+    if (budget - fixed < pictures)
+    {
+        depth = 1;
+        av_log(nullptr, AV_LOG_WARNING, "-max_memory %d is below the %lld MB that one frame in "
+               "flight takes; encoding one frame at a time\n", cliopt->max_memory,
+               megabytes(fixed + pictures));
+    }
+    else
+        depth = (int)std::min<int64_t>(depth, (budget - fixed) / pictures);
+    for (CFHD_Output *out : outputs)
+        if (out->cfhd)
+            out->cfhd->limit_queue(depth);
+    av_log(nullptr, AV_LOG_INFO, "Low-memory mode: %d frames queued for encoding, about "
+           "%lld MB of pictures in flight\n", depth, megabytes(fixed + pictures * depth));
+    for (CFHD_Output *out : outputs)
+        if (out->cfhd)
+            av_log(nullptr, AV_LOG_INFO, "Encoding threads for '%s': %d\n", out->path.c_str(),
+                   out->cfhd->threads);
+}
+
+
+// Decoded frames an image sequence or script reader keeps ready.  In low-memory mode each
+// one is a full frame waiting for an encoder slot, so two are plenty.
+int CFHD_Transcoder::read_ahead(CliOptions *cliopt)
+{
+    if (cliopt->prefetch > 0)
+        return cliopt->prefetch;
+    return b_low_memory ? 2 : taskpool->size() + 2;
+}
+
+
+// Image sequences are decoded several files at a time by CFHD_SequenceReader.
+bool CFHD_Transcoder::transcode_sequence(CliOptions *cliopt)
+{
+    int ret;
+    int depth = read_ahead(cliopt);
+    // a resumed run starts after the last committed file
+    int skip = resume_pts != AV_NOPTS_VALUE ? (int)resume_pts + 1 : 0;
+    CFHD_SequenceReader reader(cliopt->input, sequence_start, taskpool);
+    reader.trace = trace;
+
+    av_log(nullptr, AV_LOG_DEBUG, "Decoding image sequence then sending to the cfhd encoder.\n");
+    if (! reader.start(dec_ctx->codec, input->codecpar, skip, depth))
+        return false;
+    while (1)
+    {
+        int64_t start = now_us();
+        ret = reader.read(in_frame);
+        end_stage(STAGE_DECODE, start);
+        if (ret == AVERROR_EOF)
+            return true;
+        if (ret < 0 || ! transcode_frame())
+            return false;
+    }
+}
+
+
+// Vapoursynth renders -prefetch frames ahead on its own threads.
+bool CFHD_Transcoder::transcode_script(CliOptions *cliopt)
+{
+    int ret;
+    int depth = read_ahead(cliopt);
+    // a resumed run starts after the last committed frame
+    int skip = resume_pts != AV_NOPTS_VALUE ? (int)resume_pts + 1 : 0;
+
+    av_log(nullptr, AV_LOG_DEBUG, "Rendering script then sending to the cfhd encoder.\n");
+    if (! script->start(skip, depth))
+        return false;
+    while (1)
+    {
+        int64_t start = now_us();
+        ret = script->read(in_frame);
+        end_stage(STAGE_DECODE, start);
+        if (ret == AVERROR_EOF)
+            return true;
+        if (ret < 0 || ! transcode_frame())
+            return false;
+    }
+}
+
+
+// Pictures from a frame queue go to the encoders from the memory they arrived in.
+bool CFHD_Transcoder::encode_frames()
+{
+    CFHD_FrameQueue::Frame frame;
+
+    av_log(nullptr, AV_LOG_DEBUG, "Sending queued frames direct to the cfhd encoder.\n");
+    while (state->frames_in->pop(frame))
+    {
+        int64_t start = now_us();
+        int64_t pts = frame.pts, duration = 1;
+        bool b_ok = realtime_us == 0 || live_stamp(&pts, &duration);
+        frame_count++;
+        for (CFHD_Output *out : outputs)
+            b_ok = b_ok && push_frame(out, frame.buf, frame.data, frame.pitch, pts, duration);
+        av_buffer_unref(&frame.buf);
+        end_stage(STAGE_ENCODE, start);
+        if (! b_ok)
+            return false;
+    }
+    if (state->frames_in->b_abort)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "The frames for '%s' stopped before the end\n",
+               outputs[0]->path.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+// Video data is already in a format we can feed to the CFHD encoder without decoding/scaling,
+// or it is Cineform that every output copies.
+bool CFHD_Transcoder::encode()
+{
+    int ret;
+
+    av_log(nullptr, AV_LOG_DEBUG, "Sending video direct to the cfhd encoder or output.\n");
+    while (1)
+    {
+        int64_t start = now_us();
+        ret = av_read_frame(ifmt_ctx, in_pkt);
+        end_stage(STAGE_DEMUX, start);
+        if (ret < 0)
+            break;
+        // if this is the video stream...
+        if (ifmt_ctx->streams[in_pkt->stream_index] == input)
+        {
+            // frames the resumed output already has
+            if (resume_pts != AV_NOPTS_VALUE && in_pkt->pts != AV_NOPTS_VALUE &&
+                in_pkt->pts <= resume_pts)
+            {
+                av_packet_unref(in_pkt);
+                continue;
+            }
+            int pitch = in_pkt->buf->size / height;
+            int64_t pts = in_pkt->pts, duration = in_pkt->duration;
+            start = now_us();
+            if (realtime_us > 0 && ! live_stamp(&pts, &duration))
+                return false;
+            frame_count++;
+            if (! copy_video(in_pkt))
+                return false;
+            for (CFHD_Output *out : outputs)
+                if (! out->b_copy &&
+                    ! push_frame(out, in_pkt->buf, in_pkt->buf->data, pitch, pts, duration))
+                    return false;
+            end_stage(STAGE_ENCODE, start);
+        }
+        // remux other streams
+        else if (! copy_packet(in_pkt))
+            return false;
+        av_packet_unref(in_pkt);
+    }
+    return true;
+}
+
+
+void CFHD_Transcoder::process(CliOptions *cliopt)
+{
+    int ret;
+    const AVPixFmtDescriptor *input_desc;
+    bool input_is_8_bit = false;
+    bool input_is_rgb = false;
+
+    input_desc = av_pix_fmt_desc_get((AVPixelFormat)input->codecpar->format);
+    if (! input_desc)
+    {
+        av_log(nullptr, AV_LOG_ERROR, "process: the input has no known pixel format\n");
+        throw 2;
+    }
+    if (input_desc->comp[0].depth == 8)
+        input_is_8_bit = true;
+    if (input_desc->flags & AV_PIX_FMT_FLAG_RGB)
+        input_is_rgb = true;
+
+    // One budget covers every thread of the transcode: libavcodec's decoding threads, its
+    // share of the task pool, and the encoder pools, which split what is left between them
+    // by picture size.  A stage the input does not go through leaves its share to the
+    // encoders: there are no decoding threads for input sent direct or decoded by the SDK,
+    // and the pool only counts when something runs on it (conversion bands, the SDK decoding
+    // for more than one output, -analyze).  Proxies take the colorspace of the full size
+    // video, so their smaller width must not decide it.  Cineform only flags 601 or 709 YUV;
+    // 2020 is tagged in the container instead.
+    int budget = cliopt->threads > 0 ? cliopt->threads : default_threads();
+    int encoded = 0;
+    for (CFHD_Output *out : outputs)
+        encoded += ! out->b_copy;
+    // the paths below: frames handed over and direct input have no decoder and no script
+    bool b_converts = ! b_sdk_decode && (dec_ctx->codec_id != AV_CODEC_ID_NONE || script);
+    bool b_pool_work = cliopt->analyze != nullptr || (b_sdk_decode && encoded > 1) ||
+                       (b_converts && encoded > 0);
+    int pool_threads = b_pool_work ? taskpool->share(budget) : 0;
+    int threads = std::max(1, budget - decode_threads - pool_threads);
+    av_log(nullptr, AV_LOG_INFO, "Thread budget: %d (decoding %d, task pool %d, encoding %d)\n",
+           budget, decode_threads, pool_threads, threads);
+    int trc = colorspace == AVCOL_SPC_BT470BG || colorspace == AVCOL_SPC_SMPTE170M ? 601 : 709;
+    int64_t area = 0;
+    for (CFHD_Output *out : outputs)
+        if (! out->b_copy)
+            area += (int64_t)out->width * out->height;
+    count_peak(&open_rss);
+    for (CFHD_Output *out : outputs)
+    {
+        if (out->b_copy)
+            continue;
+        int share = (int)(threads * (int64_t)out->width * out->height / area);
+        out->cfhd = new CFHD_Encoder(out->width, out->height, input_is_8_bit, out->b_rgb,
+                                     out->quality, trc, std::max(1, share));
+    }
+    if (b_low_memory)
+        limit_memory(cliopt);
+    if (realtime_us > 0)
+        start_live();
+    for (CFHD_Output *out : outputs)
+    {
+        if (out->b_copy)
+            continue;
+        if (! (encoders && encoders->reuse(out->cfhd)) && ! out->cfhd->start())
+            throw 4;
+        out->cfhd->b_keep_pictures = cliopt->analyze != nullptr;
+        out->cfhd->b_wait = realtime_us > 0;
+        if (cliopt->analyze)
+            out->analyzer = new CFHD_Analyzer(taskpool, out->cfhd->pix_fmt, out->width,
+                                              out->height);
+        if (out->target_bitrate > 0 || out->target_size > 0)
+            start_rate_control(out, cliopt);
+    }
+    if (realtime_us > 0)
+        live_collector = std::thread(&CFHD_Transcoder::collect_live, this);
+    count_peak(&pool_rss);
+
+    // codec_id will be set to a codec if we need to decode; otherwise, it is set to NONE.
+    if (state && state->frames_in)
+    {
+        if (! encode_frames())
+            throw 4;
+    }
+    else if (b_sdk_decode)
+    {
+        for (CFHD_Output *out : outputs)
         {
-            CFHD_MetadataClose(metadata);
-            metadata = nullptr;
+            if (out->b_copy)
+                continue;
+            CFHD_PixelFormat decode_fmt = out->cfhd->pix_fmt;
+            if ((out->conversion = add_decoder(decode_fmt, out->scale)) < 0)
+                throw 4;
         }
-        if (pool)
+        if (! decode_cfhd())
+            throw 4;
+    }
+    else if (dec_ctx->codec_id == AV_CODEC_ID_NONE && ! script)
+    {
+        if (! encode())
+            throw 4;
+    }
+    else
+    {
+        in_frame = av_frame_alloc();
+        if (! in_frame)
         {
-            CFHD_ReleaseEncoderPool(pool);
-            pool = nullptr;
+            av_log(nullptr, AV_LOG_ERROR, "process: frame allocation failed\n");
+            throw 4;
         }
-    }
 
-    bool start();
-    bool push(uint8_t*, int, int, int64_t, int64_t);
-    bool pop();
+        // full size outputs first, so that proxies shrink the pictures they encode
+        std::vector<CFHD_Output*> ordered = outputs;
+        std::stable_sort(ordered.begin(), ordered.end(),
+                         [](CFHD_Output *a, CFHD_Output *b) { return a->scale < b->scale; });
+        for (CFHD_Output *out : ordered)
+        {
+            AVPixelFormat new_pix_fmt = AV_PIX_FMT_NONE;
+            bool b_v210 = false;
 
-private:
-    CFHD_EncodingQuality set_quality(std::string);
-};
+            if (out->b_copy)
+                continue;
+            if (out->b_rgb)
+                new_pix_fmt = AV_PIX_FMT_RGB48LE;
+            else if (input_is_8_bit)
+                new_pix_fmt = AV_PIX_FMT_YUYV422;
+            else
+            {
+                if ((AVPixelFormat)input->codecpar->format != AV_PIX_FMT_YUV422P10LE)
+                    new_pix_fmt = AV_PIX_FMT_YUV422P10LE;
+                b_v210 = true;
+            }
+            // test if we are converting YUV->RGB or RGB->YUV, set scaler flags accordingly
+            bool accurate = false;
+            if (input_is_rgb != out->b_rgb)
+                accurate = true;
+            out->conversion = add_conversion(new_pix_fmt, b_v210, accurate, out->scale);
+            if (out->conversion < 0)
+                throw 4;
+        }
+        count_peak(&stage_rss[STAGE_CONVERT]);
 
+        if (script)
+        {
+            if (! transcode_script(cliopt))
+                throw 4;
+        }
+        else if (b_sequence)
+        {
+            if (! transcode_sequence(cliopt))
+                throw 4;
+        }
+        else if (! transcode())
+            throw 4;
+    }
 
-CFHD_EncodingQuality CFHD_Encoder::set_quality(std::string quality)
-{
-    const char *c_quality;
-    CFHD_EncodingQuality cfhd_quality = CFHD_ENCODING_QUALITY_DEFAULT;
+    // flush the encoders
+    stop_live();
+    if (b_live_failed)
+        throw 4;
+    int64_t start = now_us();
+    for (CFHD_Output *out : outputs)
+        while (out->cfhd && out->cfhd->queued)
+            if (! (out->cfhd->pop() && write_cfhd_sample(out)))
+                throw 4;
+    end_stage(STAGE_ENCODE, start);
+    log_stage_times();
+    if (realtime_us > 0)
+        log_latency();
+    if (cliopt->analyze && ! write_analysis(cliopt))
+        throw 4;
 
-    if (quality == "low")
-    {
-        cfhd_quality = CFHD_ENCODING_QUALITY_LOW;
-        c_quality = "Low";
-    }
-    else if (quality == "medium")
-    {
-        cfhd_quality = CFHD_ENCODING_QUALITY_MEDIUM;
-        c_quality = "Medium";
-    }
-    else if (quality == "high")
+    av_log(nullptr, AV_LOG_INFO, "\n");
+    for (CFHD_Output *out : outputs)
     {
-        cfhd_quality = CFHD_ENCODING_QUALITY_HIGH;
-        c_quality = "High";
+        for (CFHD_AudioTranscoder *audio : out->audio)
+            if (audio && ! audio->finish())
+                throw 4;
+        if (! out->muxer->finish())
+            throw 4;
+        if ((ret = av_write_trailer(out->ofmt_ctx)) < 0)
+        {
+            av_log(nullptr, AV_LOG_ERROR,
+                   "process: av_write_trailer failed for '%s':\n%s\n", out->path.c_str(),
+                   av_err2str(ret));
+            throw 4;
+        }
+        if (out->pipe_writer && ! out->pipe_writer->close())
+            throw 4;
     }
-    else if (quality == "fs1")
+    // the output is complete, so there is nothing left to resume
+    if (checkpoint > 0)
     {
-        cfhd_quality = CFHD_ENCODING_QUALITY_FILMSCAN1;
-        c_quality = "Film Scan 1";
+        remove(checkpoint_path.c_str());
+        remove(partial_path.c_str());
     }
-    else if (quality == "fs2")
+    if (encoders)
+        for (CFHD_Output *out : outputs)
+        {
+            if (out->cfhd)
+                encoders->release(out->cfhd);
+            out->cfhd = nullptr;
+        }
+}
+
+
+// Runs one complete encode.  Throws the exit code on failure.
+static void run(CliOptions *cliopt, CFHD_TaskPool *taskpool, CFHD_EncoderCache *encoders = nullptr,
+                CFHD_JobState *state = nullptr)
+{
+    CFHD_Transcoder tc(cliopt, taskpool, encoders, state);
+    tc.open_input(cliopt);
+    tc.open_output(cliopt);
+    if (cliopt->b_resume)
+        tc.resume();
+
+    auto start = std::chrono::high_resolution_clock::now();
+    tc.process(cliopt);
+    auto stop = std::chrono::high_resolution_clock::now();
+
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - start);
+    float seconds = (float)duration.count() / 1000;
+    // frames kept from an interrupted run were not encoded this time
+    uint32_t frames = 0;
+    if (tc.frame_count > tc.resume_frames)
+        frames = tc.frame_count - tc.resume_frames;
+    float fps = (float)frames / seconds;
+    if (state)
     {
-        cfhd_quality = CFHD_ENCODING_QUALITY_FILMSCAN2;
-        c_quality = "Film Scan 2";
+        state->frames = frames;
+        state->seconds = seconds;
     }
-    else if (quality == "fs3")
+
+    for (CFHD_Output *out : tc.outputs)
     {
-        cfhd_quality = CFHD_ENCODING_QUALITY_FILMSCAN3;
-        c_quality = "Film Scan 3";
+        av_log(nullptr, AV_LOG_INFO, "%s %d frames of '%s' in %1.2f seconds (%1.2f fps)\n",
+               out->b_copy ? "Copied" : "Encoded", frames, out->path.c_str(), seconds, fps);
+        // encoding is the bottleneck, so a skipped frame saves about a frame's encode time
+        if (out->reused > 0 && frames > out->reused)
+            av_log(nullptr, AV_LOG_INFO,
+                   "Reused samples for %u repeated frames (%1.1f%%), saving about %1.2f seconds\n",
+                   out->reused, 100.0f * out->reused / frames,
+                   seconds * out->reused / (frames - out->reused));
+        if (out->rate)
+            av_log(nullptr, AV_LOG_INFO,
+                   "Video at %1.2f Mb/s for a %1.2f Mb/s budget, %d quality changes, ending at %s\n",
+                   out->rate->bitrate() / 1e6, out->rate->frame_bits * out->rate->fps / 1e6,
+                   out->rate->switches, out->rate->name());
     }
-    av_log(nullptr, AV_LOG_INFO, "\nCineform quality: %s\n", c_quality);
-    return cfhd_quality;
 }
 
 
-bool CFHD_Encoder::start()
+// Runs the jobs from a -jobs file or a -watch folder, several at a time, in one process.
+// All jobs draw their encoder threads from one shared budget so that many small jobs can
+// fill a big host without oversubscribing it, and pick up warm encoder pools from the jobs
+// before them.  The job of highest priority that has waited longest starts next.
+struct CFHD_JobScheduler
 {
-    CFHD_Error err = CFHD_ERROR_OKAY;
+    struct Job
+    {
+        // args owns the strings that argv and cliopt point into
+        std::vector<std::string> args;
+        std::vector<char*> argv;
+        CliOptions cliopt;
+        int line;
+        int priority;
+        int status;
+        int64_t queued_us;
+        int64_t started_us;
+        std::shared_ptr<CFHD_JobState> state;
+        // the job's own -trace file, which cliopt points into
+        std::string trace;
 
-    err = CFHD_MetadataOpen(&metadata);
-    if (err)
+        Job()
+        {
+            line = 0;
+            priority = 0;
+            status = 0;
+            queued_us = now_us();
+            started_us = 0;
+            state = std::make_shared<CFHD_JobState>();
+        }
+    };
+
+    std::deque<Job*> pending;
+    CFHD_TaskPool *taskpool;
+    CFHD_EncoderCache encoders;
+    // called on the worker thread as each job ends, before the job is deleted
+    std::function<void(Job*)> on_finished;
+    int parallel;
+    int total_threads;
+    int free_threads;
+    int idle_workers;
+    // jobs keep an even share of the budget, so that their pools match
+    bool b_fixed_share;
+    // no more jobs will be added
+    bool b_closed;
+    int running;
+    int finished;
+    int failed;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    CFHD_JobScheduler(CliOptions *cliopt, CFHD_TaskPool *taskpool)
+        : encoders(std::max(2, cliopt->parallel * 2))
     {
-        av_log(nullptr, AV_LOG_ERROR,
-               "CFHD_Encoder::start: MetadataOpen failed with error code: %d\n", err);
-        return false;
+        this->taskpool = taskpool;
+        parallel = cliopt->parallel;
+        if (cliopt->threads > 0) total_threads = cliopt->threads;
+        else total_threads = default_threads();
+        free_threads = total_threads;
+        idle_workers = 0;
+        b_fixed_share = false;
+        b_closed = false;
+        running = 0;
+        finished = 0;
+        failed = 0;
     }
-    err = CFHD_CreateEncoderPool(&pool, threads, queue_size, nullptr);
-    if (err)
+
+    ~CFHD_JobScheduler()
     {
-        av_log(nullptr, AV_LOG_ERROR,
-               "CFHD_Encoder::start: CreateEncoderPool failed with error code: %d\n", err);
-        return false;
+        close(true);
+        for (std::thread &t : workers)
+            if (t.joinable())
+                t.join();
+        for (Job *job : pending)
+            delete job;
     }
-    err = CFHD_AttachEncoderPoolMetadata(pool, metadata);
-    if (err)
+
+    void load(const char*);
+    bool run();
+    void start();
+    void add(Job*);
+    void close(bool);
+    void wait();
+    // the threads each job gets with b_fixed_share
+    int fixed_share() const { return std::max(1, total_threads / parallel); }
+
+private:
+    static bool split_args(const std::string&, std::vector<std::string>&);
+    void worker();
+    Job *take();
+    int acquire_threads();
+    void release_threads(int);
+};
+
+
+// Splits a job line into arguments.  Double quotes group words containing spaces.
+bool CFHD_JobScheduler::split_args(const std::string &line, std::vector<std::string> &args)
+{
+    std::string arg;
+    bool b_quoted = false;
+    bool b_in_arg = false;
+
+    for (char c : line)
     {
-        av_log(nullptr, AV_LOG_ERROR,
-               "CFHD_Encoder::start: AttachEncoderPoolMetadata failed with error code: %d\n", err);
-        return false;
+        if (c == '"')
+        {
+            b_quoted = ! b_quoted;
+            b_in_arg = true;
+        }
+        else if (isspace((unsigned char)c) && ! b_quoted)
+        {
+            if (b_in_arg)
+                args.push_back(arg);
+            arg.clear();
+            b_in_arg = false;
+        }
+        else
+        {
+            arg += c;
+            b_in_arg = true;
+        }
     }
-    int videochannels = 1;  //1 - 2D, 2 - 3D;
-    err = CFHD_MetadataAdd(metadata, TAG_VIDEO_CHANNELS, METADATATYPE_UINT32, 4,
-                           (uint32_t *)&videochannels, false);
-    if (err)
+    if (b_in_arg)
+        args.push_back(arg);
+    return ! b_quoted;
+}
+
+
+void CFHD_JobScheduler::load(const char *path)
+{
+    std::ifstream file(path);
+    std::string line;
+    int line_num = 0;
+
+    if (! file)
     {
-        av_log(nullptr, AV_LOG_ERROR,
-               "CFHD_Encoder::start: MetadataAdd failed with error code: %d\n", err);
-        return false;
+        av_log(nullptr, AV_LOG_ERROR, "Failed to open job list '%s'\n", path);
+        throw 1;
     }
-    err = CFHD_PrepareEncoderPool(pool, g_width, g_height, pix_fmt, enc_fmt, flags, quality);
-    if (err)
+
+    while (std::getline(file, line))
     {
-        av_log(nullptr, AV_LOG_ERROR,
-               "CFHD_Encoder::start: PrepareEncoderPool failed with error code: %d\n", err);
-        return false;
+        line_num++;
+        Job *job = new Job();
+        job->line = line_num;
+        job->args.push_back("cfenc");
+        if (! split_args(line, job->args))
+        {
+            av_log(nullptr, AV_LOG_ERROR, "%s:%d: unterminated quote\n", path, line_num);
+            delete job;
+            throw 1;
+        }
+        // skip blank lines and comments
+        if (job->args.size() == 1 || job->args[1][0] == '#')
+        {
+            delete job;
+            continue;
+        }
+        pending.push_back(job);
+
+        for (std::string &arg : job->args)
+            job->argv.push_back(&arg[0]);
+        job->argv.push_back(nullptr);
+
+        // getopt keeps its state in globals; optind = 0 makes it start over for each job
+        optind = 0;
+        job->cliopt.b_job = true;
+        try
+        {
+            job->cliopt.parse((int)job->args.size(), job->argv.data());
+        }
+        catch (int e)
+        {
+            av_log(nullptr, AV_LOG_ERROR, "%s:%d: invalid job\n", path, line_num);
+            throw;
+        }
+        if (job->cliopt.jobs)
+        {
+            av_log(nullptr, AV_LOG_ERROR, "%s:%d: jobs cannot be nested\n", path, line_num);
+            throw 1;
+        }
+        job->cliopt.b_progress = false;
     }
-    err = CFHD_AttachEncoderPoolMetadata(pool, metadata);
-    if (err)
+
+    if (pending.empty())
     {
-        av_log(nullptr, AV_LOG_ERROR,
-               "CFHD_Encoder::start: AttachEncoderPoolMetadata failed with error code: %d\n", err);
-        return false;
+        av_log(nullptr, AV_LOG_ERROR, "No jobs found in '%s'\n", path);
+        throw 1;
     }
-    err = CFHD_StartEncoderPool(pool);
-    if (err)
+}
+
+
+// Queues a job.  It is deleted once it has run.
+void CFHD_JobScheduler::add(Job *job)
+{
     {
-        av_log(nullptr, AV_LOG_ERROR,
-               "CFHD_Encoder::start: StartEncoderPool failed with error code: %d\n", err);
-        return false;
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(job);
     }
-    return true;
+    cv.notify_one();
 }
 
 
-bool CFHD_Encoder::push(uint8_t *data, int pitch, int frame_num, int64_t pts, int64_t duration)
+// Takes the pending job of highest priority, the earliest of those that tie.
+CFHD_JobScheduler::Job *CFHD_JobScheduler::take()
 {
-    CFHD_Error err = CFHD_ERROR_OKAY;
+    auto best = pending.begin();
+    for (auto i = pending.begin(); i != pending.end(); ++i)
+        if ((*i)->priority > (*best)->priority)
+            best = i;
+    Job *job = *best;
+    pending.erase(best);
+    return job;
+}
+
+
+// A starting job takes an even share of the threads that are free right now, split among
+// the jobs that can still start alongside it.  Threads return to the budget when a job ends,
+// so the last jobs in the list pick up the cores that earlier jobs leave behind.
+int CFHD_JobScheduler::acquire_threads()
+{
+    if (b_fixed_share)
+        return fixed_share();
+    size_t remaining = pending.size() + 1;
+    int share = free_threads / (int)std::min((size_t)idle_workers, remaining);
+    if (share < 1) share = 1;
+    free_threads -= share;
+    return share;
+}
+
+
+void CFHD_JobScheduler::release_threads(int threads)
+{
+    free_threads += threads;
+}
+
 
+void CFHD_JobScheduler::worker()
+{
     while (1)
     {
-        if (queued < queue_size)
+        Job *job;
+        // jobs that set their own thread count do not draw from the budget
+        int granted = 0;
         {
-            err = CFHD_MetadataAdd(metadata, TAG_UNIQUE_FRAMENUM, METADATATYPE_UINT32, 4,
-                                   (uint32_t *)&(frame_num), false);
-            if (err)
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return ! pending.empty() || b_closed; });
+            if (pending.empty())
+                return;
+            job = take();
+            job->started_us = now_us();
+            job->state->phase = CFHD_JobState::RUNNING;
+            if (job->cliopt.threads == 0)
             {
-                av_log(nullptr, AV_LOG_ERROR,
-                       "CFHD_Encoder::push: MetadataAdd failed with error code: %d\n", err);
-                return false;
+                granted = acquire_threads();
+                job->cliopt.threads = granted;
             }
+            idle_workers--;
+            running++;
+        }
 
-            int i = (frame_num - 1) % queue_size;
-            if (i == queue.size())
-                queue.push_back(CFHD_AVData(data, pitch, pts, duration));
-            else
-            {
-                memcpy(queue[i].data, data, (size_t)(pitch * g_height));
-                queue[i].pts = pts;
-                queue[i].duration = duration;
-            }
+        // jobs given the same -trace (as every -watch job is) would write over each other's,
+        // so each writes its own, numbered like its job: trace_3.json for job 3
+        if (job->cliopt.trace)
+        {
+            job->trace = numbered_path(job->cliopt.trace, job->line);
+            job->cliopt.trace = job->trace.c_str();
+        }
+        av_log(nullptr, AV_LOG_INFO, "Starting job %d: %s -> %s\n",
+               job->line, job->cliopt.input, job->cliopt.output);
+        try
+        {
+            // a job cancelled while it waited does not start
+            if (job->state->b_cancel)
+                throw 4;
+            ::run(&job->cliopt, taskpool, &encoders, job->state.get());
+        }
+        catch (int e)
+        {
+            if (! job->state->b_cancel)
+                av_log(nullptr, AV_LOG_ERROR, "Job %d failed (%s)\n", job->line,
+                       job->cliopt.input);
+            job->status = e;
+        }
+        job->state->exit_code = job->status;
+        if (job->state->frames_in)
+            job->state->frames_in->abort();
 
-            err = CFHD_EncodeAsyncSample(pool, frame_num, queue[i].data, pitch, metadata);
-            if (err)
-            {
-                av_log(nullptr, AV_LOG_ERROR,
-                       "CFHD_Encoder::push: EncodeAsyncSample failed with error code: %d\n", err);
-                return false;
-            }
-            queued++;
-            return true;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            idle_workers++;
+            release_threads(granted);
+            running--;
+            finished++;
+            if (job->status)
+                failed++;
         }
-        else if (! pop())
-            return false;
+        if (on_finished)
+            on_finished(job);
+        job->state->phase = job->state->b_cancel ? CFHD_JobState::CANCELLED :
+                            job->status ? CFHD_JobState::FAILED : CFHD_JobState::DONE;
+        delete job;
     }
 }
 
 
-bool CFHD_Encoder::pop()
+void CFHD_JobScheduler::start()
+{
+    idle_workers = parallel;
+    for (int i = 0; i < parallel; i++)
+        workers.push_back(std::thread(&CFHD_JobScheduler::worker, this));
+}
+
+
+// Lets the workers end once the pending jobs have run, or at once with b_cancel, in which
+// case jobs that have not started are dropped.
+void CFHD_JobScheduler::close(bool b_cancel)
+{
+    std::deque<Job*> dropped;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        b_closed = true;
+        if (b_cancel)
+            dropped.swap(pending);
+    }
+    cv.notify_all();
+    for (Job *job : dropped)
+    {
+        job->state->cancel();
+        job->state->phase = CFHD_JobState::CANCELLED;
+        delete job;
+    }
+}
+
+
+void CFHD_JobScheduler::wait()
+{
+    for (std::thread &t : workers)
+        t.join();
+    workers.clear();
+}
+
+
+bool CFHD_JobScheduler::run()
 {
-    CFHD_Error err = CFHD_ERROR_OKAY;
+    size_t jobs = pending.size();
 
-    if (CFHD_ERROR_OKAY == CFHD_TestForSample(pool, &sample.frame_num, &sample.buffer))
-    {
-        err = CFHD_GetEncodedSample(sample.buffer, (void **)&sample.data, &sample.size);
-        if (err)
-        {
-            av_log(nullptr, AV_LOG_ERROR,
-                   "CFHD_Encoder::pop: GetEncodedSample failed with error code: %d\n", err);
-            return false;
-        }
-        int i = (sample.frame_num - 1) % queue_size;
-        sample.pts = queue[i].pts;
-        sample.duration = queue[i].duration;
-        queued--;
-    }
-    else usleep(10000);
-    return true;
+    parallel = (int)std::min((size_t)parallel, jobs);
+    av_log(nullptr, AV_LOG_INFO, "Running %zu jobs, %d at a time, with %d threads\n",
+           jobs, parallel, free_threads);
+
+    start();
+    close(false);
+    wait();
+
+    if (failed)
+        av_log(nullptr, AV_LOG_ERROR, "%d of %zu jobs failed\n", failed, jobs);
+    return failed == 0;
 }
 
 
-struct CFHD_Transcoder
+static volatile sig_atomic_t b_quit = 0;
+
+static void handle_quit(int)
 {
-    AVFormatContext *ifmt_ctx;
-    AVFormatContext *ofmt_ctx;
-    AVCodecContext *dec_ctx;
-    AVStream *input;
-    CFHD_Encoder *cfhd;
-    SwsContext *sws_ctx;
-    AVCodecContext *v210_ctx;
-    AVPacket *in_pkt;
-    AVPacket *out_pkt;
-    AVFrame *in_frame;
-    AVFrame *out_frame;
-    bool b_video_only;
+    b_quit = 1;
+}
 
-    CFHD_Transcoder(bool b_video_only)
-    {
-        ifmt_ctx = avformat_alloc_context();
-        ofmt_ctx = avformat_alloc_context();
-        dec_ctx = avcodec_alloc_context3(nullptr);
-        input = nullptr;
-        cfhd = nullptr;
-        sws_ctx = nullptr;
-        v210_ctx = nullptr;
-        in_pkt = av_packet_alloc();
-        out_pkt = av_packet_alloc();
-        in_frame = nullptr;
-        out_frame = nullptr;
-        this->b_video_only = b_video_only;
 
-        if (! (ifmt_ctx && ofmt_ctx && dec_ctx && in_pkt && out_pkt))
-        {
-            av_log(nullptr, AV_LOG_ERROR, "CFHD_Transcoder: initialization failed\n");
-            throw 4;
-        }
+// Encodes every file that lands in the -watch folders until SIGINT or SIGTERM.  A file is
+// picked up when its writer closes it or when it is moved in, so one still being copied is
+// never read, and files already there without a result are picked up at the start.  Each
+// encode is written under a hidden name in the output folder and renamed once complete, and
+// <name>.json beside it records the outcome.  cfenc-stats.json holds the totals so far.
+// Results and stats are written to a temporary file and renamed, so readers never see them
+// half written.
+struct CFHD_WatchFolder
+{
+    typedef CFHD_JobScheduler::Job Job;
+
+    CliOptions *cliopt;
+    CFHD_JobScheduler *scheduler;
+    int fd;
+    // by inotify watch descriptor
+    std::map<int, CliWatch> dirs;
+    // inputs that are pending or being encoded
+    std::set<std::string> active;
+    std::string out_dir;
+    std::string extension;
+    int64_t start_us;
+    uint64_t frames;
+    double seconds;
+    int job_num;
+    std::mutex mutex;
+
+    CFHD_WatchFolder(CliOptions *cliopt, CFHD_JobScheduler *scheduler)
+    {
+        this->cliopt = cliopt;
+        this->scheduler = scheduler;
+        fd = -1;
+        out_dir = cliopt->output;
+        start_us = now_us();
+        frames = 0;
+        seconds = 0;
+        job_num = 0;
+        // the container follows -f, else mov
+        const char *format = cliopt->format ? cliopt->format : "mov";
+        if (strcmp(format, "matroska") == 0)
+            extension = "mkv";
+        else if (strcmp(format, "mpegts") == 0)
+            extension = "ts";
+        else
+            extension = format;
     }
 
-    ~CFHD_Transcoder()
+    ~CFHD_WatchFolder()
     {
-        av_log(nullptr, AV_LOG_DEBUG, "CFHD_Transcoder destructor called.\n");
-        if (out_frame) av_frame_free(&out_frame);
-        if (in_frame) av_frame_free(&in_frame);
-        if (v210_ctx) avcodec_free_context(&v210_ctx);
-        if (sws_ctx) sws_freeContext(sws_ctx);
-        av_packet_free(&out_pkt);
-        av_packet_free(&in_pkt);
-        if (cfhd) delete cfhd;
-        avcodec_free_context(&dec_ctx);
-        if (ofmt_ctx->oformat && !(ofmt_ctx->oformat->flags & AVFMT_NOFILE))
-            avio_closep(&ofmt_ctx->pb);
-        avformat_free_context(ofmt_ctx);
-        ofmt_ctx = nullptr;
-        avformat_close_input(&ifmt_ctx);
+        if (fd >= 0)
+            ::close(fd);
     }
 
-    void open_input(CliOptions*);
-    void open_output(CliOptions*);
-    void process(CliOptions*);
+    void run();
 
 private:
-    void guess_channel_layout(AVStream*, int);
-    bool encode();
-    bool transcode();
-    bool transcode_packet();
-    bool init_scaler(AVPixelFormat, bool, int);
-    bool init_v210_encoder();
-    bool encode_v210();
-    bool write_cfhd_sample();
+    void add_file(const CliWatch&, const std::string&);
+    void finished(Job*);
+    void write_stats();
+    static bool write_file(const std::string&, std::function<void(FILE*)>);
 };
 
 
-void CFHD_Transcoder::open_input(CliOptions *cliopt)
+// Replaces path with what write puts in a temporary file.
+bool CFHD_WatchFolder::write_file(const std::string &path, std::function<void(FILE*)> write)
 {
-    int ret;
-    AVCodec *dec;
+    std::string tmp_path = path + ".tmp";
+    FILE *file = fopen(tmp_path.c_str(), "w");
 
-    // If video_size has a value, then...
-    // 1 - we assume this is raw video.
-    // 2 - pix_fmt_name and framerate must also be set per CliOptions validation
-    if (cliopt->video_size)
+    if (! file)
     {
-        AVInputFormat *fmt = av_find_input_format("rawvideo");
-        AVDictionary *options = nullptr;
-        av_dict_set(&options, "video_size", cliopt->video_size, 0);
-        av_dict_set(&options, "pixel_format", cliopt->pix_fmt_name, 0);
-        av_dict_set(&options, "framerate", cliopt->framerate, 0);
-        if ((ret = avformat_open_input(&ifmt_ctx, cliopt->input, fmt, &options)) < 0)
-        {
-            av_log(nullptr, AV_LOG_ERROR,
-                   "Failed to open '%s':\n%s\n", cliopt->input, av_err2str(ret));
-            throw 2;
-        }
-        av_dict_free(&options);
+        av_log(nullptr, AV_LOG_ERROR, "Failed to open '%s': %s\n", tmp_path.c_str(),
+               strerror(errno));
+        return false;
     }
-    else if ((ret = avformat_open_input(&ifmt_ctx, cliopt->input, nullptr, nullptr)) < 0)
+    write(file);
+    if (fclose(file) != 0 || rename(tmp_path.c_str(), path.c_str()) != 0)
     {
-        av_log(nullptr, AV_LOG_ERROR,
-               "Failed to open '%s':\n%s\n", cliopt->input, av_err2str(ret));
-        throw 2;
+        av_log(nullptr, AV_LOG_ERROR, "Failed to write '%s': %s\n", path.c_str(),
+               strerror(errno));
+        remove(tmp_path.c_str());
+        return false;
     }
+    return true;
+}
+
+
+void CFHD_WatchFolder::add_file(const CliWatch &dir, const std::string &name)
+{
+    // hidden files include our own partial encodes
+    if (name.empty() || name[0] == '.')
+        return;
+    std::string path = dir.path + "/" + name;
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || ! S_ISREG(st.st_mode))
+        return;
+
+    size_t dot = name.rfind('.');
+    std::string stem = name.substr(0, dot);
+    Job *job = new Job();
+    job->args.push_back(path);
+    job->args.push_back(out_dir + "/." + stem + "." + extension);
+    job->args.push_back(out_dir + "/" + stem + "." + extension);
+    job->args.push_back(out_dir + "/" + stem + ".json");
+    job->cliopt = *cliopt;
+    job->cliopt.watch.clear();
+    job->cliopt.input = job->args[0].c_str();
+    job->cliopt.output = job->args[1].c_str();
+    job->cliopt.outputs[0].path = job->args[1];
+    job->cliopt.b_progress = false;
+    job->priority = dir.priority;
 
-    if ((ret = av_find_best_stream(ifmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &dec, 0)) < 0)
     {
-        av_log(nullptr, AV_LOG_ERROR,
-               "Error finding video stream in '%s':\n%s\n", cliopt->input, av_err2str(ret));
-        throw 2;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (! active.insert(path).second)
+        {
+            delete job;
+            return;
+        }
+        job->line = ++job_num;
     }
-    input = ifmt_ctx->streams[ret];
-    // these may already be set, but they might not be, and this causes no harm if they are
-    g_width = input->codecpar->width;
-    g_height = input->codecpar->height;
+    av_log(nullptr, AV_LOG_INFO, "Queued job %d: %s (priority %d)\n", job->line, path.c_str(),
+           dir.priority);
+    scheduler->add(job);
+}
 
-    if (cliopt->framerate)
+
+// Runs on the scheduler's worker as each job ends.
+void CFHD_WatchFolder::finished(Job *job)
+{
+    const std::string &input = job->args[0];
+    const std::string &partial = job->args[1];
+    const std::string &output = job->args[2];
+    const std::string &result = job->args[3];
+
+    if (job->status == 0 && rename(partial.c_str(), output.c_str()) != 0)
     {
-        input->avg_frame_rate = cliopt->r_frame_rate;
-        input->r_frame_rate = cliopt->r_frame_rate;
+        av_log(nullptr, AV_LOG_ERROR, "Failed to rename '%s' to '%s'\n", partial.c_str(),
+               output.c_str());
+        job->status = 3;
     }
-    
-    if (cliopt->aspect.num != 0)
-        input->display_aspect_ratio = cliopt->aspect;
-    else if (input->sample_aspect_ratio.num == 0)
+    if (job->status != 0)
+        remove(partial.c_str());
+
+    uint32_t frames = job->state->frames;
+    float job_seconds = job->state->seconds;
+    float fps = job_seconds > 0 ? frames / job_seconds : 0;
+    write_file(result, [&](FILE *file)
     {
-        input->sample_aspect_ratio.num = 1;
-        input->sample_aspect_ratio.den = 1;
-    }
-    // this sets SAR from DAR (if DAR is set)
-    avformat_find_stream_info(ifmt_ctx, nullptr);
-    // this is needed...
-    input->codecpar->sample_aspect_ratio = input->sample_aspect_ratio;
+        fprintf(file, "{\n  \"input\": ");
+        write_json_string(file, input);
+        fprintf(file, ",\n  \"output\": ");
+        write_json_string(file, job->status ? "" : output);
+        fprintf(file, ",\n  \"status\": \"%s\",\n  \"exit_code\": %d,\n  \"priority\": %d,\n"
+                "  \"wait_seconds\": %.3f,\n  \"frames\": %u,\n  \"seconds\": %.3f,\n"
+                "  \"fps\": %.2f\n}\n",
+                job->status ? "failed" : "ok", job->status, job->priority,
+                (job->started_us - job->queued_us) / 1e6, frames, job_seconds, fps);
+    });
 
-    if (input->nb_frames == 0 && ifmt_ctx->duration > 0)
     {
-        av_log(nullptr, AV_LOG_INFO, "Estimating frame count from duration\n");
-        float dur = (float)ifmt_ctx->duration / 1000000;
-        float rate = (float)input->r_frame_rate.num / (float)input->r_frame_rate.den;
-        input->nb_frames = (int64_t)(dur * rate);
+        std::lock_guard<std::mutex> lock(mutex);
+        this->frames += frames;
+        seconds += job_seconds;
+        active.erase(input);
     }
+    write_stats();
+}
 
-    av_dump_format(ifmt_ctx, 0, cliopt->input, 0);
 
-    // Check if the video is already in a format that we can send direct to the cfhd encoder.
-    if (input->codecpar->codec_id == AV_CODEC_ID_V210)
-        return;
+void CFHD_WatchFolder::write_stats()
+{
+    int pending, running, finished, failed;
+    uint32_t hits, misses;
+    size_t warm;
 
-    if (input->codecpar->codec_id == AV_CODEC_ID_RAWVIDEO)
     {
-        if (cliopt->b_rgb)
-        {
-            if ((AVPixelFormat)input->codecpar->format == AV_PIX_FMT_RGB48LE)
-                return;
-        }
-        else if ((AVPixelFormat)input->codecpar->format == AV_PIX_FMT_YUYV422)
-            return;
+        std::lock_guard<std::mutex> lock(scheduler->mutex);
+        pending = (int)scheduler->pending.size();
+        running = scheduler->running;
+        finished = scheduler->finished;
+        failed = scheduler->failed;
+    }
+    {
+        std::lock_guard<std::mutex> lock(scheduler->encoders.mutex);
+        hits = scheduler->encoders.hits;
+        misses = scheduler->encoders.misses;
+        warm = scheduler->encoders.idle.size();
     }
+    std::lock_guard<std::mutex> lock(mutex);
+    write_file(out_dir + "/cfenc-stats.json", [&](FILE *file)
+    {
+        fprintf(file,
+                "{\n  \"uptime_seconds\": %.0f,\n  \"pending\": %d,\n  \"running\": %d,\n"
+                "  \"finished\": %d,\n  \"failed\": %d,\n  \"frames\": %llu,\n"
+                "  \"encode_seconds\": %.3f,\n  \"warm_pools\": %zu,\n  \"pool_hits\": %u,\n"
+                "  \"pool_misses\": %u\n}\n",
+                (now_us() - start_us) / 1e6, pending, running, finished, failed,
+                (unsigned long long)frames, seconds, warm, hits, misses);
+    });
+}
 
-    // Otherwise we need to decode/scale it.
-    dec_ctx = avcodec_alloc_context3(dec);
-    if (!dec_ctx)
+
+void CFHD_WatchFolder::run()
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    if ((fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
     {
-        av_log(nullptr, AV_LOG_ERROR, "open_input: avcodec_alloc_context3 failed\n");
+        av_log(nullptr, AV_LOG_ERROR, "inotify_init1 failed: %s\n", strerror(errno));
         throw 2;
     }
-    if ((ret = avcodec_parameters_to_context(dec_ctx, input->codecpar)) < 0)
+    char out_real[PATH_MAX], dir_real[PATH_MAX];
+    if (! realpath(out_dir.c_str(), out_real))
     {
-        av_log(nullptr, AV_LOG_ERROR,
-               "open_input: avcodec_parameters_to_context failed:\n%s\n", av_err2str(ret));
-        throw 2;
+        av_log(nullptr, AV_LOG_ERROR, "Output folder '%s' not found\n", out_dir.c_str());
+        throw 3;
     }
-    if ((ret = avcodec_open2(dec_ctx, dec, nullptr)) < 0)
+    for (const CliWatch &dir : cliopt->watch)
     {
-        av_log(nullptr, AV_LOG_ERROR,
-               "open_input: avcodec_open2 failed:\n%s\n", av_err2str(ret));
-        throw 2;
+        // the encodes would be picked up again
+        if (realpath(dir.path.c_str(), dir_real) && strcmp(dir_real, out_real) == 0)
+        {
+            av_log(nullptr, AV_LOG_ERROR, "The output folder cannot be a watch folder\n");
+            throw 1;
+        }
+        int wd = inotify_add_watch(fd, dir.path.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd < 0)
+        {
+            av_log(nullptr, AV_LOG_ERROR, "Failed to watch '%s': %s\n", dir.path.c_str(),
+                   strerror(errno));
+            throw 2;
+        }
+        dirs[wd] = dir;
+    }
+
+    scheduler->b_fixed_share = true;
+    scheduler->on_finished = [this](Job *job) { finished(job); };
+    scheduler->start();
+    av_log(nullptr, AV_LOG_INFO, "Watching %zu folders, encoding %d at a time into '%s'\n",
+           dirs.size(), scheduler->parallel, out_dir.c_str());
+
+    // files that arrived while no daemon was watching
+    for (const CliWatch &dir : cliopt->watch)
+    {
+        DIR *d = opendir(dir.path.c_str());
+        struct dirent *entry;
+        while (d && (entry = readdir(d)))
+        {
+            std::string name = entry->d_name;
+            std::string stem = name.substr(0, name.rfind('.'));
+            if (access((out_dir + "/" + stem + ".json").c_str(), F_OK) != 0)
+                add_file(dir, name);
+        }
+        if (d) closedir(d);
+    }
+    write_stats();
+
+    signal(SIGINT, handle_quit);
+    signal(SIGTERM, handle_quit);
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    while (! b_quit)
+    {
+        if (poll(&pfd, 1, 1000) <= 0)
+            continue;
+        ssize_t len;
+        while ((len = read(fd, buf, sizeof(buf))) > 0)
+        {
+            for (char *p = buf; p < buf + len; )
+            {
+                struct inotify_event *event = (struct inotify_event*)p;
+                p += sizeof(struct inotify_event) + event->len;
+                if (event->len > 0 && ! (event->mask & IN_ISDIR) && dirs.count(event->wd))
+                    add_file(dirs[event->wd], event->name);
+            }
+        }
     }
+
+    // encodes under way are finished; queued files are picked up again at the next start
+    av_log(nullptr, AV_LOG_INFO, "Stopping after the encodes in progress\n");
+    scheduler->close(true);
+    scheduler->wait();
+    write_stats();
 }
 
 
-void CFHD_Transcoder::guess_channel_layout(AVStream *ist, int i)
+static void skip_space(const std::string &s, size_t &pos)
 {
-    char layout_name[256];
-
-    ist->codecpar->channel_layout = av_get_default_channel_layout(ist->codecpar->channels);
-    av_get_channel_layout_string(layout_name, sizeof(layout_name),
-                                 ist->codecpar->channels, ist->codecpar->channel_layout);
-    av_log(NULL, AV_LOG_WARNING, "Guessed channel layout for stream #0:%u: %s\n", i, layout_name);
+    while (pos < s.size() && isspace((unsigned char)s[pos]))
+        pos++;
 }
 
 
-void CFHD_Transcoder::open_output(CliOptions *cliopt)
+// Reads a JSON string starting at its opening quote.  \u escapes become UTF-8.
+static bool read_json_string(const std::string &s, size_t &pos, std::string &value)
 {
-    int i, ret;
-    AVStream *ist, *ost;
-    AVDictionaryEntry *tag = nullptr;
-    
-    if ((ret = avformat_alloc_output_context2(&ofmt_ctx, nullptr, nullptr, cliopt->output)) < 0)
+    value.clear();
+    if (pos >= s.size() || s[pos] != '"')
+        return false;
+    for (pos++; pos < s.size(); pos++)
     {
-        av_log(nullptr, AV_LOG_ERROR,
-               "open_output: avformat_alloc_output_context2 failed:\n%s\n", av_err2str(ret));
-        throw 3;
-    }
-    ofmt_ctx->oformat->video_codec = AV_CODEC_ID_CFHD;
-    ofmt_ctx->oformat->audio_codec = AV_CODEC_ID_NONE;
-
-    // copy container metadata
-    while ((tag = av_dict_get(ifmt_ctx->metadata, "", tag, AV_DICT_IGNORE_SUFFIX)))
-        // ignore these tags
-        if (strcmp(tag->key, "major_brand") != 0 && strcmp(tag->key, "minor_version") != 0 &&
-            strcmp(tag->key, "compatible_brands") !=0 && strcmp(tag->key, "encoder") != 0)
+        char c = s[pos];
+        if (c == '"')
         {
-            if ((ret = av_dict_set(&ofmt_ctx->metadata, tag->key, tag->value, 0)) < 0)
-                av_log(nullptr,
-                       AV_LOG_WARNING, "Error copying container metadata:\n%s\n", av_err2str(ret));
+            pos++;
+            return true;
         }
-
-    for (i = 0; i < ifmt_ctx->nb_streams; i++)
-    {
-        ist = ifmt_ctx->streams[i];
-        
-        if (cliopt->b_video_only && ist != input)
+        if (c != '\\')
+        {
+            value += c;
             continue;
-
-        if (! (ost = avformat_new_stream(ofmt_ctx, nullptr)))
+        }
+        if (++pos >= s.size())
+            return false;
+        switch (s[pos])
         {
-            av_log(nullptr, AV_LOG_ERROR,
-                   "open_output: avformat_new_stream failed for for stream #0:%u\n", i);
-            throw 3;
+            case 'b': value += '\b'; break;
+            case 'f': value += '\f'; break;
+            case 'n': value += '\n'; break;
+            case 'r': value += '\r'; break;
+            case 't': value += '\t'; break;
+            case 'u':
+            {
+                if (pos + 4 >= s.size())
+                    return false;
+                unsigned int u = (unsigned int)strtoul(s.substr(pos + 1, 4).c_str(), nullptr, 16);
+                pos += 4;
+                if (u < 0x80)
+                    value += (char)u;
+                else if (u < 0x800)
+                {
+                    value += (char)(0xc0 | (u >> 6));
+                    value += (char)(0x80 | (u & 0x3f));
+                }
+                else
+                {
+                    value += (char)(0xe0 | (u >> 12));
+                    value += (char)(0x80 | ((u >> 6) & 0x3f));
+                    value += (char)(0x80 | (u & 0x3f));
+                }
+                break;
+            }
+            default: value += s[pos]; break;
         }
+    }
+    return false;
+}
 
-        // Copy track language
-        if ((tag = av_dict_get(ist->metadata, "language", nullptr, 0)))
-            if ((ret = av_dict_set(&ost->metadata, tag->key, tag->value, 0)) < 0)
-                av_log(nullptr, AV_LOG_WARNING, "Error copying language for stream #0:%u:\n%s\n",
-                                                i, av_err2str(ret));
 
-        if (ist == input)
+// Parses one request of the job server: a JSON object whose values are strings, numbers,
+// booleans or arrays of strings.  Scalars come back as text in fields and arrays in lists.
+static bool parse_request(const std::string &line, std::map<std::string, std::string> &fields,
+                          std::map<std::string, std::vector<std::string>> &lists)
+{
+    size_t pos = 0;
+    std::string key, value;
+
+    skip_space(line, pos);
+    if (pos >= line.size() || line[pos++] != '{')
+        return false;
+    skip_space(line, pos);
+    if (pos < line.size() && line[pos] == '}')
+        return true;
+    while (1)
+    {
+        skip_space(line, pos);
+        if (! read_json_string(line, pos, key))
+            return false;
+        skip_space(line, pos);
+        if (pos >= line.size() || line[pos++] != ':')
+            return false;
+        skip_space(line, pos);
+        if (pos >= line.size())
+            return false;
+        if (line[pos] == '"')
         {
-            ost->codecpar->codec_id = AV_CODEC_ID_CFHD;
-            ost->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
-            if (cliopt->b_rgb) ost->codecpar->format = AV_PIX_FMT_GBRP12LE;
-            else ost->codecpar->format = AV_PIX_FMT_YUV422P10LE;
-            ost->codecpar->width = g_width;
-            ost->codecpar->height = g_height;
-            ost->codecpar->video_delay = ist->codecpar->video_delay;
-            ost->time_base = av_inv_q(ist->r_frame_rate);
-            ost->r_frame_rate = ist->r_frame_rate;
-            ost->avg_frame_rate = ist->avg_frame_rate;
-            // this is required for mov files
-            ost->codecpar->sample_aspect_ratio = ist->sample_aspect_ratio;
-            // this is required for avi files
-            ost->sample_aspect_ratio = ist->sample_aspect_ratio;
+            if (! read_json_string(line, pos, fields[key]))
+                return false;
         }
-        else
+        else if (line[pos] == '[')
         {
-            ost->time_base = ist->time_base;
-            if ((avcodec_parameters_copy(ost->codecpar, ist->codecpar)) < 0)
+            std::vector<std::string> &list = lists[key];
+            pos++;
+            skip_space(line, pos);
+            while (pos < line.size() && line[pos] != ']')
             {
-                av_log(nullptr, AV_LOG_ERROR,
-                       "open_output: avcodec_parameters_copy failed for stream #0:%u\n", i);
-                throw 3;
-            }
-            if (ist->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
-            {
-                ofmt_ctx->oformat->audio_codec = ist->codecpar->codec_id;
-                if (! ost->codecpar->channel_layout)
-                    guess_channel_layout(ost, i);
+                if (! read_json_string(line, pos, value))
+                    return false;
+                list.push_back(value);
+                skip_space(line, pos);
+                if (pos < line.size() && line[pos] == ',')
+                    pos++;
+                skip_space(line, pos);
             }
-            if (ist->codecpar->codec_type == AVMEDIA_TYPE_SUBTITLE)
-                ofmt_ctx->oformat->subtitle_codec = ist->codecpar->codec_id;
+            if (pos++ >= line.size())
+                return false;
         }
+        else
+        {
+            size_t end = line.find_first_of(",} \t\r\n", pos);
+            if (end == std::string::npos || end == pos)
+                return false;
+            fields[key] = line.substr(pos, end - pos);
+            pos = end;
+        }
+        skip_space(line, pos);
+        if (pos >= line.size())
+            return false;
+        if (line[pos] == '}')
+            return true;
+        if (line[pos++] != ',')
+            return false;
     }
-
-    if ((ret = avio_open(&ofmt_ctx->pb, cliopt->output, AVIO_FLAG_WRITE)) < 0)
-    {
-        av_log(nullptr, AV_LOG_ERROR, "open_output: avio_open failed:\n%s\n", av_err2str(ret));
-        throw 3;
-    }
-    if ((ret = avformat_write_header(ofmt_ctx, nullptr)) < 0)
-    {
-        av_log(nullptr, AV_LOG_ERROR, "open_output: avformat_write_header failed:\n%s\n",
-               av_err2str(ret));
-        throw 3;
-    }
-
-    av_dump_format(ofmt_ctx, 0, cliopt->output, 1);
 }
 
 
-bool CFHD_Transcoder::write_cfhd_sample()
+// Runs jobs for local clients that connect to a Unix domain socket, such as frame servers
+// and orchestration scripts, without a process per encode.  Requests and replies are JSON
+// objects, one per line.  Jobs are scheduled as with -jobs, at a fixed share of the threads
+// so that encoder pools stay warm between them.  A job can take its pictures from the
+// client instead of a file: each arrives as a memfd passed with the frame request, is
+// mapped, and goes to the encoder from that memory without a copy.  The client hears when
+// the encoder is done with it.
+struct CFHD_JobServer
 {
-    int ret;
-
-    if (cfhd->sample.size > 0)
+    struct Client
     {
-        out_pkt->data = cfhd->sample.data;
-        out_pkt->size = (int)cfhd->sample.size;
-        out_pkt->flags |= AV_PKT_FLAG_KEY;
-        out_pkt->duration = cfhd->sample.duration;
-        out_pkt->pts = out_pkt->dts = cfhd->sample.pts;
+        int fd;
+        std::mutex write_mutex;
+        // frame jobs this client feeds, aborted if it goes away before their end
+        std::vector<std::shared_ptr<CFHD_JobState>> feeding;
 
-        if (b_video_only)
-            out_pkt->stream_index = 0;
-        else
-            out_pkt->stream_index = input->index;
-        AVStream *output = ofmt_ctx->streams[out_pkt->stream_index];
-        av_packet_rescale_ts(out_pkt, input->time_base, output->time_base);
+        Client(int fd) { this->fd = fd; }
+        ~Client() { ::close(fd); }
 
-        if ((ret = av_write_frame(ofmt_ctx, out_pkt)) < 0)
+        bool send(const std::string &line)
         {
-            av_log(nullptr, AV_LOG_ERROR,
-                   "write_cfhd_sample: av_write_frame failed:\n%s\n", av_err2str(ret));
-            return false;
+            std::lock_guard<std::mutex> lock(write_mutex);
+            std::string out = line + "\n";
+            size_t sent = 0;
+            while (sent < out.size())
+            {
+                ssize_t n = ::send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    return false;
+                sent += n;
+            }
+            return true;
         }
-        if (input->nb_frames > 0)
-            av_log(nullptr, AV_LOG_INFO,
-                   "           Frame: %u / %lld\r", cfhd->sample.frame_num, input->nb_frames);
-        else
-            av_log(nullptr, AV_LOG_INFO,
-                   "           Frame: %u\r", cfhd->sample.frame_num);
+    };
 
-        cfhd->sample.data = nullptr;
-        cfhd->sample.size = 0;
-        CFHD_ReleaseSampleBuffer(cfhd->pool, cfhd->sample.buffer);
-    }
-    return true;
-}
+    struct Record
+    {
+        std::shared_ptr<CFHD_JobState> state;
+        std::string input;
+        std::string output;
+        // for checking the pictures of a frame job
+        int height;
+        int row_bytes;
+        int64_t next_pts;
+    };
 
+    // a picture mapped from a client's memfd, unmapped when the encoder lets go of it
+    struct MappedFrame
+    {
+        std::shared_ptr<Client> client;
+        int id;
+        int64_t frame;
+        void *base;
+        size_t size;
+    };
 
-bool CFHD_Transcoder::init_v210_encoder()
-{
-    int ret;
+    typedef std::map<std::string, std::string> Fields;
+    typedef std::map<std::string, std::vector<std::string>> Lists;
 
-    const AVCodec *v210 = avcodec_find_encoder_by_name("v210");
-    if (! v210)
+    CliOptions *cliopt;
+    CFHD_JobScheduler *scheduler;
+    std::string path;
+    int fd;
+    std::map<int, Record> jobs;
+    int next_id;
+    std::set<std::shared_ptr<Client>> clients;
+    std::mutex mutex;
+    std::condition_variable cv;
+    // getopt keeps its state in globals
+    std::mutex parse_mutex;
+
+    CFHD_JobServer(CliOptions *cliopt, CFHD_JobScheduler *scheduler)
     {
-        av_log(nullptr, AV_LOG_ERROR, "v210 codec not found with libavcodec.\n");
-        av_log(nullptr, AV_LOG_ERROR, "Check the version and build options for libavcodec.\n");
-        return false;
+        this->cliopt = cliopt;
+        this->scheduler = scheduler;
+        path = cliopt->serve;
+        fd = -1;
+        next_id = 1;
     }
-    if (! (v210_ctx = avcodec_alloc_context3(v210)))
+
+    ~CFHD_JobServer()
     {
-        av_log(nullptr, AV_LOG_ERROR, "init_v210_encoder: avcodec_alloc_context3 failed\n");
-        return false;
+        if (fd >= 0)
+        {
+            ::close(fd);
+            unlink(path.c_str());
+        }
     }
 
-    v210_ctx->width = g_width;
-    v210_ctx->height = g_height;
-    v210_ctx->time_base = input->time_base;
-    v210_ctx->pix_fmt = AV_PIX_FMT_YUV422P10LE;
+    void run();
 
-    if ((ret = avcodec_open2(v210_ctx, v210, nullptr)) < 0)
-    {
-        av_log(nullptr, AV_LOG_ERROR,
-               "init_v210_encoder: avcodec_open2 failed:\n%s\n", av_err2str(ret));
-        return false;
-    }
-    return true;
+private:
+    void serve(std::shared_ptr<Client>);
+    std::string handle(std::shared_ptr<Client>&, Fields&, Lists&, std::deque<int>&);
+    std::string submit(std::shared_ptr<Client>&, Fields&, Lists&);
+    std::string add_frame(std::shared_ptr<Client>&, Fields&, int);
+    std::string status(int, const Record&);
+    void progress(std::shared_ptr<Client>&, int);
+    static void release_frame(void*, uint8_t*);
+};
+
+
+static std::string json_error(const std::string &error)
+{
+    return "{\"ok\": false, \"error\": " + json_quote(error) + "}";
 }
 
 
-bool CFHD_Transcoder::encode_v210()
+std::string CFHD_JobServer::status(int id, const Record &record)
 {
-    int ret;
+    char buf[256];
+    const CFHD_JobState &state = *record.state;
 
-    if ((ret = avcodec_send_frame(v210_ctx, out_frame)) < 0)
+    snprintf(buf, sizeof(buf), "{\"ok\": true, \"id\": %d, \"state\": \"%s\", \"frames\": %u, "
+             "\"total_frames\": %lld, \"exit_code\": %d, \"input\": ", id, state.phase_name(),
+             (uint32_t)state.frames, (long long)state.total_frames, (int)state.exit_code);
+    return buf + json_quote(record.input) + ", \"output\": " + json_quote(record.output) + "}";
+}
+
+
+// {"cmd": "submit", "args": [<cfenc arguments>], "priority": <int>, "frames": true}
+// With frames, the arguments give -s, -p and -r instead of -i, and the pictures follow in
+// frame requests.  The reply then says how many buffers the client needs to take turns
+// with: the frame queue, the picture being handed to the encoders, the most any encoder
+// pool of the job holds, and with -analyze the pictures waiting to be analyzed.
+std::string CFHD_JobServer::submit(std::shared_ptr<Client> &client, Fields &fields, Lists &lists)
+{
+    typedef CFHD_JobScheduler::Job Job;
+    bool b_frames = fields["frames"] == "true";
+    Job *job = new Job();
+
+    job->args.push_back("cfenc");
+    for (const std::string &arg : lists["args"])
+        job->args.push_back(arg);
+    if (b_frames)
     {
-        av_log(nullptr, AV_LOG_ERROR,
-               "encode_v210: avcodec_send_frame failed:\n%s\n", av_err2str(ret));
-        return false;
+        job->args.insert(job->args.begin() + 1, "memfd:");
+        job->args.insert(job->args.begin() + 1, "-i");
     }
-    while (1)
+    for (std::string &arg : job->args)
+        job->argv.push_back(&arg[0]);
+    job->argv.push_back(nullptr);
+    job->priority = atoi(fields["priority"].c_str());
+
     {
-        ret = avcodec_receive_packet(v210_ctx, out_pkt);
-        if (ret == 0)
+        std::lock_guard<std::mutex> lock(parse_mutex);
+        optind = 0;
+        job->cliopt.b_job = true;
+        try
         {
-            int pitch = out_pkt->buf->size / g_height;
-            if (! cfhd->push(out_pkt->buf->data, pitch, dec_ctx->frame_number,
-                             in_frame->pts, in_frame->pkt_duration))
-                return false;
-            av_packet_unref(out_pkt);
-            return true;
+            job->cliopt.parse((int)job->args.size(), job->argv.data());
         }
-        else if (ret != AVERROR(EAGAIN))
+        catch (int e)
         {
-            av_log(nullptr, AV_LOG_ERROR,
-                   "encode_v210: avcodec_receive_packet failed:\n%s\n", av_err2str(ret));
-            return false;
+            delete job;
+            return json_error("invalid arguments");
+        }
+    }
+    if (job->cliopt.jobs || ! job->cliopt.watch.empty() || job->cliopt.serve)
+    {
+        delete job;
+        return json_error("jobs, watch and serve cannot be submitted");
+    }
+    job->cliopt.b_progress = false;
+    int width = 0, height = 0, row_bytes = 0, buffers = 0;
+    if (b_frames)
+    {
+        AVPixelFormat pix_fmt = job->cliopt.pix_fmt_name ? av_get_pix_fmt(job->cliopt.pix_fmt_name)
+                                                          : AV_PIX_FMT_NONE;
+        const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+        width = job->cliopt.video_width;
+        height = job->cliopt.video_height;
+        if (! desc || width <= 0 || height <= 0)
+        {
+            delete job;
+            return json_error("frames need -s, -p and -r");
         }
+        row_bytes = width * av_get_bits_per_pixel(desc) / 8;
+        job->state->frames_in = std::make_shared<CFHD_FrameQueue>();
+        client->feeding.push_back(job->state);
+        int threads = job->cliopt.threads > 0 ? job->cliopt.threads : scheduler->fixed_share();
+        buffers = (int)job->state->frames_in->max_frames + 1 + CFHD_Encoder::queue_for(threads);
+        if (job->cliopt.analyze)
+            buffers += CFHD_Analyzer::pending_for(scheduler->taskpool) + 1;
+    }
+
+    int id;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        // the oldest records go once there are plenty, if their jobs have ended
+        while (jobs.size() >= 1024 && jobs.begin()->second.state->phase > CFHD_JobState::RUNNING)
+            jobs.erase(jobs.begin());
+        id = next_id++;
+        Record &record = jobs[id];
+        record.state = job->state;
+        record.input = job->cliopt.input;
+        record.output = job->cliopt.output;
+        record.height = height;
+        record.row_bytes = row_bytes;
+        record.next_pts = 0;
+        job->line = id;
     }
+    scheduler->add(job);
+    if (b_frames)
+        return "{\"ok\": true, \"id\": " + std::to_string(id) + ", \"buffers\": " +
+               std::to_string(buffers) + "}";
+    return "{\"ok\": true, \"id\": " + std::to_string(id) + "}";
 }
 
 
-bool CFHD_Transcoder::init_scaler(AVPixelFormat new_pix_fmt, bool accurate, int trc)
+void CFHD_JobServer::release_frame(void *opaque, uint8_t*)
 {
-    AVColorSpace colorspace;
-    const AVPixelFormat src_pix_fmt = (AVPixelFormat)input->codecpar->format;
-    int flags = SWS_BICUBIC;
-    const int *table;
+    MappedFrame *mapped = (MappedFrame*)opaque;
 
-    if (accurate)
-        flags |= SWS_ACCURATE_RND | SWS_FULL_CHR_H_INT;
+    munmap(mapped->base, mapped->size);
+    mapped->client->send("{\"event\": \"released\", \"id\": " + std::to_string(mapped->id) +
+                         ", \"frame\": " + std::to_string(mapped->frame) + "}");
+    delete mapped;
+}
+
+
+// {"cmd": "frame", "id": <job>, "pitch": <bytes>, "offset": <bytes>, "pts": <frame>}, sent
+// with the memfd holding the picture.  pts counts frames and follows on when left out.
+// Only the pages of the picture are mapped, and they stay mapped until the encoder is done
+// with them; the client keeps as many buffers as the submit reply asked for.  A pitch may
+// pad the rows to at most four times their size.
+std::string CFHD_JobServer::add_frame(std::shared_ptr<Client> &client, Fields &fields,
+                                      int memfd)
+{
+    int id = atoi(fields["id"].c_str());
+    int64_t pitch = atoll(fields["pitch"].c_str());
+    int64_t offset = atoll(fields["offset"].c_str());
+    std::shared_ptr<CFHD_FrameQueue> queue;
+    CFHD_FrameQueue::Frame frame;
+    struct stat st;
+    int64_t pts = 0;
+    int height = 0, row_bytes = 0;
 
-    sws_ctx = sws_getContext(g_width, g_height, src_pix_fmt,
-                             g_width, g_height, new_pix_fmt,
-                             flags, nullptr, nullptr, nullptr);
-    if (! sws_ctx)
     {
-        av_log(nullptr, AV_LOG_ERROR, "init_scaler: sws_getContext failed\n");
-        return false;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto i = jobs.find(id);
+        if (i != jobs.end() && i->second.state->frames_in)
+        {
+            Record &record = i->second;
+            queue = record.state->frames_in;
+            pts = fields.count("pts") ? atoll(fields["pts"].c_str()) : record.next_pts;
+            record.next_pts = pts + 1;
+            height = record.height;
+            row_bytes = record.row_bytes;
+        }
+    }
+    // only the client that submitted a job feeds it
+    bool b_feeding = false;
+    for (std::shared_ptr<CFHD_JobState> &state : client->feeding)
+        b_feeding = b_feeding || (queue && state->frames_in == queue);
+    std::string error;
+    if (! b_feeding)
+        error = "bad frame for job " + fields["id"];
+    else if (pitch < row_bytes || pitch > 4 * (int64_t)row_bytes)
+        error = "pitch must be from " + std::to_string(row_bytes) + " to " +
+                std::to_string(4 * (int64_t)row_bytes) + " bytes";
+    else if (pitch * height > INT_MAX)
+        error = "the picture is too large";
+    else if (fstat(memfd, &st) != 0 || offset < 0 || offset > st.st_size - pitch * height)
+        error = "the picture does not lie inside the memfd";
+    if (! error.empty())
+    {
+        ::close(memfd);
+        return json_error(error);
     }
 
-    switch(trc)
+    // mappings start on a page
+    int64_t bytes = pitch * height;
+    int64_t start = offset / sysconf(_SC_PAGESIZE) * sysconf(_SC_PAGESIZE);
+    size_t size = (size_t)(offset - start + bytes);
+    void *base = mmap(nullptr, size, PROT_READ, MAP_SHARED, memfd, start);
+    ::close(memfd);
+    if (base == MAP_FAILED)
+        return json_error(std::string("mmap failed: ") + strerror(errno));
+
+    MappedFrame *mapped = new MappedFrame();
+    mapped->client = client;
+    mapped->id = id;
+    mapped->frame = pts;
+    mapped->base = base;
+    mapped->size = size;
+    frame.data = (uint8_t*)base + (offset - start);
+    frame.buf = av_buffer_create(frame.data, (int)bytes, release_frame, mapped,
+                                 AV_BUFFER_FLAG_READONLY);
+    if (! frame.buf)
     {
-        case 601:
-            colorspace = AVCOL_SPC_BT470BG;
-            break;
-        case 709:
-            colorspace = AVCOL_SPC_BT709;
-            break;
-        case 2020:
-            colorspace = AVCOL_SPC_BT2020_NCL;
-            break;
-        default:
-            if (g_width <= 720)
-                colorspace = AVCOL_SPC_BT470BG;
-            else if (g_width <= 1920)
-                colorspace = AVCOL_SPC_BT709;
-            else
-                colorspace = AVCOL_SPC_BT2020_NCL;
+        munmap(base, size);
+        delete mapped;
+        return json_error("av_buffer_create failed");
     }
-    table = sws_getCoefficients(colorspace);
-    sws_setColorspaceDetails(sws_ctx, table, 0, table, 0, 0, 65535, 65535);
-    return true;
+    frame.pitch = (int)pitch;
+    frame.pts = pts;
+    if (! queue->push(frame))
+        return json_error("job " + fields["id"] + " takes no more frames");
+    return "{\"ok\": true, \"id\": " + std::to_string(id) + ", \"frame\": " +
+           std::to_string(pts) + "}";
 }
 
 
-bool CFHD_Transcoder::transcode_packet()
+// {"cmd": "progress", "id": <job>} streams a progress event for the job about every quarter
+// second until it ends, then its status.  The connection answers nothing else meanwhile.
+void CFHD_JobServer::progress(std::shared_ptr<Client> &client, int id)
 {
-    int ret;
-
-    if ((ret = avcodec_send_packet(dec_ctx, in_pkt)) < 0)
-    {
-        av_log(nullptr, AV_LOG_ERROR,
-               "transcode_packet: avcodec_send_packet failed:\n%s\n", av_err2str(ret));
-        return false;
-    }
     while (1)
     {
-        ret = avcodec_receive_frame(dec_ctx, in_frame);
-        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-            return true;
-        else if (ret < 0)
-        {
-            av_log(nullptr, AV_LOG_ERROR,
-                   "transcode_packet: avcodec_receive_frame failed:\n%s\n", av_err2str(ret));
-            return false;
-        }
-
-        if (sws_ctx)
+        std::string line;
+        bool b_ended;
         {
-            if ((ret = sws_scale(sws_ctx, in_frame->data, in_frame->linesize, 0, g_height,
-                                 out_frame->data, out_frame->linesize)) <= 0)
+            std::lock_guard<std::mutex> lock(mutex);
+            auto i = jobs.find(id);
+            if (i == jobs.end())
             {
-                av_log(nullptr, AV_LOG_ERROR,
-                       "transcode_packet: sws_scale failed:\n%s\n", av_err2str(ret));
-                return false;
+                client->send(json_error("no job " + std::to_string(id)));
+                return;
             }
+            const CFHD_JobState &state = *i->second.state;
+            b_ended = state.phase > CFHD_JobState::RUNNING;
+            if (b_ended)
+                line = status(id, i->second);
+            else
+                line = "{\"event\": \"progress\", \"id\": " + std::to_string(id) +
+                       ", \"state\": \"" + state.phase_name() + "\", \"frames\": " +
+                       std::to_string((uint32_t)state.frames) + ", \"total_frames\": " +
+                       std::to_string((long long)state.total_frames) + "}";
         }
-        else av_frame_ref(out_frame, in_frame);
-
-        if (v210_ctx)
-        {
-            if (! encode_v210())
-                return false;
-        }
-        else if (! cfhd->push(out_frame->data[0], out_frame->linesize[0], dec_ctx->frame_number,
-                              in_frame->pts, in_frame->pkt_duration))
-                return false;
-
-        if (! write_cfhd_sample())
-            return false;
-
-        if (! sws_ctx) av_frame_unref(out_frame);
-        av_frame_unref(in_frame);
+        if (! client->send(line) || b_ended)
+            return;
+        usleep(250000);
     }
 }
 
 
-// Video data requires decoding/scaling to feed the CFHD encoder.
-bool CFHD_Transcoder::transcode()
+std::string CFHD_JobServer::handle(std::shared_ptr<Client> &client, Fields &fields,
+                                   Lists &lists, std::deque<int> &fds)
 {
-    int ret;
+    const std::string &cmd = fields["cmd"];
+    int id = atoi(fields["id"].c_str());
 
-    av_log(nullptr, AV_LOG_DEBUG, "Decoding/scaling video then sending to the cfhd encoder.\n");
-    while (1)
+    if (cmd == "submit")
+        return submit(client, fields, lists);
+    if (cmd == "frame")
     {
-        if (av_read_frame(ifmt_ctx, in_pkt) < 0)
-            break;
-        // if this is the video stream...
-        if (ifmt_ctx->streams[in_pkt->stream_index] == input)
-        {
-            if (! transcode_packet())
-               return false;
-        }
-        // else remux other streams
-        else if (! b_video_only)
-            if ((ret = av_write_frame(ofmt_ctx, in_pkt)) < 0)
-            {
-                av_log(nullptr, AV_LOG_ERROR,
-                       "transcode: av_write_frame failed for stream #0:%u:\n%s\n",
-                       in_pkt->stream_index, av_err2str(ret));
-                return false;
-            }
-        av_packet_unref(in_pkt);
+        if (fds.empty())
+            return json_error("frame sent without a memfd");
+        int memfd = fds.front();
+        fds.pop_front();
+        return add_frame(client, fields, memfd);
     }
-    // flush the decoder
-    av_packet_free(&in_pkt);
-    if (! transcode_packet())
-        return false;
-    return true;
+    if (cmd == "progress")
+    {
+        progress(client, id);
+        return "";
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (cmd == "list")
+    {
+        std::string reply = "{\"ok\": true, \"jobs\": [";
+        for (auto &i : jobs)
+            reply += (i.first == jobs.begin()->first ? "" : ", ") + status(i.first, i.second);
+        return reply + "]}";
+    }
+    auto i = jobs.find(id);
+    if (i == jobs.end())
+        return json_error(cmd.empty() ? "no cmd" : "no job " + fields["id"]);
+    if (cmd == "status")
+        return status(id, i->second);
+    if (cmd == "cancel")
+    {
+        i->second.state->cancel();
+        return status(id, i->second);
+    }
+    if (cmd == "end" && i->second.state->frames_in)
+    {
+        i->second.state->frames_in->end();
+        return status(id, i->second);
+    }
+    return json_error("unknown cmd " + json_quote(cmd));
 }
 
 
-// Video data is already in a format we can feed to the CFHD encoder without decoding/scaling.
-bool CFHD_Transcoder::encode()
+// Reads the requests of one client.  Descriptors passed alongside frame requests are queued
+// in the order they arrive, and each frame request takes the next.
+void CFHD_JobServer::serve(std::shared_ptr<Client> client)
 {
-    int ret;
-    int frame_num = 0;
+    std::string buffer;
+    std::deque<int> fds;
+    char data[65536];
+    char control[CMSG_SPACE(sizeof(int) * 16)];
 
-    av_log(nullptr, AV_LOG_DEBUG, "Sending video direct to the cfhd encoder.\n");
     while (1)
     {
-        if (av_read_frame(ifmt_ctx, in_pkt) < 0)
+        struct iovec iov = { data, sizeof(data) };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t n = recvmsg(client->fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
             break;
-        // if this is the video stream...
-        if (ifmt_ctx->streams[in_pkt->stream_index] == input)
-        {
-            frame_num++;
-            int pitch = in_pkt->buf->size / g_height;
-            if (! (cfhd->push(in_pkt->buf->data, pitch, frame_num, in_pkt->pts, in_pkt->duration) &&
-                   write_cfhd_sample()))
-                return false;
-        }
-        // remux other streams
-        else if (! b_video_only)
-            if ((ret = av_write_frame(ofmt_ctx, in_pkt)) < 0)
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
             {
-                av_log(nullptr, AV_LOG_ERROR,
-                       "encode: av_write_frame failed for stream #0:%u:\n%s\n",
-                       in_pkt->stream_index, av_err2str(ret));
-                return false;
+                int count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+                int *passed = (int*)CMSG_DATA(cmsg);
+                for (int k = 0; k < count; k++)
+                    fds.push_back(passed[k]);
             }
-        av_packet_unref(in_pkt);
+        buffer.append(data, n);
+
+        size_t end;
+        while ((end = buffer.find('\n')) != std::string::npos)
+        {
+            std::string line = buffer.substr(0, end);
+            Fields fields;
+            Lists lists;
+            buffer.erase(0, end + 1);
+            if (line.find_first_not_of(" \t\r") == std::string::npos)
+                continue;
+            std::string reply = parse_request(line, fields, lists) ?
+                                handle(client, fields, lists, fds) : json_error("bad request");
+            if (! reply.empty() && ! client->send(reply))
+                break;
+        }
     }
-    return true;
+
+    // frames that never reached their end fail their jobs
+    for (std::shared_ptr<CFHD_JobState> &state : client->feeding)
+        state->frames_in->abort();
+    for (int passed : fds)
+        ::close(passed);
+    std::lock_guard<std::mutex> lock(mutex);
+    clients.erase(client);
+    cv.notify_all();
 }
 
 
-void CFHD_Transcoder::process(CliOptions *cliopt)
+void CFHD_JobServer::run()
 {
-    int ret;
-    const AVPixFmtDescriptor *input_desc;
-    bool input_is_8_bit = false;
-    bool input_is_rgb = false;
-
-    input_desc = av_pix_fmt_desc_get((AVPixelFormat)input->codecpar->format);
-    if (input_desc->comp[0].depth == 8)
-        input_is_8_bit = true;
-    if (input_desc->flags & AV_PIX_FMT_FLAG_RGB)
-        input_is_rgb = true;
-    
-    cfhd = new CFHD_Encoder(input_is_8_bit, cliopt->b_rgb, cliopt->quality,
-                            cliopt->trc, cliopt->threads);
-    if (! cfhd->start())
-        throw 4;
+    struct sockaddr_un addr;
 
-    // codec_id will be set to a codec if we need to decode; otherwise, it is set to NONE.
-    if (dec_ctx->codec_id == AV_CODEC_ID_NONE)
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
     {
-        if (! encode())
-            throw 4;
+        av_log(nullptr, AV_LOG_ERROR, "Socket path '%s' is too long\n", path.c_str());
+        throw 1;
     }
-    else
+    strcpy(addr.sun_path, path.c_str());
+    // a socket left by a server that died
+    unlink(path.c_str());
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0)
     {
-        AVPixelFormat new_pix_fmt = AV_PIX_FMT_NONE;
-        in_frame = av_frame_alloc();
-        out_frame = av_frame_alloc();
-        if (!(in_frame && out_frame))
-        {
-            av_log(nullptr, AV_LOG_ERROR, "process: frame allocation failed\n");
-            throw 4;
-        }
+        av_log(nullptr, AV_LOG_ERROR, "Failed to listen on '%s': %s\n", path.c_str(),
+               strerror(errno));
+        throw 1;
+    }
 
-        if (cliopt->b_rgb)
-            new_pix_fmt = AV_PIX_FMT_RGB48LE;
-        else if (input_is_8_bit)
-            new_pix_fmt = AV_PIX_FMT_YUYV422;
-        else
-        {
-            if ((AVPixelFormat)input->codecpar->format != AV_PIX_FMT_YUV422P10LE)
-                new_pix_fmt = AV_PIX_FMT_YUV422P10LE;
-            if (! init_v210_encoder())
-                throw 4;
-        }
+    scheduler->b_fixed_share = true;
+    scheduler->start();
+    av_log(nullptr, AV_LOG_INFO, "Serving jobs on '%s', %d at a time\n", path.c_str(),
+           scheduler->parallel);
 
-        if (new_pix_fmt != AV_PIX_FMT_NONE)
+    signal(SIGINT, handle_quit);
+    signal(SIGTERM, handle_quit);
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    while (! b_quit)
+    {
+        if (poll(&pfd, 1, 1000) <= 0)
+            continue;
+        int client_fd = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client_fd < 0)
+            continue;
+        std::shared_ptr<Client> client = std::make_shared<Client>(client_fd);
         {
-            out_frame->width = g_width;
-            out_frame->height = g_height;
-            out_frame->format = new_pix_fmt;
-            if ((ret = av_frame_get_buffer(out_frame, 0)) < 0)
-            {
-                av_log(nullptr, AV_LOG_ERROR,
-                       "process: av_frame_get_buffer failed:\n%s\n", av_err2str(ret));
-                throw 4;
-            }
-            // test if we are converting YUV->RGB or RGB->YUV, set scaler flags accordingly
-            bool accurate = false;
-            if (input_is_rgb != cliopt->b_rgb)
-                accurate = true;
-            if (! init_scaler(new_pix_fmt, accurate, cliopt->trc))
-                throw 4;
+            std::lock_guard<std::mutex> lock(mutex);
+            clients.insert(client);
         }
-
-        if (! transcode())
-            throw 4;
+        std::thread(&CFHD_JobServer::serve, this, client).detach();
     }
 
-    // flush the encoder
-    while (cfhd->queued)
-        if (! (cfhd->pop() && write_cfhd_sample()))
-            throw 4;
-
-    av_log(nullptr, AV_LOG_INFO, "\n");
-    if ((ret = av_write_trailer(ofmt_ctx)) < 0)
+    // queued jobs are dropped, and those under way finish
+    av_log(nullptr, AV_LOG_INFO, "Stopping after the encodes in progress\n");
     {
-        av_log(nullptr, AV_LOG_ERROR,
-               "process: av_write_trailer failed:\n%s\n", av_err2str(ret));
-        throw 4;
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const std::shared_ptr<Client> &client : clients)
+            shutdown(client->fd, SHUT_RD);
     }
+    scheduler->close(true);
+    scheduler->wait();
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this] { return clients.empty(); });
 }
 
 
@@ -1249,20 +9642,31 @@ int main(int argc, char **argv)
 
         show_banner();
 
-        CFHD_Transcoder tc(cliopt.b_video_only);
-        tc.open_input(&cliopt);
-        tc.open_output(&cliopt);
-
-        auto start = std::chrono::high_resolution_clock::now();
-        tc.process(&cliopt);
-        auto stop = std::chrono::high_resolution_clock::now();
+        // one pool serves every stage of every job in the process, out of the thread budget
+        CFHD_TaskPool taskpool(cliopt.threads > 0 ? cliopt.threads : default_threads());
 
-        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - start);
-        float seconds = (float)duration.count() / 1000;
-        float fps = (float)tc.cfhd->sample.frame_num / seconds;
-
-        av_log(nullptr, AV_LOG_INFO, "Encoded %d frames in %1.2f seconds (%1.2f fps)\n",
-               tc.cfhd->sample.frame_num, seconds, fps);
+        if (cliopt.b_kernel_bench)
+            bench_kernels(cliopt.video_width, cliopt.video_height);
+        else if (cliopt.jobs)
+        {
+            CFHD_JobScheduler scheduler(&cliopt, &taskpool);
+            scheduler.load(cliopt.jobs);
+            if (! scheduler.run())
+                throw 4;
+        }
+        else if (! cliopt.watch.empty())
+        {
+            CFHD_JobScheduler scheduler(&cliopt, &taskpool);
+            CFHD_WatchFolder watcher(&cliopt, &scheduler);
+            watcher.run();
+        }
+        else if (cliopt.serve)
+        {
+            CFHD_JobScheduler scheduler(&cliopt, &taskpool);
+            CFHD_JobServer server(&cliopt, &scheduler);
+            server.run();
+        }
+        else run(&cliopt, &taskpool);
     }
     catch (int e)
     {